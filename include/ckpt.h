@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// asynchronous checkpoints of a fixed size buffer of doubles. the caller copies a snapshot into a
+// staging buffer and goes on, a background thread writes it to a temporary file, fsyncs it and renames
+// it over path, so the file on disk is always a whole snapshot. there are two staging buffers: while
+// one is being written the next snapshot goes into the other, and a snapshot that was not picked up
+// yet is replaced by the newer one. every file carries the fingerprint the caller opened it with, a
+// hash of the layout of the doubles, so a reader with another layout of the same size is refused
+struct ckpt;
+typedef struct ckpt ckpt_t;
+
+ckpt_t *ckpt_open(const char *path, size_t n, uint64_t fingerprint);
+// waits for the pending snapshot, stops the writer and returns how many writes failed
+int ckpt_close(ckpt_t *c);
+
+// the staging buffer of the next snapshot, fill its n doubles then call ckpt_commit
+double *ckpt_stage(ckpt_t *c);
+void ckpt_commit(ckpt_t *c, size_t step);
+// blocks until every committed snapshot is on disk, returns how many were written
+size_t ckpt_wait(ckpt_t *c);
+
+// reads a checkpoint of exactly n doubles, returns 0 on success and -1 when the file is missing, of
+// another size or of another fingerprint
+int ckpt_read(const char *path, double *x, size_t n, uint64_t fingerprint, size_t *step);
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "ckpt.h"
+#include "dist.h"
 #include "mat.h"
+#include "mem.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -11,6 +14,9 @@ enum layer_kind {
   MAX_POOL,
   AVG_POOL,
   FLATTEN,
+  SEPARABLE_CONV2D,
+  BATCH_NORM,
+  GLOBAL_AVG_POOL,
 };
 
 typedef enum {
@@ -18,12 +24,43 @@ typedef enum {
   SOFTMAX,
   RELU,
   TANH,
+  LINEAR, // the identity, left on the layer a BATCH_NORM follows
 } ActFun;
 
+typedef enum {
+  SGD,
+  MOMENTUM,
+  NESTEROV,
+  ADAM,
+} OptKind;
+
+typedef struct {
+  OptKind kind;
+  double momentum;          // MOMENTUM and NESTEROV
+  double beta1, beta2, eps; // ADAM
+  size_t t;                 // steps taken
+} Optimizer;
+
+// int8 weights, one row per output channel, plus the calibrated scale of the layer input
+typedef struct {
+  QMat2D ws;
+  float in_scale;
+} QLayer;
+
 typedef struct {
   Mat2D ws;
   double bias;
   Mat2D a;
+  QLayer *q;
+  HMat2D *h;        // ws^T in 16 bits, set by nn_half_weights
+  CSRMat2D *sparse; // nonzeros of ws^T, set by nn_prune when it moves fewer bytes than ws
+  uint8_t *mask;    // 1 for the weights nn_prune kept, laid out like ws, NULL once nothing is pruned
+  size_t *nonzero;  // ws.rows, the nonzero inputs dense_forward gathers, one per network or context
+  int8_t *qx;       // ws.rows, the input of the int8 path, like nonzero
+  // optimizer state, allocated by nn_compile when the optimizer needs it
+  Mat2D m, v;
+  double bias_m, bias_v;
+  Mat2D shift; // one per unit, added after the bias, set when nn_freeze folds a BATCH_NORM into the layer
 } DenseLayer;
 
 typedef struct {
@@ -41,52 +78,287 @@ typedef struct {
   Mat2D *kernels;
   Mat2D *a;
   double *bias;
+  QLayer *q;
+  HMat2D *h; // one row per kernel, set by nn_half_weights
 } Conv2dLayer;
 
+// a k x k depthwise convolution of every input channel on its own, then a 1 x 1 pointwise convolution
+// that mixes the channels into kernel_count planes, the activation follows the pointwise step
+typedef struct {
+  size_t kernel_count;
+  size_t channels;
+  size_t kernel_size;
+  int padding;
+  int stride;
+  double *params;  // every weight in one block, the views below point into it
+  Mat2D depthwise; // channels x kernel_size², one kernel per row
+  Mat2D pointwise; // kernel_count x channels
+  double *bias;    // kernel_count
+  double *m, *v;   // optimizer state of params, allocated by nn_compile when the optimizer needs it
+  Mat2D dw;        // channels x pixels, the depthwise output
+  Mat2D *a;
+} SeparableConvLayer;
+
+// what nn_fit has gathered of the batch it is on, the forward and backward passes of a BATCH_NORM follow it
+enum bn_stage {
+  BN_RUNNING,    // outside nn_fit: the running statistics, constants of the forward pass
+  BN_BATCH,      // the mean and var of the batch
+  BN_BATCH_GRAD, // and the means of delta and delta x̂ over the batch, that flow back through them
+};
+
+// gamma (x - mean) / sqrt(var + eps) + beta on every unit of a dense output or every channel of a conv
+// output, then the activation the previous layer had, which is left LINEAR. nn_fit normalizes with the
+// mean and var of each batch, over its rows and the pixels of a plane, and backprops through them too.
+// the running statistics follow the batch ones and are what inference and nn_freeze use
+typedef struct {
+  size_t features;     // units or channels
+  size_t channels;     // 0 after a dense layer, the output is a single column
+  double *params;      // gamma then beta, the views below point into it
+  double *gamma, *beta;
+  double *mean, *var;  // running statistics
+  double *batch;       // mean, var, mean of delta and of delta x̂ of nn_fit's batch, after var in one block
+  enum bn_stage stage;
+  double seen;         // batches averaged so far, the first ones weigh more than momentum
+  double momentum, eps;
+  double *m, *v;       // optimizer state of params, allocated by nn_compile when the optimizer needs it
+  Mat2D *a;            // channels planes, or the column
+} BatchNormLayer;
+
 typedef struct {
   Mat2D *a;
   size_t channels;
   size_t pool_size;
+  size_t stride; // pool_size unless the windows overlap or leave gaps
 } PoolingLayer;
 
+// the mean of every input plane, a column of one value per channel that a DENSE layer can read
+// directly, in place of a FLATTEN of the whole planes
+typedef struct {
+  size_t channels;
+  Mat2D a;
+} GlobalPoolLayer;
+
 typedef struct {
   Mat2D a;
+  Mat2D view;  // the input planes seen as the column, when nn_forward finds them contiguous
+  int viewed;  // the output is view, nothing was copied into a
 } FlattenLayer;
 
+// set by the fusion pass of nn_compile, RECOMPUTED by nn_set_activation_budget
+enum fusion_flags {
+  FUSED = 1 << 0,       // computed by the previous layer, nn_forward skips it
+  OUTPUT_VIEW = 1 << 1, // the output planes are views into the next layer's FLATTEN buffer
+  RECOMPUTED = 1 << 2,  // the output is a view into a buffer shared with other layers, backprop recomputes it
+};
+
+enum kernel_algo {
+  ALGO_DEFAULT,     // dense: transpose then gemv, conv2d: direct
+  ALGO_DENSE_AXPY,  // Mat2D_T_col_mul over tiles of outputs
+  ALGO_CONV_IM2COL, // im2col then one gemm against every kernel
+};
+
+// the kernel nn_forward runs for a DENSE or CONV2D layer on double weights, set by nn_autotune
+typedef struct {
+  enum kernel_algo algo;
+  int tile;    // outputs per task of ALGO_DENSE_AXPY
+  int threads; // 0 keeps the OpenMP default
+} KernelChoice;
+
 typedef struct {
   enum layer_kind kind;
   ActFun act;
+  unsigned fusion;
+  KernelChoice kc;
   union {
     DenseLayer dl;
     InputLayer il;
     Conv2dLayer cl;
     PoolingLayer pl;
     FlattenLayer fl;
+    SeparableConvLayer sl;
+    BatchNormLayer bn;
+    GlobalPoolLayer gp;
   };
 } layer_t;
 
+enum nn_phase {
+  PHASE_FORWARD,
+  PHASE_BACKWARD,
+  PHASE_COUNT,
+};
+
+// flops and bytes are per call, estimated from the compiled shapes
+typedef struct {
+  double time;
+  size_t calls;
+  double flops;
+  double bytes;
+} LayerProfile;
+
+// numa policy of the execution layer, all off when zero initialized
 typedef struct {
+  int pin;         // pin the OpenMP threads node by node, see topo_pin_threads
+  int first_touch; // nn_compile zeroes the weights from the threads that read them, so the pages land on their nodes
+  int replicate;   // nn_evaluate runs every thread on the replica of the weights kept for its node
+} NumaPolicy;
+
+typedef struct nn {
   size_t layer_count;
   size_t capacity;
   layer_t *layers;
+  LayerProfile (*prof)[PHASE_COUNT]; // one row per layer, NULL when profiling is disabled
+  int shared_weights;                // a context, the weights belong to another nn_t
+  Optimizer opt;                     // SGD when zero initialized
+  double *recompute;                 // the outputs of one segment of RECOMPUTED layers at a time
+  double *arena;                     // inference plan, every layer output lives here
+  dist_t *dist;                      // data parallel training, nn_fit sums the gradients of every rank
+  NumaPolicy numa;
+  int replica;                       // a context with its own copy of the double weights
+  struct nn *replicas;               // one per numa node with numa.replicate, nn_evaluate runs on them
+  int replica_nodes;
+  int autotune;                      // nn_compile runs nn_autotune
+  const char *tune_cache;
+  ckpt_t *ckpt;                      // background checkpoint writer, owned by the network
+  size_t ckpt_every;                 // nn_fit checkpoints every ckpt_every steps, 0 for never
 } nn_t;
 
+typedef struct {
+  double loss;       // mean cross entropy with a SOFTMAX output, mean squared error otherwise
+  double accuracy;   // argmax of the output against argmax of the label
+  size_t classes;
+  size_t *confusion; // classes x classes, rows are the labels and columns the predictions
+} nn_metrics_t;
+
+typedef struct {
+  size_t samples;
+  double seconds;
+  double throughput; // samples per second
+  double loss;       // mean loss of the samples before their own update, same as nn_metrics_t
+} nn_train_stats_t;
+
 nn_t new_nn(size_t height, size_t width, size_t channels);
 void nn_add_dense_layer(nn_t *nn, size_t size, ActFun act);
 void nn_add_avg_pooling_layer(nn_t *nn, size_t pool_size);
 void nn_add_flatten_layer(nn_t *nn);
 void nn_add_max_pooling_layer(nn_t *nn, size_t pool_size);
 void nn_add_avg_pooling_layer(nn_t *nn, size_t pool_size);
+// kind is MAX_POOL or AVG_POOL, a conv is only fused with the pooling after it when stride is pool_size
+void nn_add_strided_pooling_layer(nn_t *nn, enum layer_kind kind, size_t pool_size, size_t stride);
+void nn_add_global_avg_pooling_layer(nn_t *nn);
 
 // channels = previous layer's output depth
 void nn_add_conv2d_layer(nn_t *nn, size_t kernel_count, size_t kernel_size, size_t channels, int padding, int stride, ActFun act);
+// channels x k² + kernel_count x channels weights instead of kernel_count x channels x k², trainable by nn_fit
+void nn_add_depthwise_separable_conv_layer(nn_t *nn, size_t kernel_count, size_t kernel_size, size_t channels, int padding, int stride, ActFun act);
+// normalizes the output of the last layer, a DENSE, CONV2D or SEPARABLE_CONV2D, before its activation
+void nn_add_batch_norm_layer(nn_t *nn);
 
 void nn_forward(nn_t *nn, const Mat2D *input, size_t channels);
+// views channels x height x width doubles as the input of nn_forward, x must have room for one Mat2D
+// per input channel. returns the channels to pass along
+size_t nn_input_view(const nn_t *nn, const double *row, Mat2D *x);
 void nn_destroy(nn_t *nn);
 void nn_init_random(nn_t *nn, const double min, const double max);
 void nn_init_zero(nn_t *nn);
-nn_t nn_backprop(const nn_t *nn, const Mat2D *y);
+nn_t nn_backprop(nn_t *nn, const Mat2D *y);
 const Mat2D *nn_layer_output(const layer_t *l);
 const Mat2D *nn_output(const nn_t *nn);
 void nn_fit(nn_t *nn, const Mat2D *train_data, const Mat2D *labels, size_t batch_size, double lr);
+// copies the weights and the optimizer state of rank 0 to every rank, then each rank runs nn_fit on its dist_shard.
+// the batch of a step is batch_size rows of every rank
+void nn_set_dist(nn_t *nn, dist_t *dist);
+// one epoch of Hogwild sgd: every thread runs its own samples on a context and writes each step
+// straight into the shared weights, without locks and without waiting for the other threads.
+// the rows of a weight matrix whose input is zero have no gradient and are not touched, so sparse
+// inputs rarely collide. plain SGD only, 0 threads uses omp_get_max_threads
+nn_train_stats_t nn_fit_hogwild(nn_t *nn, const Mat2D *train_data, const Mat2D *labels, double lr, int threads);
+
+// the usual hyperparameters for each kind, set it before nn_compile so the state is allocated with the weights.
+// setting it again starts over, the moments of the previous optimizer are dropped
+Optimizer nn_optimizer(OptKind kind);
+void nn_set_optimizer(nn_t *nn, Optimizer opt);
 void nn_compile(nn_t *nn);
+// folds every BATCH_NORM into the weights and bias of the layer before it and removes it, the network
+// computes the same thing without the normalization pass. call it once the weights are trained or loaded,
+// on a training or an inference compile, before nn_quantize, nn_half_weights, nn_prune and any context
+void nn_freeze(nn_t *nn);
+// nn_compile for inference only: a layer output is dead once the next layer has read it, so the outputs
+// alternate between the two ends of one arena sized to the largest pair of consecutive outputs. only the
+// network output is valid after nn_forward, there is nothing to backprop or quantize from.
+// contexts of the network get their own arena
+void nn_compile_inference(nn_t *nn);
+
+// times the candidate kernels of every DENSE and CONV2D layer on scratch data of its shape and keeps the
+// fastest in its KernelChoice. the winners are appended to cache_path (NULL for none) keyed by cpu model,
+// thread count and shape, later runs read them back instead of timing. returns how many layers were timed.
+// the int8 and 16 bit paths are not tuned, they win over the choice
+size_t nn_autotune(nn_t *nn, const char *cache_path);
+// set it before nn_compile
+void nn_set_autotune(nn_t *nn, const char *cache_path);
+
+// writes a standalone C file with the double weights embedded and a forward pass whose loop bounds are
+// all constants, for the compiler to unroll and vectorize. it defines void cnn_forward(const double *in,
+// double *out) on one row of the data nn_fit takes, static buffers make it not reentrant. nn_freeze first
+// to emit the BATCH_NORM layers folded. returns 0 on success and -1 when path cannot be written
+int nn_emit_c(const nn_t *nn, const char *path);
+
+// nn_fit checkpoints the weights and the optimizer state every `every` steps (0 for only nn_checkpoint),
+// the training thread only pays the copy into a staging buffer, see ckpt.h. set it after nn_compile and
+// after dist_fork, only rank 0 writes. NULL path stops it
+void nn_set_checkpoint(nn_t *nn, const char *path, size_t every);
+void nn_checkpoint(nn_t *nn);
+// blocks until the committed checkpoints are on disk, returns how many were written
+size_t nn_checkpoint_wait(nn_t *nn);
+// weights, optimizer state and step count from a checkpoint of the same network and optimizer,
+// returns 0 on success and -1 when path is missing or was written by another optimizer or a layer of
+// another kind, activation or shape. pruned layers keep their mask, quantized or 16 bit copies must be
+// dropped first
+int nn_load_checkpoint(nn_t *nn, const char *path);
+
+// gradient checkpointing for training a dense network: keeps the output of every k-th layer and of the
+// output layer, with the smallest k that fits the bytes. the k - 1 layers in between share one buffer
+// with the other segments and backprop replays each segment once from the kept layer below it, one
+// extra forward pass in total. 0 keeps every output. returns the activation bytes of the plan
+size_t nn_set_activation_budget(nn_t *nn, size_t bytes);
+
+// a context shares the weights of nn and has its own activations, so each thread can run
+// nn_forward on its own context. dense biases are copied, destroy it with nn_destroy
+nn_t nn_new_context(const nn_t *nn);
+// a context for inference with its own copy of the DENSE and CONV2D double weights, placed on the
+// node of the calling thread. the int8, 16 bit and CSR copies are still shared
+nn_t nn_new_replica(const nn_t *nn);
+// set it before nn_compile, pinning happens right away. with replicate the network keeps one replica
+// per node from nn_compile (or from here when it is compiled already) until nn_destroy, nn_evaluate
+// copies the current weights into them once per call
+void nn_set_numa(nn_t *nn, NumaPolicy policy);
+
+// batched inference over every row of data, spread across all the threads
+void nn_evaluate(const nn_t *nn, const Mat2D *data, const Mat2D *labels, nn_metrics_t *metrics);
+void nn_destroy_metrics(nn_metrics_t *metrics);
+
+// profiling, enable it after nn_compile (and after nn_quantize, the costs depend on the weights format).
+// nn_forward and nn_backprop add to the counters atomically, contexts from nn_new_context are not profiled
+void nn_enable_profiling(nn_t *nn);
+void nn_disable_profiling(nn_t *nn);
+void nn_reset_profile(nn_t *nn);
+const LayerProfile *nn_profile(const nn_t *nn, size_t layer, enum nn_phase phase);
+void nn_print_profile(const nn_t *nn);
+
+// bytes a compiled network needs per kind, gradients are what one training step allocates
+void nn_memory_footprint(const nn_t *nn, size_t bytes[MEM_KIND_COUNT]);
+
+// post-training int8 quantization of the DENSE and CONV2D layers, each row of samples is a calibration input.
+// returns the max absolute difference between the fp and the int8 outputs over the samples
+double nn_quantize(nn_t *nn, const Mat2D *samples);
+void nn_dequantize(nn_t *nn);
+
+// inference copies of the DENSE and CONV2D weights in fp16 or bf16, nn_forward uses them
+// (int8 weights still win) and accumulates in fp32. the double weights are kept, nn_full_weights (and
+// nn_dequantize for int8) drops the copies so nn_fit can train them again
+void nn_half_weights(nn_t *nn, enum half_format format);
+void nn_full_weights(nn_t *nn);
+
+// magnitude pruning of the DENSE layers to the given fraction of zero weights, every pruned layer keeps a
+// mask that nn_fit applies after each step so pruned weights stay 0 when training. the layers that end up
+// sparse enough run nn_forward on CSR weights. returns the zero weights
+size_t nn_prune(nn_t *nn, double sparsity);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "mat.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// data parallel training across local processes. dist_fork starts them and dist_allreduce sums a
+// buffer over every rank, each element is summed in a fixed order and every rank copies the same
+// result, so the ranks stay bit identical and runs are reproducible
+enum dist_transport {
+  DIST_SHM,    // POSIX shared memory, every rank reduces a slice of the buffers
+  DIST_SOCKET, // ring over unix sockets, a stand-in for a network
+};
+
+struct dist_shared;
+
+typedef struct {
+  int rank;
+  int size;
+  enum dist_transport transport;
+  size_t chunk;               // doubles reduced at once
+  struct dist_shared *shared; // barrier, slots and result, mapped by every rank
+  double *slots;              // size x chunk, rank r writes row r
+  double *sum;                // chunk
+  double *recv;               // chunk, private receive buffer of the ring
+  int next, prev;             // ring sockets
+  pid_t *children;            // rank 0 only
+} dist_t;
+
+// call it before any OpenMP region, forked children cannot reuse the parent's thread pool.
+// every process returns with its own rank
+dist_t dist_fork(int size, size_t chunk, enum dist_transport transport);
+// exits on every rank but 0, which waits for the others and returns how many failed
+int dist_finalize(dist_t *d);
+
+void dist_barrier(dist_t *d);
+void dist_allreduce(dist_t *d, double *x, size_t n);
+// x of rank 0 to every rank
+void dist_broadcast(dist_t *d, double *x, size_t n);
+
+// the rows of data this rank trains on, every rank gets the same count
+Mat2D dist_shard(const dist_t *d, const Mat2D *data);
@@ -1,12 +1,20 @@
 #pragma once
 
+#include "mem.h"
 #include <stddef.h>
+#include <stdint.h>
 
 #define MAT2D_GET(mat, i, j) mat.elems[(i) * mat.cols + (j)]
 
+#define MAT_MAX_DIMS 4
+
+// a strided view: element (i0, i1, ...) is elems[offset + i0 * strides[0] + i1 * strides[1] + ...].
+// views never own elems, slicing, selecting and reshaping one only changes the metadata
 typedef struct mat {
-  size_t *dims;
+  size_t dims[MAT_MAX_DIMS];
+  size_t strides[MAT_MAX_DIMS]; // in elements
   size_t dim_count;
+  size_t offset;
   double *elems;
 } mat_t;
 
@@ -16,11 +24,46 @@ typedef struct {
   double *elems;
 } Mat2D;
 
+// int8 matrix with a symmetric scale per row: value(i, j) = elems[i][j] * scales[i]
+typedef struct {
+  size_t cols;
+  size_t rows;
+  int8_t *elems;
+  float *scales;
+} QMat2D;
+
+enum half_format {
+  HALF_FP16,
+  HALF_BF16,
+};
+
+// 16 bit floats, widened to fp32 in registers and accumulated in fp32
+typedef struct {
+  size_t cols;
+  size_t rows;
+  enum half_format format;
+  uint16_t *elems;
+} HMat2D;
+
+// compressed sparse rows, the nonzeros of row i are vals[row_ptr[i] .. row_ptr[i + 1])
+typedef struct {
+  size_t cols;
+  size_t rows;
+  size_t nnz;
+  double *vals;
+  uint32_t *col_idx;
+  size_t *row_ptr;
+} CSRMat2D;
+
 void mul_Mat2D(const Mat2D *m1, const Mat2D *m2, Mat2D *out);
 void destroy_Mat2D(Mat2D *m);
 Mat2D new_Mat2D(const size_t rows, const size_t cols);
+Mat2D alloc_Mat2D(const size_t rows, const size_t cols, enum mem_kind kind);
 void random_init_Mat2D(Mat2D *m, const double min, const double max);
 void zero_init_Mat2D(Mat2D *m);
+// zero_init_Mat2D split by rows with the static schedule of the row parallel kernels, so each page is
+// first touched, and placed, by the thread that later reads it
+void first_touch_Mat2D(Mat2D *m);
 
 void add_scalar_Mat2D(Mat2D *m, const double s);
 void sum_Mat2D(Mat2D *m1, const Mat2D *m2);
@@ -32,5 +75,99 @@ void Mat2D_col_mul(const Mat2D *mat, const Mat2D *vec, Mat2D *out);
 void vec_Mat2D_mul(const Mat2D *vec, const Mat2D *mat, Mat2D *out);
 
 void convolution2D(const Mat2D *input, const Mat2D *kernel, int stride, int padding, Mat2D *out);
-void max_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size);
-void avg_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size);
+// pool_size x pool_size windows every stride pixels, they overlap when stride < pool_size
+void max_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size, size_t stride);
+void avg_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size, size_t stride);
+// the mean of every plane, one value per channel
+void global_avg_pooling2D(const Mat2D *planes, size_t channels, double *out);
+// convolution2D with a k_size x k_size kernel stored as one row, the window is clipped to the input once
+// per output pixel instead of testing every tap
+void depthwise_conv2D(const Mat2D *input, const double *kernel, size_t k_size, int stride, int padding, Mat2D *out);
+// accumulates the kernel gradient, and the input gradient unless grad_input is NULL
+void depthwise_conv2D_backward(const Mat2D *input, const double *kernel, size_t k_size, int stride, int padding,
+                               const Mat2D *grad_out, double *grad_kernel, Mat2D *grad_input);
+// 1x1 convolution, out[k] = sum over c of weights(k, c) * in row c + bias[k], in has one plane per row
+// and out one plane per row of weights
+void pointwise_conv2D(const Mat2D *weights, const Mat2D *in, const double *bias, Mat2D *out);
+// accumulate into grad_input, a max window routes its gradient to its first max
+void max_pooling2D_backward(const Mat2D *input, const Mat2D *grad_out, size_t pool_size, size_t stride, Mat2D *grad_input);
+void avg_pooling2D_backward(const Mat2D *grad_out, size_t pool_size, size_t stride, Mat2D *grad_input);
+
+QMat2D new_QMat2D(const size_t rows, const size_t cols);
+QMat2D alloc_QMat2D(const size_t rows, const size_t cols, enum mem_kind kind);
+void destroy_QMat2D(QMat2D *m);
+void quantize_rows_Mat2D(const Mat2D *m, QMat2D *q);
+void quantize_vec(const double *x, size_t n, float scale, int8_t *out);
+void QMat2D_col_mul(const QMat2D *mat, const int8_t *vec, float vec_scale, Mat2D *out);
+void QMat2D_mul_T(const QMat2D *m1, const QMat2D *m2, Mat2D *out);
+void quantize_im2col(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, float scale, QMat2D *out);
+
+HMat2D new_HMat2D(const size_t rows, const size_t cols, enum half_format format);
+HMat2D alloc_HMat2D(const size_t rows, const size_t cols, enum half_format format, enum mem_kind kind);
+void destroy_HMat2D(HMat2D *m);
+// rounds to nearest even, fp16 overflows to inf
+void half_Mat2D(const Mat2D *m, HMat2D *h);
+uint16_t to_half(double x, enum half_format format);
+float from_half(uint16_t h, enum half_format format);
+void HMat2D_col_mul(const HMat2D *mat, const Mat2D *vec, Mat2D *out);
+// out = mat * m^T, m is m_rows fp32 rows of mat->cols
+void HMat2D_mul_T(const HMat2D *mat, const float *m, size_t m_rows, Mat2D *out);
+// the patches seen by a k_rows x k_cols kernel as fp32 rows, laid out like quantize_im2col
+void im2col_f32(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, float *out);
+void im2col(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, double *out);
+// out = m1 * m2^T, both operands are read along their rows
+void mul_T_Mat2D(const Mat2D *m1, const Mat2D *m2, Mat2D *out);
+// out = mat^T * vec without the transpose: every tile of tile outputs is a task that adds one row of
+// mat per input, the sums run in the same order as Mat2D_col_mul on the transpose
+void Mat2D_T_col_mul(const Mat2D *mat, const Mat2D *vec, size_t tile, Mat2D *out);
+// the indices of the nonzero elements of vec in idx, returns how many there are
+size_t nonzero_rows(const Mat2D *vec, size_t *idx);
+// Mat2D_T_col_mul reading only the n rows of mat listed in idx, the inputs at the other rows must be 0
+void Mat2D_T_gather_col_mul(const Mat2D *mat, const Mat2D *vec, const size_t *idx, size_t n, Mat2D *out);
+
+// a packed row major view of elems
+mat_t mat_view(double *elems, size_t dim_count, const size_t *dims);
+// m as rows x cols
+mat_t mat_of_Mat2D(const Mat2D *m);
+// count planes of the same shape as a count x rows x cols view, returns -1 when the gap between two
+// consecutive planes is not always the same
+int mat_of_planes(const Mat2D *planes, size_t count, mat_t *out);
+size_t mat_size(const mat_t *m);
+double *mat_at(const mat_t *m, const size_t *idx);
+// the elements follow each other in row major order, with no gap
+int mat_is_contiguous(const mat_t *m);
+// [begin, end) along dim
+mat_t mat_slice(const mat_t *m, size_t dim, size_t begin, size_t end);
+// index i along dim, the view has one dimension less
+mat_t mat_select(const mat_t *m, size_t dim, size_t i);
+// the same elements with other dims, m must be contiguous
+mat_t mat_reshape(const mat_t *m, size_t dim_count, const size_t *dims);
+// a 2 dimensional contiguous view as the Mat2D the other kernels take, it shares the elements
+Mat2D mat_to_Mat2D(const mat_t *m);
+// gathers a strided view into dst, both of the same dims
+void mat_copy(const mat_t *src, const mat_t *dst);
+// the convolution and pooling kernels on a 2 dimensional view whose rows need not follow each other, a
+// slice of the columns of a wider plane goes in as it is. the columns of a row must be adjacent
+void mat_convolution2D(const mat_t *input, const Mat2D *kernel, int stride, int padding, Mat2D *out);
+void mat_max_pooling2D(const mat_t *input, Mat2D *out, size_t pool_size, size_t stride);
+void mat_avg_pooling2D(const mat_t *input, Mat2D *out, size_t pool_size, size_t stride);
+void mat_depthwise_conv2D(const mat_t *input, const double *kernel, size_t k_size, int stride, int padding, Mat2D *out);
+
+// zeroes the smallest |elems| so that at least sparsity of them are 0, returns the zero count
+size_t prune_Mat2D(Mat2D *m, double sparsity);
+// the nonzeros of m
+CSRMat2D new_CSRMat2D(const Mat2D *m);
+CSRMat2D alloc_CSRMat2D(const Mat2D *m, enum mem_kind kind);
+void destroy_CSRMat2D(CSRMat2D *m);
+// out = mat * m, m can have any number of columns
+void CSRMat2D_mul(const CSRMat2D *mat, const Mat2D *m, Mat2D *out);
+
+// fused optimizer updates, one pass over the weights, the gradients and the state.
+// g is scaled by scale first (1 / batch size)
+void sgd_step(double *w, const double *g, size_t n, double lr, double scale);
+void momentum_step(double *w, const double *g, double *v, size_t n, double lr, double scale, double mu, int nesterov);
+void adam_step(double *w, const double *g, double *m, double *v, size_t n, double lr, double scale, double beta1, double beta2, double eps, size_t t);
+
+// latency summaries, sorts x in place, then percentile takes p in [0, 100] by nearest rank
+void sort_doubles(double *x, size_t n);
+double percentile(const double *sorted, size_t n, double p);
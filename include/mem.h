@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+
+// every block is aligned to a cache line and its size rounded up to whole lines, so vector loads
+// never straddle two lines and the tail of a buffer never shares a line with another one
+#define MEM_ALIGN 64
+// blocks of at least one huge page are mapped on their own, aligned to it
+#define MEM_HUGE_PAGE (2UL << 20)
+
+enum mem_huge_pages {
+  MEM_HUGE_TRANSPARENT, // madvise the large blocks for transparent huge pages, the default
+  MEM_HUGE_EXPLICIT,    // MAP_HUGETLB from the reserved pool, transparent when it is empty
+  MEM_HUGE_OFF,         // large blocks come from the heap like the others
+};
+
+// every allocation of the library goes through mem_alloc and is accounted to a kind
+enum mem_kind {
+  MEM_WEIGHTS,
+  MEM_ACTIVATIONS,
+  MEM_GRADIENTS,
+  MEM_SCRATCH,
+  MEM_OTHER, // user matrices and bookkeeping
+  MEM_KIND_COUNT,
+};
+
+enum mem_phase {
+  MEM_PHASE_IDLE,
+  MEM_PHASE_FORWARD,
+  MEM_PHASE_BACKWARD,
+  MEM_PHASE_UPDATE,
+  MEM_PHASE_COUNT,
+};
+
+typedef struct {
+  size_t live[MEM_KIND_COUNT]; // bytes currently allocated
+  size_t peak;                 // max of the total live bytes
+  size_t phase_peak[MEM_PHASE_COUNT];
+  size_t allocs;
+  size_t frees;
+  size_t steps;                // training steps seen by mem_end_step
+  size_t last_step_allocs;
+  size_t max_step_allocs;
+  size_t mapped;               // bytes of the live blocks mapped on their own, headers and rounding included
+  size_t hugetlb;              // the part of mapped taken from the reserved huge pages
+} mem_stats_t;
+
+void *mem_alloc(size_t bytes, enum mem_kind kind);
+void *mem_calloc(size_t count, size_t size, enum mem_kind kind);
+void *mem_realloc(void *p, size_t bytes);
+void mem_free(void *p);
+
+// for the blocks allocated after the call, returns the previous mode
+enum mem_huge_pages mem_set_huge_pages(enum mem_huge_pages mode);
+
+// returns the previous phase so nested calls can restore it
+enum mem_phase mem_set_phase(enum mem_phase phase);
+void mem_end_step(void);
+
+mem_stats_t mem_stats(void);
+void mem_reset_peaks(void);
+void mem_print_stats(void);
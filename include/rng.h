@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// counter based random numbers: number i of a stream is philox4x32-10 of the counter (i, stream) under
+// the key seed, a pure function of the three. any thread can draw any number without shared state, so
+// a parallel fill gives the same result for every thread count and schedule
+typedef struct {
+  uint64_t seed;
+  uint64_t stream;
+} rng_t;
+
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+
+// a seed from random(), so srandom still picks the whole run
+uint64_t rng_seed(void);
+// uniform in [0, 1) with 53 random bits
+double rng_uniform(rng_t r, uint64_t i);
+// x[k] = number first + k of r scaled to [min, max), in parallel
+void rng_fill(rng_t r, uint64_t first, double *x, size_t n, double min, double max);
+// Fisher-Yates on idx with the numbers of r
+void rng_shuffle(rng_t r, size_t *idx, size_t n);
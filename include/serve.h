@@ -0,0 +1,38 @@
+#pragma once
+
+#include "cnn.h"
+#include <stddef.h>
+
+// inference over a unix domain socket. a client connects and sends requests of the network input size
+// in doubles, one row of the data nn_fit takes, and reads back the output in doubles, as many times as
+// it wants on the same connection. requests from every connection go into one queue: the first idle
+// worker waits until max_batch requests are queued, the oldest one has waited max_delay or every
+// connection is waiting for an answer. it takes at most max_batch of them and no more than its share of
+// the queue split over the idle workers, and runs them back to back on its own context of the network,
+// the other idle workers start on the rest at once
+typedef struct {
+  size_t max_batch;
+  double max_delay; // seconds
+  int workers;      // 0 for omp_get_max_threads, each runs nn_forward on one thread
+} serve_config_t;
+
+// latencies go from the whole request read to its output ready, over the last SERVE_LATENCY_WINDOW requests
+#define SERVE_LATENCY_WINDOW 4096
+
+typedef struct {
+  size_t requests;
+  size_t batches;
+  double mean_batch;
+  double p50, p99, max; // seconds
+  double throughput;    // requests per second since serve_open
+} serve_stats_t;
+
+struct serve;
+typedef struct serve serve_t;
+
+// listens on path, replacing a stale socket left there, and serves until serve_close. nn must outlive the
+// server and not change meanwhile. returns NULL when the socket cannot be bound
+serve_t *serve_open(const nn_t *nn, const char *path, serve_config_t config);
+void serve_stats(serve_t *s, serve_stats_t *stats);
+// drops the connections, finishes the queued requests and removes the socket
+void serve_close(serve_t *s);
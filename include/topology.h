@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// the numa nodes of the machine as linux reports them in sysfs, a single node when there is
+// nothing to read
+int topo_nodes(void);
+int topo_cpu_node(int cpu);
+// node of the cpu the calling thread runs on
+int topo_current_node(void);
+
+// pins each thread of an OpenMP team of the given size (0 = omp_get_max_threads) to one of the
+// allowed cpus, taken node by node so consecutive threads, and their static schedule chunks, share
+// a node. the threads stay pinned for the later regions of that size or smaller.
+// returns how many threads were pinned
+int topo_pin_threads(int threads);
+
+// asks the kernel to keep the whole pages of [p, p + bytes) on node, moving the ones already
+// placed elsewhere. only a hint, returns 0 when the kernel took it
+int topo_bind(void *p, size_t bytes, int node);
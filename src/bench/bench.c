@@ -0,0 +1,477 @@
+#include "cnn.h"
+#include "mat.h"
+#include <assert.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRAIN_IMGS "./data/train-images-idx3-ubyte"
+#define TRAIN_LBLS "./data/train-labels-idx1-ubyte"
+#define IMG_SIDE 28
+#define IMG_SIZE 784
+#define MNIST_SAMPLES 2000
+
+#define WARMUP 3
+#define MIN_RUNS 10
+#define MAX_RUNS 1000
+#define MIN_TIME 0.25 // seconds spent measuring each benchmark
+
+typedef struct {
+  char name[64];
+  char params[64];
+  int threads;
+  size_t runs;
+  double min, mean, p50, p90, p99; // seconds
+  double throughput;
+  const char *unit;
+} result_t;
+
+typedef void (*bench_fn)(void *arg);
+
+static result_t *results = NULL;
+static size_t result_count = 0;
+static size_t result_capacity = 0;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// times fn until both MIN_RUNS and MIN_TIME are reached, work is the amount of
+// `unit` done by a single call (flops, bytes, samples...) scaled by unit_scale
+static void bench(const char *name, const char *params, int threads, bench_fn fn, void *arg, double work, double unit_scale, const char *unit) {
+  double samples[MAX_RUNS];
+  size_t runs = 0;
+
+  omp_set_num_threads(threads);
+
+  for (int i = 0; i < WARMUP; ++i) fn(arg);
+
+  double start = now(), total = 0.0;
+  while (runs < MAX_RUNS && (runs < MIN_RUNS || now() - start < MIN_TIME)) {
+    double t = now();
+    fn(arg);
+    samples[runs] = now() - t;
+    total += samples[runs++];
+  }
+
+  sort_doubles(samples, runs);
+
+  if (result_count == result_capacity) {
+    result_capacity = result_capacity ? result_capacity * 2 : 32;
+    results = (result_t *) realloc(results, sizeof(result_t) * result_capacity);
+    assert(results != NULL && "not enough memory");
+  }
+
+  result_t *r = &results[result_count++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  snprintf(r->params, sizeof(r->params), "%s", params);
+  r->threads = threads;
+  r->runs = runs;
+  r->min = samples[0];
+  r->mean = total / runs;
+  r->p50 = percentile(samples, runs, 50);
+  r->p90 = percentile(samples, runs, 90);
+  r->p99 = percentile(samples, runs, 99);
+  r->throughput = work / r->p50 / unit_scale;
+  r->unit = unit;
+
+  fprintf(stderr, "%-20s %-22s t=%-3d p50 %10.3f us  p99 %10.3f us  %10.3f %s\n",
+          r->name, r->params, threads, r->p50 * 1e6, r->p99 * 1e6, r->throughput, unit);
+}
+
+// 1, 2, 4... up to the max and the max itself
+static int next_threads(int t) {
+  int max = omp_get_max_threads();
+  if (t >= max) return 0;
+  return t * 2 > max ? max : t * 2;
+}
+
+static void print_json(FILE *f, int max_threads) {
+  fprintf(f, "{\n  \"max_threads\": %d,\n  \"benchmarks\": [\n", max_threads);
+  for (size_t i = 0; i < result_count; ++i) {
+    result_t *r = &results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"params\": \"%s\", \"threads\": %d, \"runs\": %zu, "
+               "\"min_ns\": %.0f, \"mean_ns\": %.0f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, "
+               "\"throughput\": %.6g, \"unit\": \"%s\"}%s\n",
+            r->name, r->params, r->threads, r->runs,
+            r->min * 1e9, r->mean * 1e9, r->p50 * 1e9, r->p90 * 1e9, r->p99 * 1e9,
+            r->throughput, r->unit, i + 1 < result_count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+// ------- kernels -------
+
+typedef struct {
+  Mat2D a, b, out;
+} mat_args;
+
+typedef struct {
+  QMat2D a;
+  QMat2D b;
+  int8_t *vec;
+  Mat2D out;
+} qmat_args;
+
+typedef struct {
+  HMat2D a;
+  Mat2D x, out;
+} half_args;
+
+typedef struct {
+  CSRMat2D a;
+  Mat2D x, out;
+} sparse_args;
+
+typedef struct {
+  Mat2D input, kernel, out;
+  int stride, padding;
+  size_t pool_size;
+} img_args;
+
+static void run_gemm(void *arg) { mat_args *a = arg; mul_Mat2D(&a->a, &a->b, &a->out); }
+static void run_gemv(void *arg) { mat_args *a = arg; Mat2D_col_mul(&a->a, &a->b, &a->out); }
+static void run_vec_mat(void *arg) { mat_args *a = arg; vec_Mat2D_mul(&a->a, &a->b, &a->out); }
+static void run_sum(void *arg) { mat_args *a = arg; sum_Mat2D(&a->a, &a->b); }
+static void run_add_scalar(void *arg) { mat_args *a = arg; add_scalar_Mat2D(&a->a, 1e-9); }
+static void run_transpose(void *arg) { mat_args *a = arg; Mat2D t = transpose_Mat2D(&a->a); destroy_Mat2D(&t); }
+static void run_qgemv(void *arg) { qmat_args *a = arg; QMat2D_col_mul(&a->a, a->vec, 1.0f, &a->out); }
+static void run_qgemm(void *arg) { qmat_args *a = arg; QMat2D_mul_T(&a->a, &a->b, &a->out); }
+static void run_hgemv(void *arg) { half_args *a = arg; HMat2D_col_mul(&a->a, &a->x, &a->out); }
+static void run_spmv(void *arg) { sparse_args *a = arg; CSRMat2D_mul(&a->a, &a->x, &a->out); }
+static void run_conv(void *arg) { img_args *a = arg; convolution2D(&a->input, &a->kernel, a->stride, a->padding, &a->out); }
+static void run_max_pool(void *arg) { img_args *a = arg; max_pooling2D(&a->input, &a->out, a->pool_size, a->pool_size); }
+static void run_avg_pool(void *arg) { img_args *a = arg; avg_pooling2D(&a->input, &a->out, a->pool_size, a->pool_size); }
+
+static void bench_gemm(size_t n) {
+  char params[64];
+  mat_args a = { new_Mat2D(n, n), new_Mat2D(n, n), new_Mat2D(n, n) };
+  random_init_Mat2D(&a.a, -1, 1);
+  random_init_Mat2D(&a.b, -1, 1);
+
+  snprintf(params, sizeof(params), "%zux%zux%zu", n, n, n);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("gemm", params, t, run_gemm, &a, 2.0 * n * n * n, 1e9, "GFLOP/s");
+  }
+
+  destroy_Mat2D(&a.a);
+  destroy_Mat2D(&a.b);
+  destroy_Mat2D(&a.out);
+}
+
+static void bench_gemv(size_t rows, size_t cols) {
+  char params[64];
+  const double bytes = sizeof(double) * (rows * cols + rows + cols);
+  mat_args mv = { new_Mat2D(rows, cols), new_Mat2D(cols, 1), new_Mat2D(rows, 1) };
+  mat_args vm = { new_Mat2D(1, rows), new_Mat2D(rows, cols), new_Mat2D(1, cols) };
+  random_init_Mat2D(&mv.a, -1, 1);
+  random_init_Mat2D(&mv.b, -1, 1);
+  random_init_Mat2D(&vm.a, -1, 1);
+  random_init_Mat2D(&vm.b, -1, 1);
+
+  snprintf(params, sizeof(params), "%zux%zu", rows, cols);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("gemv", params, t, run_gemv, &mv, bytes, 1e9, "GB/s");
+    bench("vec_mat", params, t, run_vec_mat, &vm, bytes, 1e9, "GB/s");
+  }
+
+  destroy_Mat2D(&mv.a);
+  destroy_Mat2D(&mv.b);
+  destroy_Mat2D(&mv.out);
+  destroy_Mat2D(&vm.a);
+  destroy_Mat2D(&vm.b);
+  destroy_Mat2D(&vm.out);
+}
+
+static void bench_int8(size_t rows, size_t cols, size_t batch) {
+  char params[64];
+  Mat2D m = new_Mat2D(rows, cols);
+  random_init_Mat2D(&m, -1, 1);
+
+  // gemm against a batch of `batch` quantized inputs
+  Mat2D inputs = { .cols = cols, .rows = batch, .elems = m.elems };
+  qmat_args a = { new_QMat2D(rows, cols), new_QMat2D(batch, cols), (int8_t *) malloc(cols), new_Mat2D(rows, 1) };
+  quantize_rows_Mat2D(&m, &a.a);
+  quantize_rows_Mat2D(&inputs, &a.b);
+  quantize_vec(m.elems, cols, 1.0f / 127, a.vec);
+
+  qmat_args g = a;
+  g.out = new_Mat2D(rows, batch);
+
+  snprintf(params, sizeof(params), "%zux%zu", rows, cols);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("int8_gemv", params, t, run_qgemv, &a, rows * cols + rows * sizeof(double) + cols, 1e9, "GB/s");
+  }
+
+  snprintf(params, sizeof(params), "%zux%zux%zu", rows, cols, batch);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("int8_gemm_t", params, t, run_qgemm, &g, 2.0 * rows * batch * cols, 1e9, "GOP/s");
+  }
+
+  destroy_Mat2D(&m);
+  destroy_QMat2D(&a.a);
+  destroy_QMat2D(&a.b);
+  destroy_Mat2D(&a.out);
+  destroy_Mat2D(&g.out);
+  free(a.vec);
+}
+
+static void bench_half(size_t rows, size_t cols) {
+  char params[64];
+  const double bytes = sizeof(uint16_t) * rows * cols + sizeof(double) * (rows + cols);
+  Mat2D m = new_Mat2D(rows, cols);
+  random_init_Mat2D(&m, -1, 1);
+
+  half_args fp16 = { new_HMat2D(rows, cols, HALF_FP16), new_Mat2D(cols, 1), new_Mat2D(rows, 1) };
+  half_args bf16 = { new_HMat2D(rows, cols, HALF_BF16), fp16.x, new_Mat2D(rows, 1) };
+  half_Mat2D(&m, &fp16.a);
+  half_Mat2D(&m, &bf16.a);
+  random_init_Mat2D(&fp16.x, -1, 1);
+
+  snprintf(params, sizeof(params), "%zux%zu", rows, cols);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("fp16_gemv", params, t, run_hgemv, &fp16, bytes, 1e9, "GB/s");
+    bench("bf16_gemv", params, t, run_hgemv, &bf16, bytes, 1e9, "GB/s");
+  }
+
+  destroy_Mat2D(&m);
+  destroy_HMat2D(&fp16.a);
+  destroy_HMat2D(&bf16.a);
+  destroy_Mat2D(&fp16.x);
+  destroy_Mat2D(&fp16.out);
+  destroy_Mat2D(&bf16.out);
+}
+
+// GB/s counts the bytes of the CSR arrays, compare the time against gemv of the same shape
+static void bench_sparse(size_t rows, size_t cols, double sparsity) {
+  char params[64];
+  Mat2D m = new_Mat2D(rows, cols);
+  random_init_Mat2D(&m, -1, 1);
+  prune_Mat2D(&m, sparsity);
+
+  sparse_args a = { new_CSRMat2D(&m), new_Mat2D(cols, 1), new_Mat2D(rows, 1) };
+  random_init_Mat2D(&a.x, -1, 1);
+  const double bytes = (sizeof(double) + sizeof(uint32_t)) * a.a.nnz + sizeof(size_t) * rows + sizeof(double) * (rows + cols);
+
+  snprintf(params, sizeof(params), "%zux%zu@%.2f", rows, cols, sparsity);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("csr_spmv", params, t, run_spmv, &a, bytes, 1e9, "GB/s");
+  }
+
+  destroy_Mat2D(&m);
+  destroy_CSRMat2D(&a.a);
+  destroy_Mat2D(&a.x);
+  destroy_Mat2D(&a.out);
+}
+
+static void bench_elementwise(size_t rows, size_t cols) {
+  char params[64];
+  mat_args a = { new_Mat2D(rows, cols), new_Mat2D(rows, cols), { 0 } };
+  zero_init_Mat2D(&a.a);
+  zero_init_Mat2D(&a.b);
+
+  snprintf(params, sizeof(params), "%zux%zu", rows, cols);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("sum", params, t, run_sum, &a, 3.0 * sizeof(double) * rows * cols, 1e9, "GB/s");
+    bench("add_scalar", params, t, run_add_scalar, &a, 2.0 * sizeof(double) * rows * cols, 1e9, "GB/s");
+    bench("transpose", params, t, run_transpose, &a, 2.0 * sizeof(double) * rows * cols, 1e9, "GB/s");
+  }
+
+  destroy_Mat2D(&a.a);
+  destroy_Mat2D(&a.b);
+}
+
+// the image kernels are single threaded, they are parallelised by the layers across channels
+static void bench_image(size_t side, size_t k, size_t pool_size) {
+  char params[64];
+  img_args a = { .input = new_Mat2D(side, side), .kernel = new_Mat2D(k, k), .out = new_Mat2D(side, side), .stride = 1, .padding = (int) k / 2 };
+  random_init_Mat2D(&a.input, -1, 1);
+  random_init_Mat2D(&a.kernel, -1, 1);
+  a.out.rows = (side - k + 2 * a.padding) + 1;
+  a.out.cols = a.out.rows;
+
+  snprintf(params, sizeof(params), "%zux%zu k%zu", side, side, k);
+  bench("conv2d", params, 1, run_conv, &a, 2.0 * a.out.rows * a.out.cols * k * k, 1e9, "GFLOP/s");
+
+  img_args p = { .input = a.input, .out = new_Mat2D(side / pool_size, side / pool_size), .pool_size = pool_size };
+  snprintf(params, sizeof(params), "%zux%zu p%zu", side, side, pool_size);
+  bench("max_pool2d", params, 1, run_max_pool, &p, sizeof(double) * (side * side + p.out.rows * p.out.cols), 1e9, "GB/s");
+  bench("avg_pool2d", params, 1, run_avg_pool, &p, sizeof(double) * (side * side + p.out.rows * p.out.cols), 1e9, "GB/s");
+
+  destroy_Mat2D(&a.input);
+  destroy_Mat2D(&a.kernel);
+  destroy_Mat2D(&a.out);
+  destroy_Mat2D(&p.out);
+}
+
+// ------- networks -------
+
+typedef struct {
+  nn_t *nn;
+  Mat2D *x;
+  size_t channels;
+  const Mat2D *data;
+  const Mat2D *labels;
+  size_t batch_size;
+} net_args;
+
+static void run_forward(void *arg) { net_args *a = arg; nn_forward(a->nn, a->x, a->channels); }
+
+static void run_batch(void *arg) {
+  net_args *a = arg;
+  for (size_t i = 0; i < a->data->rows; ++i) {
+    Mat2D x = { .cols = 1, .rows = a->data->cols, .elems = &a->data->elems[i * a->data->cols] };
+    nn_forward(a->nn, &x, 1);
+  }
+}
+
+static void run_fit(void *arg) {
+  net_args *a = arg;
+  nn_fit(a->nn, a->data, a->labels, a->batch_size, 0.01);
+}
+
+// dense layers with every activation, each includes the gemv producing the pre-activation
+static void bench_activations(size_t size) {
+  const ActFun acts[] = { SIGMOID, RELU, TANH, SOFTMAX };
+  const char *names[] = { "dense_sigmoid", "dense_relu", "dense_tanh", "dense_softmax" };
+  char params[64];
+
+  Mat2D x = new_Mat2D(size, 1);
+  random_init_Mat2D(&x, -1, 1);
+  snprintf(params, sizeof(params), "%zu->%zu", size, size);
+
+  for (size_t i = 0; i < sizeof(acts) / sizeof(acts[0]); ++i) {
+    nn_t nn = new_nn(size, 1, 1);
+    nn_add_dense_layer(&nn, size, acts[i]);
+    nn_compile(&nn);
+    nn_init_random(&nn, -1, 1);
+
+    net_args a = { .nn = &nn, .x = &x, .channels = 1 };
+    for (int t = 1; t; t = next_threads(t)) {
+      bench(names[i], params, t, run_forward, &a, 1, 1, "samples/s");
+    }
+    nn_destroy(&nn);
+  }
+
+  destroy_Mat2D(&x);
+}
+
+static int reverse_int(int i) {
+  return ((i & 0xFF) << 24) | ((i >> 8 & 0xFF) << 16) | ((i >> 16 & 0xFF) << 8) | (i >> 24 & 0xFF);
+}
+
+// reads the first rows of the MNIST training set, falls back to random data of the
+// same shape when the files are not there so the benchmark can always run
+static void mnist_data(Mat2D *imgs, Mat2D *labels, size_t rows) {
+  *imgs = new_Mat2D(rows, IMG_SIZE);
+  *labels = new_Mat2D(rows, 10);
+  zero_init_Mat2D(labels);
+
+  FILE *fi = fopen(TRAIN_IMGS, "rb");
+  FILE *fl = fopen(TRAIN_LBLS, "rb");
+  int header[4];
+
+  if (fi && fl && fread(header, sizeof(int), 4, fi) == 4 && reverse_int(header[1]) >= (int) rows
+      && fread(header, sizeof(int), 2, fl) == 2) {
+    for (size_t i = 0; i < rows; ++i) {
+      unsigned char px[IMG_SIZE], lbl;
+      if (fread(px, 1, IMG_SIZE, fi) != IMG_SIZE || fread(&lbl, 1, 1, fl) != 1) break;
+      for (size_t j = 0; j < IMG_SIZE; ++j) {
+        MAT2D_GET((*imgs), i, j) = px[j] / 255.0;
+      }
+      MAT2D_GET((*labels), i, lbl) = 1.0;
+    }
+  } else {
+    fprintf(stderr, "mnist images not found, using random data\n");
+    random_init_Mat2D(imgs, 0, 1);
+    for (size_t i = 0; i < rows; ++i) {
+      MAT2D_GET((*labels), i, random() % 10) = 1.0;
+    }
+  }
+
+  if (fi) fclose(fi);
+  if (fl) fclose(fl);
+}
+
+static void bench_mnist(void) {
+  Mat2D imgs, labels;
+  mnist_data(&imgs, &labels, MNIST_SAMPLES);
+
+  nn_t mlp = new_nn(IMG_SIZE, 1, 1);
+  nn_add_dense_layer(&mlp, 32, SIGMOID);
+  nn_add_dense_layer(&mlp, 16, SIGMOID);
+  nn_add_dense_layer(&mlp, 10, SOFTMAX);
+  nn_compile(&mlp);
+  nn_init_random(&mlp, -1, 1);
+
+  nn_t cnn = new_nn(IMG_SIDE, IMG_SIDE, 1);
+  nn_add_conv2d_layer(&cnn, 8, 3, 1, 0, 1, RELU);
+  nn_add_max_pooling_layer(&cnn, 2);
+  nn_add_conv2d_layer(&cnn, 8, 3, 8, 0, 1, RELU);
+  nn_add_max_pooling_layer(&cnn, 2);
+  nn_add_flatten_layer(&cnn);
+  nn_add_dense_layer(&cnn, 10, SOFTMAX);
+  nn_compile(&cnn);
+  nn_init_random(&cnn, -0.5, 0.5);
+
+  Mat2D x = { .cols = 1, .rows = IMG_SIZE, .elems = imgs.elems };
+  Mat2D img = { .cols = IMG_SIDE, .rows = IMG_SIDE, .elems = imgs.elems };
+  Mat2D batch = { .cols = IMG_SIZE, .rows = 256, .elems = imgs.elems };
+  Mat2D calib = { .cols = IMG_SIZE, .rows = 64, .elems = imgs.elems };
+
+  net_args mlp_args = { .nn = &mlp, .x = &x, .channels = 1, .data = &batch, .labels = &labels };
+  net_args cnn_args = { .nn = &cnn, .x = &img, .channels = 1 };
+  net_args fit_args = { .nn = &mlp, .data = &imgs, .labels = &labels, .batch_size = 32 };
+
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("mnist_mlp_forward", "784-32-16-10", t, run_forward, &mlp_args, 1, 1, "samples/s");
+    bench("mnist_mlp_batch", "256 samples", t, run_batch, &mlp_args, batch.rows, 1, "samples/s");
+    bench("mnist_cnn_forward", "c8-p2-c8-p2-d10", t, run_forward, &cnn_args, 1, 1, "samples/s");
+    bench("mnist_mlp_train", "2000 samples b32", t, run_fit, &fit_args, imgs.rows, 1, "samples/s");
+  }
+
+  nn_quantize(&mlp, &calib);
+  nn_quantize(&cnn, &calib);
+  for (int t = 1; t; t = next_threads(t)) {
+    bench("mnist_mlp_forward", "784-32-16-10 int8", t, run_forward, &mlp_args, 1, 1, "samples/s");
+    bench("mnist_cnn_forward", "c8-p2-c8-p2-d10 int8", t, run_forward, &cnn_args, 1, 1, "samples/s");
+  }
+
+  nn_destroy(&mlp);
+  nn_destroy(&cnn);
+  destroy_Mat2D(&imgs);
+  destroy_Mat2D(&labels);
+}
+
+// usage: bench [output.json], the JSON report goes to stdout by default
+int main(int argc, char **argv) {
+  const int max_threads = omp_get_max_threads();
+  srandom(42);
+
+  bench_gemm(256);
+  bench_gemv(2048, 2048);
+  bench_int8(2048, 2048, 64);
+  bench_half(2048, 2048);
+  bench_sparse(2048, 2048, 0.5);
+  bench_sparse(2048, 2048, 0.9);
+  bench_elementwise(1024, 1024);
+  bench_image(128, 3, 2);
+  bench_image(128, 5, 3);
+  bench_activations(1024);
+  bench_mnist();
+
+  omp_set_num_threads(max_threads);
+
+  FILE *out = argc > 1 ? fopen(argv[1], "w") : stdout;
+  assert(out != NULL && "could not open the output file");
+  print_json(out, max_threads);
+  if (out != stdout) fclose(out);
+
+  free(results);
+  return 0;
+}
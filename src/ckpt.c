@@ -0,0 +1,180 @@
+#include "ckpt.h"
+#include "mem.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CKPT_MAGIC 0x3254504b434e4e43ULL // "CNNCKPT2"
+
+struct ckpt {
+  char *path;
+  size_t n;
+  uint64_t fingerprint;
+  double *buf[2];
+  size_t step[2];
+  int writing; // buffer the thread writes, -1 for none
+  int pending; // committed buffer the thread has not picked up, -1 for none
+  int staged;  // buffer handed out by ckpt_stage
+  int stop;
+  size_t written;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+typedef struct {
+  uint64_t magic;
+  uint64_t n;
+  uint64_t fingerprint; // of what wrote the doubles, ckpt_read only takes the same one
+  uint64_t step;
+} ckpt_header_t;
+
+static int write_all(int fd, const void *p, size_t bytes) {
+  while (bytes > 0) {
+    ssize_t k = write(fd, p, bytes);
+    if (k <= 0) return -1;
+    p = (const char *) p + k;
+    bytes -= k;
+  }
+  return 0;
+}
+
+// the directory entry of the rename has to reach the disk too
+static int sync_dir(const char *path) {
+  char *copy = strdup(path);
+  if (copy == NULL) return -1;
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  free(copy);
+  if (fd == -1) return -1;
+
+  int err = fsync(fd);
+  close(fd);
+  return err;
+}
+
+static int write_file(const char *path, const double *x, size_t n, uint64_t fingerprint, size_t step) {
+  char tmp[strlen(path) + 5];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return -1;
+
+  const ckpt_header_t h = { .magic = CKPT_MAGIC, .n = n, .fingerprint = fingerprint, .step = step };
+  int err = write_all(fd, &h, sizeof(h)) || write_all(fd, x, sizeof(double) * n) || fsync(fd);
+  err = close(fd) || err;
+  if (err || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return sync_dir(path);
+}
+
+static void *writer(void *arg) {
+  ckpt_t *c = (ckpt_t *) arg;
+
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    while (c->pending == -1 && !c->stop) pthread_cond_wait(&c->cond, &c->lock);
+    if (c->pending == -1) break;
+
+    const int b = c->writing = c->pending;
+    c->pending = -1;
+    pthread_mutex_unlock(&c->lock);
+
+    const int err = write_file(c->path, c->buf[b], c->n, c->fingerprint, c->step[b]);
+
+    pthread_mutex_lock(&c->lock);
+    c->writing = -1;
+    c->written++;
+    c->failed += err != 0;
+    pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+ckpt_t *ckpt_open(const char *path, size_t n, uint64_t fingerprint) {
+  ckpt_t *c = (ckpt_t *) mem_calloc(1, sizeof(ckpt_t), MEM_OTHER);
+  assert(c != NULL && "not enough memory");
+
+  c->path = strdup(path);
+  c->n = n;
+  c->fingerprint = fingerprint;
+  c->buf[0] = (double *) mem_alloc(sizeof(double) * n, MEM_OTHER);
+  c->buf[1] = (double *) mem_alloc(sizeof(double) * n, MEM_OTHER);
+  assert(c->path != NULL && c->buf[0] != NULL && c->buf[1] != NULL && "not enough memory");
+  c->writing = c->pending = -1;
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  int err = pthread_create(&c->thread, NULL, writer, c);
+  assert(err == 0 && "could not start the checkpoint writer");
+
+  return c;
+}
+
+int ckpt_close(ckpt_t *c) {
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, NULL);
+
+  const int failed = c->failed;
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->cond);
+  mem_free(c->buf[0]);
+  mem_free(c->buf[1]);
+  free(c->path);
+  mem_free(c);
+  return failed;
+}
+
+double *ckpt_stage(ckpt_t *c) {
+  pthread_mutex_lock(&c->lock);
+  // never the buffer on its way to disk, and an older snapshot still waiting is dropped
+  const int b = c->staged = c->writing == 0 ? 1 : 0;
+  if (c->pending == b) c->pending = -1;
+  pthread_mutex_unlock(&c->lock);
+
+  return c->buf[b];
+}
+
+void ckpt_commit(ckpt_t *c, size_t step) {
+  pthread_mutex_lock(&c->lock);
+  c->step[c->staged] = step;
+  c->pending = c->staged;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+size_t ckpt_wait(ckpt_t *c) {
+  pthread_mutex_lock(&c->lock);
+  while (c->pending != -1 || c->writing != -1) pthread_cond_wait(&c->cond, &c->lock);
+  const size_t written = c->written;
+  pthread_mutex_unlock(&c->lock);
+
+  return written;
+}
+
+int ckpt_read(const char *path, double *x, size_t n, uint64_t fingerprint, size_t *step) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return -1;
+
+  ckpt_header_t h;
+  int ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == CKPT_MAGIC && h.n == n && h.fingerprint == fingerprint
+    && fread(x, sizeof(double), n, f) == n;
+  fclose(f);
+  if (!ok) return -1;
+
+  if (step) *step = h.step;
+  return 0;
+}
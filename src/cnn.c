@@ -1,7 +1,10 @@
 #include "cnn.h"
 #include "mat.h"
+#include "rng.h"
+#include "topology.h"
 #include <assert.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
 #include <string.h>
@@ -37,6 +40,7 @@ static inline double activate(double x, ActFun act) {
     case SIGMOID: return sigmoid(x);
     case RELU: return x > 0.0 ? x : 0.0;
     case TANH: return tanh(x);
+    case LINEAR: return x;
     default: assert(0 && "unreachable");
   };
 }
@@ -46,6 +50,7 @@ static inline double dactf(double a, ActFun act) {
     case SIGMOID: return a * (1.0 - a);
     case RELU: return a > 0.0 ? 1.0 : 0.0;
     case TANH: return 1 - a * a;
+    case LINEAR: return 1;
     case SOFTMAX: return 1; // suposing it's used in last layer, the derivative with cross entropy loss would be just a - y
     default: assert(0 && "unreachable");
   }
@@ -81,16 +86,63 @@ static layer_t new_dense_layer(size_t size, ActFun act) {
   };
 
   dl.dl = (DenseLayer) {
-    .a = new_Mat2D(size, 1),
+    .a = alloc_Mat2D(size, 1, MEM_ACTIVATIONS),
     .bias = 0.0,
   };
 
   return dl;
 }
 
+// the per input buffers of dense_forward, allocated with the activations so the forward pass allocates nothing
+static void alloc_dense_scratch(DenseLayer *dl) {
+  dl->nonzero = (size_t *) mem_alloc(sizeof(size_t) * dl->ws.rows, MEM_SCRATCH);
+  dl->qx = (int8_t *) mem_alloc(sizeof(int8_t) * dl->ws.rows, MEM_SCRATCH);
+  assert(dl->nonzero != NULL && dl->qx != NULL && "not enough memory");
+}
+
+static void free_dense_scratch(DenseLayer *dl) {
+  mem_free(dl->nonzero);
+  mem_free(dl->qx);
+  dl->nonzero = NULL;
+  dl->qx = NULL;
+}
+
+static void destroy_qlayer(QLayer **q) {
+  if (*q) {
+    destroy_QMat2D(&(*q)->ws);
+    mem_free(*q);
+  }
+  *q = NULL;
+}
+
+static void destroy_half(HMat2D **h) {
+  if (*h) {
+    destroy_HMat2D(*h);
+    mem_free(*h);
+  }
+  *h = NULL;
+}
+
+static void destroy_sparse(CSRMat2D **s) {
+  if (*s) {
+    destroy_CSRMat2D(*s);
+    mem_free(*s);
+  }
+  *s = NULL;
+}
+
 static void destroy_dense_layer(DenseLayer *dl) {
   destroy_Mat2D(&dl->a);
   destroy_Mat2D(&dl->ws);
+  destroy_Mat2D(&dl->m);
+  destroy_Mat2D(&dl->v);
+  destroy_qlayer(&dl->q);
+  destroy_half(&dl->h);
+  destroy_sparse(&dl->sparse);
+  mem_free(dl->mask);
+  dl->mask = NULL;
+  destroy_Mat2D(&dl->shift);
+  free_dense_scratch(dl);
 }
 
 static layer_t new_conv2d_layer(size_t kernel_count, size_t kernel_size, size_t channels, int padding, int stride, ActFun act) {
@@ -99,13 +151,13 @@ static layer_t new_conv2d_layer(size_t kernel_count, size_t kernel_size, size_t
     .channels = channels,
     .padding = padding,
     .stride = stride,
-    .kernels = (Mat2D *) malloc(sizeof(Mat2D) * kernel_count * channels),
-    .bias = (double *) malloc(sizeof(double) * kernel_count),
-    .a = (Mat2D *) malloc(sizeof(Mat2D) * kernel_count),
+    .kernels = (Mat2D *) mem_alloc(sizeof(Mat2D) * kernel_count * channels, MEM_WEIGHTS),
+    .bias = (double *) mem_alloc(sizeof(double) * kernel_count, MEM_WEIGHTS),
+    .a = (Mat2D *) mem_alloc(sizeof(Mat2D) * kernel_count, MEM_ACTIVATIONS),
   };
 
   for (size_t k = 0; k < kernel_count * channels; ++k) {
-    cl.kernels[k] = new_Mat2D(kernel_size, kernel_size);
+    cl.kernels[k] = alloc_Mat2D(kernel_size, kernel_size, MEM_WEIGHTS);
   }
 
   return (layer_t) {
@@ -115,26 +167,145 @@ static layer_t new_conv2d_layer(size_t kernel_count, size_t kernel_size, size_t
   };
 }
 
-static void destroy_conv2d_layer(Conv2dLayer *l) {
+static void destroy_conv2d_layer(Conv2dLayer *l, unsigned fusion) {
   for (size_t k = 0; k < l->kernel_count * l->channels; ++k) {
     destroy_Mat2D(&l->kernels[k]);
   }
-  free(l->kernels);
+  mem_free(l->kernels);
   l->kernels = NULL;
-  free(l->bias);
+  mem_free(l->bias);
   l->bias = NULL;
 
-  for (size_t a = 0; a < l->kernel_count; ++a) {
+  for (size_t a = 0; a < l->kernel_count && !(fusion & OUTPUT_VIEW); ++a) {
+    destroy_Mat2D(&l->a[a]);
+  }
+  mem_free(l->a);
+  l->a = NULL;
+  destroy_qlayer(&l->q);
+  destroy_half(&l->h);
+}
+
+// points the depthwise, pointwise and bias views into params
+static void separable_views(SeparableConvLayer *sl) {
+  const size_t k2 = sl->kernel_size * sl->kernel_size;
+  sl->depthwise = (Mat2D) { .cols = k2, .rows = sl->channels, .elems = sl->params };
+  sl->pointwise = (Mat2D) { .cols = sl->channels, .rows = sl->kernel_count, .elems = &sl->params[sl->channels * k2] };
+  sl->bias = &sl->params[sl->channels * k2 + sl->kernel_count * sl->channels];
+}
+
+static size_t separable_params(const SeparableConvLayer *sl) {
+  return sl->channels * sl->kernel_size * sl->kernel_size + sl->kernel_count * sl->channels + sl->kernel_count;
+}
+
+static layer_t new_separable_layer(size_t kernel_count, size_t kernel_size, size_t channels, int padding, int stride, ActFun act) {
+  assert(act != SOFTMAX && "softmax only makes sense on a dense output layer");
+
+  SeparableConvLayer sl = {
+    .kernel_count = kernel_count,
+    .channels = channels,
+    .kernel_size = kernel_size,
+    .padding = padding,
+    .stride = stride,
+    .a = (Mat2D *) mem_alloc(sizeof(Mat2D) * kernel_count, MEM_ACTIVATIONS),
+  };
+  sl.params = (double *) mem_alloc(sizeof(double) * separable_params(&sl), MEM_WEIGHTS);
+  assert(sl.params != NULL && sl.a != NULL && "not enough memory");
+  separable_views(&sl);
+
+  return (layer_t) {
+    .kind = SEPARABLE_CONV2D,
+    .act = act,
+    .sl = sl,
+  };
+}
+
+static void destroy_separable_layer(SeparableConvLayer *l, unsigned fusion) {
+  mem_free(l->params);
+  mem_free(l->m);
+  mem_free(l->v);
+  l->params = l->m = l->v = l->bias = NULL;
+  l->depthwise.elems = l->pointwise.elems = NULL;
+  destroy_Mat2D(&l->dw);
+
+  for (size_t a = 0; a < l->kernel_count && !(fusion & OUTPUT_VIEW); ++a) {
+    destroy_Mat2D(&l->a[a]);
+  }
+  mem_free(l->a);
+  l->a = NULL;
+}
+
+static void batch_norm_views(BatchNormLayer *bn) {
+  bn->gamma = bn->params;
+  bn->beta = &bn->params[bn->features];
+}
+
+static size_t batch_norm_planes(const BatchNormLayer *bn) {
+  return bn->channels ? bn->channels : 1;
+}
+
+// the identity: gamma 1, beta 0 and the statistics of nothing seen yet
+static void batch_norm_reset(BatchNormLayer *bn) {
+  for (size_t f = 0; f < bn->features; ++f) {
+    bn->gamma[f] = 1.0;
+    bn->beta[f] = 0.0;
+    bn->mean[f] = 0.0;
+    bn->var[f] = 1.0;
+  }
+  bn->seen = 0.0;
+}
+
+static layer_t new_batch_norm_layer(const layer_t *prev) {
+  BatchNormLayer bn = {
+    .momentum = 0.01,
+    .eps = 1e-5,
+  };
+
+  switch (prev->kind) {
+    case DENSE: bn.features = prev->dl.a.rows; break;
+    case CONV2D: bn.features = bn.channels = prev->cl.kernel_count; break;
+    case SEPARABLE_CONV2D: bn.features = bn.channels = prev->sl.kernel_count; break;
+    default: assert(0 && "batch norm follows a dense or a conv layer");
+  }
+
+  // mean, var then the batch statistics in one block
+  bn.params = (double *) mem_alloc(sizeof(double) * 2 * bn.features, MEM_WEIGHTS);
+  bn.mean = (double *) mem_alloc(sizeof(double) * 6 * bn.features, MEM_WEIGHTS);
+  bn.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * batch_norm_planes(&bn), MEM_ACTIVATIONS);
+  assert(bn.params != NULL && bn.mean != NULL && bn.a != NULL && "not enough memory");
+  bn.var = &bn.mean[bn.features];
+  bn.batch = &bn.mean[2 * bn.features];
+  batch_norm_views(&bn);
+  batch_norm_reset(&bn);
+  // the planes are sized by nn_compile
+  if (!bn.channels) bn.a[0] = alloc_Mat2D(bn.features, 1, MEM_ACTIVATIONS);
+
+  return (layer_t) {
+    .kind = BATCH_NORM,
+    .act = prev->act,
+    .bn = bn,
+  };
+}
+
+static void destroy_batch_norm_layer(BatchNormLayer *l, unsigned fusion) {
+  mem_free(l->params);
+  mem_free(l->mean);
+  mem_free(l->m);
+  mem_free(l->v);
+  l->params = l->gamma = l->beta = l->mean = l->var = l->batch = l->m = l->v = NULL;
+
+  for (size_t a = 0; l->a && a < batch_norm_planes(l) && !(fusion & OUTPUT_VIEW); ++a) {
     destroy_Mat2D(&l->a[a]);
   }
-  free(l->a);
+  mem_free(l->a);
   l->a = NULL;
 }
 
-static layer_t new_pooling_layer(size_t pool_size, enum layer_kind kind) {
+static layer_t new_pooling_layer(size_t pool_size, size_t stride, enum layer_kind kind) {
+  assert(pool_size > 0 && stride > 0);
   PoolingLayer pl = {
     .channels = -1,
     .pool_size = pool_size,
+    .stride = stride,
     .a = NULL,
   };
 
@@ -144,18 +315,25 @@ static layer_t new_pooling_layer(size_t pool_size, enum layer_kind kind) {
   };
 }
 
-static void destroy_pooling_layer(PoolingLayer *l) {
+static void destroy_pooling_layer(PoolingLayer *l, unsigned fusion) {
   if (l->a) {
-    for (size_t a = 0; a < l->channels; ++a) {
+    for (size_t a = 0; a < l->channels && !(fusion & OUTPUT_VIEW); ++a) {
       destroy_Mat2D(&l->a[a]);
     }
-    free(l->a);
+    mem_free(l->a);
   }
 
   l->a = NULL;
   l->channels = -1;
 };
 
+static layer_t new_global_pool_layer() {
+  return (layer_t) {
+    .kind = GLOBAL_AVG_POOL,
+    .gp = (GlobalPoolLayer) { .a.elems = NULL },
+  };
+}
+
 static layer_t new_flatten_layer() {
   return (layer_t) {
     .kind = FLATTEN,
@@ -170,35 +348,96 @@ static void destroy_flatten_layer(FlattenLayer *l) {
 static void append_layer(nn_t *nn, layer_t l) {
   if (nn->capacity <= nn->layer_count) {
     nn->capacity *= 1.5;
-    nn->layers = (layer_t *) realloc(nn->layers, sizeof(layer_t) * nn->capacity);
+    nn->layers = (layer_t *) mem_realloc(nn->layers, sizeof(layer_t) * nn->capacity);
     assert(nn->layers != NULL && "not enough memory");
   }
 
   nn->layers[nn->layer_count++] = l;
 }
 
+// zeroed gradient planes shaped like planes
+static Mat2D *alloc_grad_planes(const Mat2D *planes, size_t count) {
+  Mat2D *g = (Mat2D *) mem_alloc(sizeof(Mat2D) * count, MEM_GRADIENTS);
+  assert(g != NULL && "not enough memory");
+
+  for (size_t c = 0; c < count; ++c) {
+    g[c] = alloc_Mat2D(planes[c].rows, planes[c].cols, MEM_GRADIENTS);
+    zero_init_Mat2D(&g[c]);
+  }
+  return g;
+}
+
 static nn_t nn_copy_structure(const nn_t *nn) {
   assert(nn->layers[0].kind == _INPUT);
 
   nn_t cpy = (nn_t) {
     .capacity = nn->capacity,
     .layer_count = nn->layer_count,
-    .layers = (layer_t *) malloc(sizeof(layer_t) * nn->capacity),
+    .layers = (layer_t *) mem_alloc(sizeof(layer_t) * nn->capacity, MEM_GRADIENTS),
   };
 
   cpy.layers[0].kind = _INPUT;
+  cpy.layers[0].fusion = 0;
   cpy.layers[0].il.input = nn->layers[0].il.input;
 
   for (size_t l = 1; l < nn->layer_count; ++l) {
     layer_t layer = nn->layers[l];
     cpy.layers[l].kind = layer.kind;
+    cpy.layers[l].fusion = 0;
     switch (layer.kind) {
       case DENSE:
-        cpy.layers[l].dl.a = new_Mat2D(layer.dl.a.rows, layer.dl.a.cols);
-        cpy.layers[l].dl.ws = new_Mat2D(layer.dl.ws.rows, layer.dl.ws.cols);
+        cpy.layers[l].dl.a = alloc_Mat2D(layer.dl.a.rows, layer.dl.a.cols, MEM_GRADIENTS);
+        cpy.layers[l].dl.ws = alloc_Mat2D(layer.dl.ws.rows, layer.dl.ws.cols, MEM_GRADIENTS);
         cpy.layers[l].dl.bias = 0.0;
+        cpy.layers[l].dl.q = NULL;
+        cpy.layers[l].dl.h = NULL;
+        cpy.layers[l].dl.sparse = NULL;
+        cpy.layers[l].dl.mask = NULL;
+        cpy.layers[l].dl.nonzero = NULL;
+        cpy.layers[l].dl.qx = NULL;
+        cpy.layers[l].dl.m = (Mat2D) { 0 };
+        cpy.layers[l].dl.v = (Mat2D) { 0 };
+        cpy.layers[l].dl.shift = (Mat2D) { 0 };
+        cpy.layers[l].act = layer.act;
+        break;
+      case SEPARABLE_CONV2D: {
+        SeparableConvLayer *sl = &cpy.layers[l].sl;
+        *sl = layer.sl;
+        sl->params = (double *) mem_alloc(sizeof(double) * separable_params(sl), MEM_GRADIENTS);
+        assert(sl->params != NULL && "not enough memory");
+        separable_views(sl);
+        sl->m = sl->v = NULL;
+        sl->dw = alloc_Mat2D(layer.sl.dw.rows, layer.sl.dw.cols, MEM_GRADIENTS);
+        sl->a = alloc_grad_planes(layer.sl.a, layer.sl.kernel_count);
+        cpy.layers[l].act = layer.act;
+        break;
+      }
+      case BATCH_NORM: {
+        BatchNormLayer *bn = &cpy.layers[l].bn;
+        *bn = layer.bn;
+        bn->params = (double *) mem_alloc(sizeof(double) * 2 * bn->features, MEM_GRADIENTS);
+        assert(bn->params != NULL && "not enough memory");
+        batch_norm_views(bn);
+        bn->mean = bn->var = bn->batch = bn->m = bn->v = NULL;
+        bn->a = alloc_grad_planes(layer.bn.a, batch_norm_planes(bn));
         cpy.layers[l].act = layer.act;
         break;
+      }
+      case MAX_POOL:
+      case AVG_POOL:
+        cpy.layers[l].pl = layer.pl;
+        cpy.layers[l].pl.a = alloc_grad_planes(layer.pl.a, layer.pl.channels);
+        break;
+      case GLOBAL_AVG_POOL:
+        cpy.layers[l].gp = layer.gp;
+        cpy.layers[l].gp.a = alloc_Mat2D(layer.gp.a.rows, 1, MEM_GRADIENTS);
+        zero_init_Mat2D(&cpy.layers[l].gp.a);
+        break;
+      case FLATTEN:
+        cpy.layers[l].fl.a = alloc_Mat2D(layer.fl.a.rows, 1, MEM_GRADIENTS);
+        cpy.layers[l].fl.viewed = 0;
+        zero_init_Mat2D(&cpy.layers[l].fl.a);
+        break;
       default:
         assert("unreachable" && 0);
     }
@@ -207,28 +446,105 @@ static nn_t nn_copy_structure(const nn_t *nn) {
   return cpy;
 }
 
-static void dense_layer_learn(DenseLayer *dl, DenseLayer *g, size_t batch_size, double lr) {
+static void dense_layer_learn(DenseLayer *dl, DenseLayer *g, size_t batch_size, double lr, const Optimizer *opt) {
   assert(dl->ws.cols == g->ws.cols && dl->ws.rows == g->ws.rows);
+  const size_t n = dl->ws.rows * dl->ws.cols;
+  const double scale = 1.0 / batch_size;
+
+  switch (opt->kind) {
+    case SGD:
+      sgd_step(dl->ws.elems, g->ws.elems, n, lr, scale);
+      sgd_step(&dl->bias, &g->bias, 1, lr, scale);
+      break;
+    case MOMENTUM:
+    case NESTEROV:
+      momentum_step(dl->ws.elems, g->ws.elems, dl->m.elems, n, lr, scale, opt->momentum, opt->kind == NESTEROV);
+      momentum_step(&dl->bias, &g->bias, &dl->bias_m, 1, lr, scale, opt->momentum, opt->kind == NESTEROV);
+      break;
+    case ADAM:
+      adam_step(dl->ws.elems, g->ws.elems, dl->m.elems, dl->v.elems, n, lr, scale, opt->beta1, opt->beta2, opt->eps, opt->t);
+      adam_step(&dl->bias, &g->bias, &dl->bias_m, &dl->bias_v, 1, lr, scale, opt->beta1, opt->beta2, opt->eps, opt->t);
+      break;
+    default:
+      assert(0 && "unreachable");
+  }
+}
 
-  for (size_t i = 0; i < dl->ws.rows; ++i) {
-    for (size_t j = 0; j < dl->ws.cols; ++j) {
-      MAT2D_GET(dl->ws, i, j) -= MAT2D_GET(g->ws, i, j) * lr / batch_size;
-    }
+// one optimizer step on a block of parameters and its own state
+static void params_learn(double *w, const double *g, double *m, double *v, size_t n, size_t batch_size, double lr, const Optimizer *opt) {
+  const double scale = 1.0 / batch_size;
+
+  switch (opt->kind) {
+    case SGD:
+      sgd_step(w, g, n, lr, scale);
+      break;
+    case MOMENTUM:
+    case NESTEROV:
+      momentum_step(w, g, m, n, lr, scale, opt->momentum, opt->kind == NESTEROV);
+      break;
+    case ADAM:
+      adam_step(w, g, m, v, n, lr, scale, opt->beta1, opt->beta2, opt->eps, opt->t);
+      break;
+    default:
+      assert(0 && "unreachable");
+  }
+}
+
+// zeroes the pruned weights again and copies the updated ones into the CSR values
+static void dense_prune_update(DenseLayer *dl) {
+  const size_t n = dl->ws.rows * dl->ws.cols;
+  #pragma omp parallel for simd
+  for (size_t i = 0; i < n; ++i) {
+    dl->ws.elems[i] = dl->mask[i] ? dl->ws.elems[i] : 0.0;
+  }
+
+  CSRMat2D *s = dl->sparse;
+  if (s == NULL) return;
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < s->rows; ++i) {
+    for (size_t p = s->row_ptr[i]; p < s->row_ptr[i + 1]; ++p) s->vals[p] = MAT2D_GET(dl->ws, s->col_idx[p], i);
   }
+}
 
-  dl->bias -= g->bias * lr / batch_size;
+// after the weights were written from outside nn_learn, the CSR values follow them
+static void nn_prune_update(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (nn->layers[l].kind == DENSE && nn->layers[l].dl.mask) dense_prune_update(&nn->layers[l].dl);
+  }
 }
 
 static void nn_learn(nn_t *nn, const nn_t *g, size_t batch_size, double lr) {
+  enum mem_phase phase = mem_set_phase(MEM_PHASE_UPDATE);
+  nn->opt.t++;
+
   for (size_t l = 1; l < nn->layer_count; ++l) {
     switch (nn->layers[l].kind) {
       case DENSE:
-        dense_layer_learn(&nn->layers[l].dl, &g->layers[l].dl, batch_size, lr);
+        dense_layer_learn(&nn->layers[l].dl, &g->layers[l].dl, batch_size, lr, &nn->opt);
+        if (nn->layers[l].dl.mask) dense_prune_update(&nn->layers[l].dl);
+        break;
+      case SEPARABLE_CONV2D: {
+        SeparableConvLayer *sl = &nn->layers[l].sl;
+        params_learn(sl->params, g->layers[l].sl.params, sl->m, sl->v, separable_params(sl), batch_size, lr, &nn->opt);
+        break;
+      }
+      case BATCH_NORM: {
+        BatchNormLayer *bn = &nn->layers[l].bn;
+        params_learn(bn->params, g->layers[l].bn.params, bn->m, bn->v, 2 * bn->features, batch_size, lr, &nn->opt);
+        break;
+      }
+      case MAX_POOL:
+      case AVG_POOL:
+      case GLOBAL_AVG_POOL:
+      case FLATTEN:
         break;
       default:
         assert("unreachable" && 0);
     }
   }
+
+  mem_set_phase(phase);
 }
 
 // g1 += g2
@@ -243,6 +559,21 @@ static void nn_add_gradient(nn_t *g1, const nn_t *g2) {
         sum_Mat2D(&g1->layers[l].dl.ws, &g2->layers[l].dl.ws);
         g1->layers[l].dl.bias += g2->layers[l].dl.bias;
         break;
+      case SEPARABLE_CONV2D:
+        for (size_t i = 0; i < separable_params(&g1->layers[l].sl); ++i) {
+          g1->layers[l].sl.params[i] += g2->layers[l].sl.params[i];
+        }
+        break;
+      case BATCH_NORM:
+        for (size_t i = 0; i < 2 * g1->layers[l].bn.features; ++i) {
+          g1->layers[l].bn.params[i] += g2->layers[l].bn.params[i];
+        }
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+      case GLOBAL_AVG_POOL:
+      case FLATTEN:
+        break;
       default:
         assert("unreachable" && 0);
     }
@@ -253,12 +584,13 @@ nn_t new_nn(size_t input_rows, size_t input_cols, size_t channels) {
   nn_t nn = (nn_t) {
     .layer_count = 1,
     .capacity = 10,
-    .layers = (layer_t *) malloc(sizeof(layer_t) * 10),
+    .layers = (layer_t *) mem_alloc(sizeof(layer_t) * 10, MEM_OTHER),
   };
 
   assert(nn.layers != NULL && "Not enough memory");
 
   nn.layers[0].kind = _INPUT;
+  nn.layers[0].fusion = 0;
   nn.layers[0].il.input = NULL;
   nn.layers[0].il.width = input_cols;
   nn.layers[0].il.height = input_rows;
@@ -268,25 +600,38 @@ nn_t new_nn(size_t input_rows, size_t input_cols, size_t channels) {
 }
 
 void nn_init_random(nn_t *nn, const double min, const double max) {
-  const double diff = max - min;
+  const uint64_t seed = rng_seed();
 
+  // one stream per layer, the weights then the biases
   for (size_t l = 1; l < nn->layer_count; ++l) {
     layer_t *layer = &nn->layers[l];
+    const rng_t r = { .seed = seed, .stream = l };
     switch (layer->kind) {
-      case DENSE:
-        random_init_Mat2D(&layer->dl.ws, min, max);
-        layer->dl.bias = (double) random() / (double) RAND_MAX * diff + min;
+      case DENSE: {
+        const size_t n = layer->dl.ws.rows * layer->dl.ws.cols;
+        rng_fill(r, 0, layer->dl.ws.elems, n, min, max);
+        rng_fill(r, n, &layer->dl.bias, 1, min, max);
         break;
-      case CONV2D:
+      }
+      case CONV2D: {
+        size_t n = 0;
         for (size_t k = 0; k < layer->cl.kernel_count * layer->cl.channels; ++k) {
-          random_init_Mat2D(&layer->cl.kernels[k], min, max);
-        }
-        for (size_t k = 0; k < layer->cl.kernel_count; ++k) {
-          layer->cl.bias[k] = (double) random() / (double) RAND_MAX * diff + min;
+          const Mat2D *kernel = &layer->cl.kernels[k];
+          rng_fill(r, n, kernel->elems, kernel->rows * kernel->cols, min, max);
+          n += kernel->rows * kernel->cols;
         }
+        rng_fill(r, n, layer->cl.bias, layer->cl.kernel_count, min, max);
+        break;
+      }
+      case SEPARABLE_CONV2D:
+        rng_fill(r, 0, layer->sl.params, separable_params(&layer->sl), min, max);
+        break;
+      case BATCH_NORM:
+        batch_norm_reset(&layer->bn);
         break;
       case MAX_POOL:
       case AVG_POOL:
+      case GLOBAL_AVG_POOL:
       case FLATTEN:
         break;
       default:
@@ -312,8 +657,15 @@ void nn_init_zero(nn_t *nn) {
           layer->cl.bias[k] = 0.0;
         }
         break;
+      case SEPARABLE_CONV2D:
+        memset(layer->sl.params, 0, sizeof(double) * separable_params(&layer->sl));
+        break;
+      case BATCH_NORM:
+        memset(layer->bn.params, 0, sizeof(double) * 2 * layer->bn.features);
+        break;
       case MAX_POOL:
       case AVG_POOL:
+      case GLOBAL_AVG_POOL:
       case FLATTEN:
         break;
       default:
@@ -322,21 +674,289 @@ void nn_init_zero(nn_t *nn) {
   }
 }
 
+// the output planes of a conv or pooling layer and their count, NULL for the other kinds
+static Mat2D *layer_planes(const layer_t *layer, size_t *count) {
+  switch (layer->kind) {
+    case CONV2D: *count = layer->cl.kernel_count; return layer->cl.a;
+    case SEPARABLE_CONV2D: *count = layer->sl.kernel_count; return layer->sl.a;
+    case BATCH_NORM: *count = layer->bn.channels; return layer->bn.channels ? layer->bn.a : NULL;
+    case MAX_POOL:
+    case AVG_POOL: *count = layer->pl.channels; return layer->pl.a;
+    default: *count = 0; return NULL;
+  }
+}
+
+// bytes of the output storage a layer owns. fused layers write into the storage of another layer
+static size_t output_bytes(const layer_t *layer) {
+  size_t count;
+  const Mat2D *planes = layer_planes(layer, &count);
+
+  switch (layer->kind) {
+    case DENSE: return sizeof(double) * layer->dl.a.rows;
+    case FLATTEN: return sizeof(double) * layer->fl.a.rows;
+    case GLOBAL_AVG_POOL: return sizeof(double) * layer->gp.a.rows;
+    case BATCH_NORM:
+      if (!layer->bn.channels) return sizeof(double) * layer->bn.features;
+      // fall through
+    default:
+      if (planes == NULL || layer->fusion & OUTPUT_VIEW || planes[0].elems == NULL) return 0;
+      return sizeof(double) * count * planes[0].rows * planes[0].cols;
+  }
+}
+
+// the largest pair of consecutive outputs
+static size_t arena_bytes(const nn_t *nn) {
+  size_t max = 0, prev = 0;
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const size_t bytes = output_bytes(&nn->layers[l]);
+    if (bytes == 0) continue;
+    max = prev + bytes > max ? prev + bytes : max;
+    prev = bytes;
+  }
+  return max;
+}
+
+static void set_planes(Mat2D *planes, size_t count, double *p) {
+  for (size_t c = 0; c < count; ++c) {
+    planes[c].elems = p ? &p[c * planes[c].rows * planes[c].cols] : NULL;
+  }
+}
+
+// points the output storage of layer at p, NULL detaches it
+static void set_output(layer_t *layer, layer_t *prev, double *p) {
+  size_t count;
+  Mat2D *planes = layer_planes(layer, &count);
+
+  switch (layer->kind) {
+    case DENSE: layer->dl.a.elems = p; break;
+    case GLOBAL_AVG_POOL: layer->gp.a.elems = p; break;
+    case BATCH_NORM:
+      if (!layer->bn.channels) {
+        layer->bn.a[0].elems = p;
+        break;
+      }
+      set_planes(planes, count, p);
+      break;
+    case FLATTEN:
+      layer->fl.a.elems = p;
+      if (!(layer->fusion & FUSED)) break;
+      // the planes of the previous layer are views into the flatten buffer
+      planes = layer_planes(prev, &count);
+      set_planes(planes, count, p);
+      break;
+    default:
+      assert(planes != NULL && "unreachable");
+      set_planes(planes, count, p);
+  }
+}
+
+// moves every layer output into one arena, consecutive outputs at opposite ends so a layer never overwrites its input.
+// owned: the outputs have buffers of their own to free, not a previous arena
+static void nn_plan(nn_t *nn, int owned) {
+  const size_t size = arena_bytes(nn) / sizeof(double);
+  nn->arena = (double *) mem_alloc(sizeof(double) * size, MEM_ACTIVATIONS);
+  assert(nn->arena != NULL && "not enough memory");
+
+  size_t owner = 0;
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    const size_t count = output_bytes(layer) / sizeof(double);
+    if (count == 0) continue;
+
+    size_t channels;
+    const Mat2D *planes = layer_planes(layer, &channels);
+    if (planes && owned) {
+      for (size_t c = 0; c < channels; ++c) mem_free(planes[c].elems);
+    } else if (owned) {
+      mem_free(nn_layer_output(layer)->elems);
+    }
+    set_output(layer, &nn->layers[l - 1], owner++ % 2 ? &nn->arena[size - count] : nn->arena);
+  }
+}
+
+static void nn_release_arena(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (output_bytes(&nn->layers[l])) set_output(&nn->layers[l], &nn->layers[l - 1], NULL);
+  }
+
+  mem_free(nn->arena);
+  nn->arena = NULL;
+}
+
+static Mat2D replicate_Mat2D(const Mat2D *m, int node) {
+  Mat2D r = alloc_Mat2D(m->rows, m->cols, MEM_WEIGHTS);
+  topo_bind(r.elems, sizeof(double) * r.rows * r.cols, node);
+  memcpy(r.elems, m->elems, sizeof(double) * r.rows * r.cols);
+  return r;
+}
+
+static nn_t new_replica_on(const nn_t *nn, int node) {
+  nn_t ctx = nn_new_context(nn);
+  ctx.replica = 1;
+
+  for (size_t l = 1; l < ctx.layer_count; ++l) {
+    layer_t *layer = &ctx.layers[l];
+    if (layer->kind == DENSE) {
+      layer->dl.ws = replicate_Mat2D(&nn->layers[l].dl.ws, node);
+    } else if (layer->kind == CONV2D) {
+      const size_t count = layer->cl.kernel_count * layer->cl.channels;
+      layer->cl.kernels = (Mat2D *) mem_alloc(sizeof(Mat2D) * count, MEM_WEIGHTS);
+      assert(layer->cl.kernels != NULL && "not enough memory");
+      for (size_t k = 0; k < count; ++k) {
+        layer->cl.kernels[k] = replicate_Mat2D(&nn->layers[l].cl.kernels[k], node);
+      }
+    }
+  }
+
+  return ctx;
+}
+
+nn_t nn_new_replica(const nn_t *nn) {
+  return new_replica_on(nn, topo_current_node());
+}
+
+static void free_replicas(nn_t *nn) {
+  for (int node = 0; node < nn->replica_nodes; ++node) {
+    nn_destroy(&nn->replicas[node]);
+  }
+  mem_free(nn->replicas);
+  nn->replicas = NULL;
+  nn->replica_nodes = 0;
+}
+
+// the output layer has its storage once the network is compiled
+static int nn_compiled(const nn_t *nn) {
+  const Mat2D *o = nn_layer_output(&nn->layers[nn->layer_count - 1]);
+  return nn->layer_count > 1 && o != NULL && o->elems != NULL;
+}
+
+static void build_replicas(nn_t *nn) {
+  free_replicas(nn);
+  if (!nn->numa.replicate || nn->shared_weights || !nn_compiled(nn)) return;
+
+  nn->replica_nodes = topo_nodes();
+  nn->replicas = (nn_t *) mem_alloc(sizeof(nn_t) * nn->replica_nodes, MEM_OTHER);
+  assert(nn->replicas != NULL && "not enough memory");
+  for (int node = 0; node < nn->replica_nodes; ++node) {
+    nn->replicas[node] = new_replica_on(nn, node);
+  }
+}
+
+// the weights may have been trained since the last call, the pages stay on their nodes
+static void refresh_replicas(const nn_t *nn) {
+  for (int node = 0; node < nn->replica_nodes; ++node) {
+    const nn_t *r = &nn->replicas[node];
+    for (size_t l = 1; l < nn->layer_count; ++l) {
+      const layer_t *layer = &nn->layers[l];
+      if (layer->kind == DENSE) {
+        memcpy(r->layers[l].dl.ws.elems, layer->dl.ws.elems, sizeof(double) * layer->dl.ws.rows * layer->dl.ws.cols);
+      } else if (layer->kind == CONV2D) {
+        for (size_t k = 0; k < layer->cl.kernel_count * layer->cl.channels; ++k) {
+          const Mat2D *kernel = &layer->cl.kernels[k];
+          memcpy(r->layers[l].cl.kernels[k].elems, kernel->elems, sizeof(double) * kernel->rows * kernel->cols);
+        }
+      }
+    }
+  }
+}
+
+// a context of nn whose double weights are the ones of the replica, everything else is shared with nn
+static void use_replica(nn_t *ctx, const nn_t *r) {
+  for (size_t l = 1; l < ctx->layer_count; ++l) {
+    if (ctx->layers[l].kind == DENSE) ctx->layers[l].dl.ws = r->layers[l].dl.ws;
+    else if (ctx->layers[l].kind == CONV2D) ctx->layers[l].cl.kernels = r->layers[l].cl.kernels;
+  }
+}
+
+static void destroy_context(nn_t *ctx) {
+  for (size_t l = 1; l < ctx->layer_count; ++l) {
+    layer_t *layer = &ctx->layers[l];
+    switch (layer->kind) {
+      case DENSE:
+        destroy_Mat2D(&layer->dl.a);
+        free_dense_scratch(&layer->dl);
+        if (ctx->replica) destroy_Mat2D(&layer->dl.ws);
+        break;
+      case CONV2D:
+        for (size_t k = 0; k < layer->cl.kernel_count * layer->cl.channels && ctx->replica; ++k) {
+          destroy_Mat2D(&layer->cl.kernels[k]);
+        }
+        if (ctx->replica) mem_free(layer->cl.kernels);
+        for (size_t k = 0; k < layer->cl.kernel_count && !(layer->fusion & OUTPUT_VIEW); ++k) {
+          destroy_Mat2D(&layer->cl.a[k]);
+        }
+        mem_free(layer->cl.a);
+        break;
+      case SEPARABLE_CONV2D:
+        for (size_t k = 0; k < layer->sl.kernel_count && !(layer->fusion & OUTPUT_VIEW); ++k) {
+          destroy_Mat2D(&layer->sl.a[k]);
+        }
+        mem_free(layer->sl.a);
+        destroy_Mat2D(&layer->sl.dw);
+        break;
+      case BATCH_NORM:
+        for (size_t c = 0; c < batch_norm_planes(&layer->bn) && !(layer->fusion & OUTPUT_VIEW); ++c) {
+          destroy_Mat2D(&layer->bn.a[c]);
+        }
+        mem_free(layer->bn.a);
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+        for (size_t c = 0; c < layer->pl.channels && !(layer->fusion & OUTPUT_VIEW); ++c) {
+          destroy_Mat2D(&layer->pl.a[c]);
+        }
+        mem_free(layer->pl.a);
+        break;
+      case GLOBAL_AVG_POOL:
+        destroy_Mat2D(&layer->gp.a);
+        break;
+      case FLATTEN:
+        destroy_Mat2D(&layer->fl.a);
+        break;
+      default:
+        assert(0 && "unreachable");
+    }
+  }
+
+  mem_free(ctx->layers);
+  mem_free(ctx->prof);
+  *ctx = (nn_t) { 0 };
+}
+
 void nn_destroy(nn_t *nn) {
+  if (nn->arena) nn_release_arena(nn);
+
+  if (nn->shared_weights) {
+    destroy_context(nn);
+    return;
+  }
+  if (nn->ckpt) ckpt_close(nn->ckpt);
+  free_replicas(nn);
+
   for (size_t l = 0; l < nn->layer_count; ++l) {
     switch (nn->layers[l].kind) {
       case DENSE:
+        if (nn->layers[l].fusion & RECOMPUTED) nn->layers[l].dl.a.elems = NULL;
         destroy_dense_layer(&nn->layers[l].dl);
         break;
       case _INPUT:
         nn->layers[l].il.input = NULL;
         break;
       case CONV2D:
-        destroy_conv2d_layer(&nn->layers[l].cl);
+        destroy_conv2d_layer(&nn->layers[l].cl, nn->layers[l].fusion);
+        break;
+      case SEPARABLE_CONV2D:
+        destroy_separable_layer(&nn->layers[l].sl, nn->layers[l].fusion);
+        break;
+      case BATCH_NORM:
+        destroy_batch_norm_layer(&nn->layers[l].bn, nn->layers[l].fusion);
         break;
       case MAX_POOL:
       case AVG_POOL:
-        destroy_pooling_layer(&nn->layers[l].pl);
+        destroy_pooling_layer(&nn->layers[l].pl, nn->layers[l].fusion);
+        break;
+      case GLOBAL_AVG_POOL:
+        destroy_Mat2D(&nn->layers[l].gp.a);
         break;
       case FLATTEN:
         destroy_flatten_layer(&nn->layers[l].fl);
@@ -346,7 +966,11 @@ void nn_destroy(nn_t *nn) {
       }
   }
 
-  free(nn->layers);
+  mem_free(nn->layers);
+  mem_free(nn->prof);
+  mem_free(nn->recompute);
+  nn->prof = NULL;
+  nn->recompute = NULL;
   nn->capacity = 0;
   nn->layer_count = 0;
 }
@@ -363,14 +987,42 @@ void nn_add_conv2d_layer(nn_t *nn, size_t kernel_count, size_t kernel_size, size
   append_layer(nn, conv);
 }
 
+void nn_add_depthwise_separable_conv_layer(nn_t *nn, size_t kernel_count, size_t kernel_size, size_t channels, int padding, int stride, ActFun act) {
+  layer_t sep = new_separable_layer(kernel_count, kernel_size, channels, padding, stride, act);
+
+  append_layer(nn, sep);
+}
+
+void nn_add_batch_norm_layer(nn_t *nn) {
+  layer_t *prev = &nn->layers[nn->layer_count - 1];
+  assert(prev->act != SOFTMAX && "softmax only makes sense on a dense output layer");
+  layer_t bn = new_batch_norm_layer(prev);
+  prev->act = LINEAR;
+
+  append_layer(nn, bn);
+}
+
 void nn_add_max_pooling_layer(nn_t *nn, size_t pool_size) {
-  layer_t l = new_pooling_layer(pool_size, MAX_POOL);
+  layer_t l = new_pooling_layer(pool_size, pool_size, MAX_POOL);
 
   append_layer(nn, l);
 }
 
 void nn_add_avg_pooling_layer(nn_t *nn, size_t pool_size) {
-  layer_t l = new_pooling_layer(pool_size, AVG_POOL);
+  layer_t l = new_pooling_layer(pool_size, pool_size, AVG_POOL);
+
+  append_layer(nn, l);
+}
+
+void nn_add_strided_pooling_layer(nn_t *nn, enum layer_kind kind, size_t pool_size, size_t stride) {
+  assert((kind == MAX_POOL || kind == AVG_POOL) && "not a pooling layer");
+  layer_t l = new_pooling_layer(pool_size, stride, kind);
+
+  append_layer(nn, l);
+}
+
+void nn_add_global_avg_pooling_layer(nn_t *nn) {
+  layer_t l = new_global_pool_layer();
 
   append_layer(nn, l);
 }
@@ -381,107 +1033,593 @@ void nn_add_flatten_layer(nn_t *nn) {
   append_layer(nn, l);
 }
 
-void nn_compile(nn_t *nn) {
-  size_t width, height, channels, flatten_size;
-
-  for (size_t l = 0; l < nn->layer_count; ++l) {
+// conv -> pool: the conv computes the pooled output directly, its own output is never materialised.
+// conv/pool -> flatten: the planes are written straight into the flatten buffer
+static void nn_fuse(nn_t *nn) {
+  for (size_t l = 1; l + 1 < nn->layer_count; ++l) {
     layer_t *layer = &nn->layers[l];
-    switch (layer->kind) {
-      case _INPUT:
-        width = layer->il.width;
-        height = layer->il.height;
-        channels = layer->il.channels;
-        if (width == 1) flatten_size = width * height;
-        break;
-      case DENSE:
-        layer->dl.ws = new_Mat2D(flatten_size, layer->dl.a.rows);
-        flatten_size = layer->dl.a.rows;
-        break;
-      case CONV2D:
-        height = (height - layer->cl.kernels[0].rows + 2 * layer->cl.padding) / layer->cl.stride + 1;
-        width = (width - layer->cl.kernels[0].cols + 2 * layer->cl.padding) / layer->cl.stride + 1;
-        for (size_t i = 0; i < layer->cl.kernel_count; ++i) {
-          layer->cl.a[i] = new_Mat2D(height, width);
-        }
-        channels = layer->cl.kernel_count;
-        break;
-      case MAX_POOL:
-      case AVG_POOL:
-        layer->pl.channels = channels;
-        width /= layer->pl.pool_size;
-        height /= layer->pl.pool_size;
+    layer_t *next = &nn->layers[l + 1];
 
-        layer->pl.a = (Mat2D *) malloc(sizeof(Mat2D) * channels);
-        for (size_t c = 0; c < channels; ++c) {
-          layer->pl.a[c] = new_Mat2D(height, width);
-        }
-        break;
+    // the fused kernels step from one window to the next without overlap
+    if (layer->kind == CONV2D && (next->kind == MAX_POOL || next->kind == AVG_POOL) && next->pl.stride == next->pl.pool_size) {
+      next->fusion |= FUSED;
+    }
+
+    const int planes = layer->kind == CONV2D || layer->kind == SEPARABLE_CONV2D || layer->kind == MAX_POOL || layer->kind == AVG_POOL
+      || (layer->kind == BATCH_NORM && layer->bn.channels);
+    if (planes && next->kind == FLATTEN) {
+      layer->fusion |= OUTPUT_VIEW;
+      next->fusion |= FUSED;
+    }
+  }
+}
+
+// allocates the output planes of a conv or pooling layer, or carves them out of the next FLATTEN buffer
+static void alloc_planes(layer_t *layer, layer_t *next, Mat2D *planes, size_t channels, size_t height, size_t width) {
+  if (layer->fusion & OUTPUT_VIEW) {
+    next->fl.a = alloc_Mat2D(channels * height * width, 1, MEM_ACTIVATIONS);
+  }
+
+  for (size_t c = 0; c < channels; ++c) {
+    if (layer->fusion & OUTPUT_VIEW) {
+      planes[c] = (Mat2D) { .cols = width, .rows = height, .elems = &next->fl.a.elems[c * height * width] };
+    } else if (next && (next->fusion & FUSED)) {
+      planes[c] = (Mat2D) { .cols = width, .rows = height, .elems = NULL };
+    } else {
+      planes[c] = alloc_Mat2D(height, width, MEM_ACTIVATIONS);
+    }
+  }
+}
+
+static void alloc_params_state(const Optimizer *opt, size_t n, double **m, double **v) {
+  if (opt->kind != SGD && *m == NULL) *m = (double *) mem_calloc(n, sizeof(double), MEM_GRADIENTS);
+  if (opt->kind == ADAM && *v == NULL) *v = (double *) mem_calloc(n, sizeof(double), MEM_GRADIENTS);
+  assert((opt->kind == SGD || *m != NULL) && (opt->kind != ADAM || *v != NULL) && "not enough memory");
+}
+
+static void alloc_optimizer_state(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    DenseLayer *dl = &nn->layers[l].dl;
+    SeparableConvLayer *sl = &nn->layers[l].sl;
+    BatchNormLayer *bn = &nn->layers[l].bn;
+
+    if (nn->layers[l].kind == SEPARABLE_CONV2D) {
+      alloc_params_state(&nn->opt, separable_params(sl), &sl->m, &sl->v);
+      continue;
+    }
+    if (nn->layers[l].kind == BATCH_NORM) {
+      alloc_params_state(&nn->opt, 2 * bn->features, &bn->m, &bn->v);
+      continue;
+    }
+    if (nn->layers[l].kind != DENSE) continue;
+
+    if (nn->opt.kind != SGD && dl->m.elems == NULL) {
+      dl->m = alloc_Mat2D(dl->ws.rows, dl->ws.cols, MEM_GRADIENTS);
+      if (nn->numa.first_touch) first_touch_Mat2D(&dl->m);
+      else zero_init_Mat2D(&dl->m);
+      dl->bias_m = 0.0;
+    }
+
+    if (nn->opt.kind == ADAM && dl->v.elems == NULL) {
+      dl->v = alloc_Mat2D(dl->ws.rows, dl->ws.cols, MEM_GRADIENTS);
+      if (nn->numa.first_touch) first_touch_Mat2D(&dl->v);
+      else zero_init_Mat2D(&dl->v);
+      dl->bias_v = 0.0;
+    }
+  }
+}
+
+void nn_compile(nn_t *nn) {
+  size_t width = 0, height = 0, channels = 0, flatten_size = 0;
+
+  nn_fuse(nn);
+
+  for (size_t l = 0; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    layer_t *next = l + 1 < nn->layer_count ? &nn->layers[l + 1] : NULL;
+    switch (layer->kind) {
+      case _INPUT:
+        width = layer->il.width;
+        height = layer->il.height;
+        channels = layer->il.channels;
+        if (width == 1) flatten_size = width * height;
+        break;
+      case DENSE:
+        layer->dl.ws = alloc_Mat2D(flatten_size, layer->dl.a.rows, MEM_WEIGHTS);
+        if (nn->numa.first_touch) first_touch_Mat2D(&layer->dl.ws);
+        alloc_dense_scratch(&layer->dl);
+        flatten_size = layer->dl.a.rows;
+        break;
+      case CONV2D:
+        height = (height - layer->cl.kernels[0].rows + 2 * layer->cl.padding) / layer->cl.stride + 1;
+        width = (width - layer->cl.kernels[0].cols + 2 * layer->cl.padding) / layer->cl.stride + 1;
+        channels = layer->cl.kernel_count;
+        alloc_planes(layer, next, layer->cl.a, channels, height, width);
+        break;
+      case SEPARABLE_CONV2D:
+        height = (height - layer->sl.kernel_size + 2 * layer->sl.padding) / layer->sl.stride + 1;
+        width = (width - layer->sl.kernel_size + 2 * layer->sl.padding) / layer->sl.stride + 1;
+        layer->sl.dw = alloc_Mat2D(channels, height * width, MEM_ACTIVATIONS);
+        channels = layer->sl.kernel_count;
+        alloc_planes(layer, next, layer->sl.a, channels, height, width);
+        break;
+      case BATCH_NORM:
+        if (layer->bn.channels) alloc_planes(layer, next, layer->bn.a, channels, height, width);
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+        assert(height >= layer->pl.pool_size && width >= layer->pl.pool_size && "the pooling window is larger than its input");
+        layer->pl.channels = channels;
+        width = (width - layer->pl.pool_size) / layer->pl.stride + 1;
+        height = (height - layer->pl.pool_size) / layer->pl.stride + 1;
+
+        layer->pl.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * channels, MEM_ACTIVATIONS);
+        alloc_planes(layer, next, layer->pl.a, channels, height, width);
+        break;
+      case GLOBAL_AVG_POOL:
+        assert(channels > 0 && width > 1 && "global pooling follows planes");
+        layer->gp.channels = channels;
+        layer->gp.a = alloc_Mat2D(channels, 1, MEM_ACTIVATIONS);
+        flatten_size = channels;
+        break;
       case FLATTEN:
         flatten_size = height * width * channels;
-        layer->fl.a = new_Mat2D(flatten_size, 1);
+        if (!(layer->fusion & FUSED)) layer->fl.a = alloc_Mat2D(flatten_size, 1, MEM_ACTIVATIONS);
         break;
       default: assert(0 && "unreachable");
     }
   }
+
+  alloc_optimizer_state(nn);
+  if (nn->autotune) nn_autotune(nn, nn->tune_cache);
+  if (nn->numa.replicate) build_replicas(nn);
 }
 
-void nn_forward(nn_t *nn, const Mat2D *input, size_t channels) {
+void nn_compile_inference(nn_t *nn) {
+  nn_compile(nn);
+  nn_plan(nn, 1);
+}
+
+// gamma (x - mean) / sd + beta = s x + t with s = gamma / sd, so the weights of unit or kernel f are
+// scaled by s[f] and its bias becomes s[f] bias + t[f]
+static void fold_batch_norm(layer_t *prev, const BatchNormLayer *bn) {
+  DenseLayer *dl = &prev->dl;
+  if (prev->kind == DENSE && dl->shift.elems == NULL) {
+    dl->shift = alloc_Mat2D(bn->features, 1, MEM_WEIGHTS);
+    zero_init_Mat2D(&dl->shift);
+  }
+
+  for (size_t f = 0; f < bn->features; ++f) {
+    const double s = bn->gamma[f] / sqrt(bn->var[f] + bn->eps);
+    const double t = bn->beta[f] - bn->mean[f] * s;
+
+    switch (prev->kind) {
+      case DENSE:
+        for (size_t j = 0; j < dl->ws.rows; ++j) MAT2D_GET(dl->ws, j, f) *= s;
+        // the dense bias is shared by every unit, it moves into the shift
+        dl->shift.elems[f] = s * (dl->bias + dl->shift.elems[f]) + t;
+        break;
+      case CONV2D:
+        for (size_t c = 0; c < prev->cl.channels; ++c) {
+          Mat2D *kernel = &prev->cl.kernels[f * prev->cl.channels + c];
+          for (size_t i = 0; i < kernel->rows * kernel->cols; ++i) kernel->elems[i] *= s;
+        }
+        prev->cl.bias[f] = s * prev->cl.bias[f] + t;
+        break;
+      case SEPARABLE_CONV2D:
+        for (size_t c = 0; c < prev->sl.channels; ++c) MAT2D_GET(prev->sl.pointwise, f, c) *= s;
+        prev->sl.bias[f] = s * prev->sl.bias[f] + t;
+        break;
+      default:
+        assert(0 && "unreachable");
+    }
+  }
+
+  if (prev->kind == DENSE) dl->bias = 0.0;
+}
+
+// the layer before takes over the output storage of the BATCH_NORM, the layers after it read the same buffers.
+// owned: its own output is freed, otherwise it lived in an arena that is gone
+static void adopt_output(layer_t *prev, layer_t *layer, int owned) {
+  BatchNormLayer *bn = &layer->bn;
+
+  if (prev->kind == DENSE) {
+    if (owned) destroy_Mat2D(&prev->dl.a);
+    prev->dl.a = bn->a[0];
+    mem_free(bn->a);
+  } else {
+    size_t count;
+    Mat2D *planes = layer_planes(prev, &count);
+    for (size_t c = 0; c < count && owned; ++c) destroy_Mat2D(&planes[c]);
+    mem_free(planes);
+    if (prev->kind == CONV2D) prev->cl.a = bn->a;
+    else prev->sl.a = bn->a;
+    prev->fusion |= layer->fusion & OUTPUT_VIEW;
+  }
+
+  bn->a = NULL;
+}
+
+void nn_freeze(nn_t *nn) {
+  assert(!nn->shared_weights && nn->recompute == NULL && "freeze the network itself, before the activation budget");
+  const int planned = nn->arena != NULL;
+
+  // the outputs are placed again once the layers are gone
+  if (planned) {
+    mem_free(nn->arena);
+    nn->arena = NULL;
+  }
+
+  for (size_t l = nn->layer_count - 1; l > 0; --l) {
+    layer_t *layer = &nn->layers[l];
+    layer_t *prev = &nn->layers[l - 1];
+    if (layer->kind != BATCH_NORM) continue;
+    assert((prev->kind != DENSE || (!prev->dl.q && !prev->dl.h && !prev->dl.sparse)) && "freeze before the weight copies");
+    assert((prev->kind != CONV2D || (!prev->cl.q && !prev->cl.h)) && "freeze before the weight copies");
+
+    fold_batch_norm(prev, &layer->bn);
+    prev->act = layer->act;
+    adopt_output(prev, layer, !planned);
+    destroy_batch_norm_layer(&layer->bn, layer->fusion);
+    memmove(layer, &nn->layers[l + 1], sizeof(layer_t) * (nn->layer_count - l - 1));
+    nn->layer_count--;
+  }
+
+  if (planned) nn_plan(nn, 0);
+  if (nn->prof) nn_enable_profiling(nn);
+  // the replicas were made for the layers that are gone
+  if (nn->replicas) build_replicas(nn);
+}
+
+static void dense_forward_q(DenseLayer *dl, const Mat2D *m, ActFun act) {
+  quantize_vec(m->elems, m->rows, dl->q->in_scale, dl->qx);
+  QMat2D_col_mul(&dl->q->ws, dl->qx, dl->q->in_scale, &dl->a);
+
+  add_column_scalar(&dl->a, dl->bias);
+  if (dl->shift.elems) sum_Mat2D(&dl->a, &dl->shift);
+  activate_col(&dl->a, act);
+}
+
+static void dense_forward(DenseLayer *dl, const Mat2D *m, ActFun act, const KernelChoice *kc) {
+  if (dl->q) {
+    dense_forward_q(dl, m, act);
+    return;
+  }
+
+  if (dl->h) {
+    HMat2D_col_mul(dl->h, m, &dl->a);
+  } else if (dl->sparse) {
+    CSRMat2D_mul(dl->sparse, m, &dl->a);
+  } else if (kc->algo == ALGO_DENSE_AXPY) {
+    Mat2D_T_col_mul(&dl->ws, m, kc->tile, &dl->a);
+  } else {
+    // raw pixels and relu outputs are mostly zeros, then only the rows of the nonzero inputs are read
+    const size_t nonzeros = nonzero_rows(m, dl->nonzero);
+    if (2 * nonzeros <= m->rows) {
+      Mat2D_T_gather_col_mul(&dl->ws, m, dl->nonzero, nonzeros, &dl->a);
+    } else {
+      Mat2D ws_t = transpose_Mat2D(&dl->ws);
+      Mat2D_col_mul(&ws_t, m, &dl->a);
+      destroy_Mat2D(&ws_t);
+    }
+  }
+
+  add_column_scalar(&dl->a, dl->bias);
+  if (dl->shift.elems) sum_Mat2D(&dl->a, &dl->shift);
+  activate_col(&dl->a, act);
+}
+
+// one plane of a MAX_POOL or AVG_POOL layer, the conv kernels call it too when the pooling is fused into them
+static void pool2D(enum layer_kind kind, const Mat2D *input, Mat2D *out, size_t pool_size, size_t stride) {
+  if (kind == MAX_POOL) max_pooling2D(input, out, pool_size, stride);
+  else avg_pooling2D(input, out, pool_size, stride);
+}
+
+// one row per kernel: [channel][kernel row][kernel col]
+static Mat2D conv_weight_rows(const Conv2dLayer *cl) {
+  const size_t k_elems = cl->kernels[0].rows * cl->kernels[0].cols;
+  Mat2D ws = alloc_Mat2D(cl->kernel_count, cl->channels * k_elems, MEM_SCRATCH);
+  for (size_t k = 0; k < cl->kernel_count * cl->channels; ++k) {
+    memcpy(&ws.elems[k * k_elems], cl->kernels[k].elems, sizeof(double) * k_elems);
+  }
+  return ws;
+}
+
+// im2col on the quantized input and a single int8 GEMM against all the kernels
+static void conv2d_forward_q(Conv2dLayer *cl, const Mat2D *m, ActFun act, layer_t *pool) {
+  const size_t k_size = cl->kernels[0].rows;
+  const size_t pixels = cl->a[0].rows * cl->a[0].cols;
+
+  QMat2D patches = alloc_QMat2D(pixels, cl->channels * k_size * k_size, MEM_SCRATCH);
+  quantize_im2col(m, cl->channels, k_size, k_size, cl->stride, cl->padding, cl->q->in_scale, &patches);
+
+  Mat2D out = alloc_Mat2D(cl->kernel_count, pixels, MEM_SCRATCH);
+  QMat2D_mul_T(&cl->q->ws, &patches, &out);
+
+  for (size_t k = 0; k < cl->kernel_count; ++k) {
+    Mat2D plane = { .cols = cl->a[k].cols, .rows = cl->a[k].rows, .elems = &out.elems[k * pixels] };
+    for (size_t p = 0; p < pixels; ++p) {
+      plane.elems[p] = activate(plane.elems[p] + cl->bias[k], act);
+    }
+
+    if (pool) pool2D(pool->kind, &plane, &pool->pl.a[k], pool->pl.pool_size, pool->pl.stride);
+    else memcpy(cl->a[k].elems, plane.elems, sizeof(double) * pixels);
+  }
+
+  destroy_Mat2D(&out);
+  destroy_QMat2D(&patches);
+}
+
+// im2col in fp32 and a single half precision GEMM against all the kernels
+static void conv2d_forward_h(Conv2dLayer *cl, const Mat2D *m, ActFun act, layer_t *pool) {
+  const size_t k_size = cl->kernels[0].rows;
+  const size_t pixels = cl->a[0].rows * cl->a[0].cols;
+
+  float *patches = (float *) mem_alloc(sizeof(float) * pixels * cl->h->cols, MEM_SCRATCH);
+  assert(patches != NULL && "not enough memory");
+  im2col_f32(m, cl->channels, k_size, k_size, cl->stride, cl->padding, patches);
+
+  Mat2D out = alloc_Mat2D(cl->kernel_count, pixels, MEM_SCRATCH);
+  HMat2D_mul_T(cl->h, patches, pixels, &out);
+
+  for (size_t k = 0; k < cl->kernel_count; ++k) {
+    Mat2D plane = { .cols = cl->a[k].cols, .rows = cl->a[k].rows, .elems = &out.elems[k * pixels] };
+    for (size_t p = 0; p < pixels; ++p) {
+      plane.elems[p] = activate(plane.elems[p] + cl->bias[k], act);
+    }
+
+    if (pool) pool2D(pool->kind, &plane, &pool->pl.a[k], pool->pl.pool_size, pool->pl.stride);
+    else memcpy(cl->a[k].elems, plane.elems, sizeof(double) * pixels);
+  }
+
+  destroy_Mat2D(&out);
+  mem_free(patches);
+}
+
+// im2col and a single GEMM against all the kernels, in double
+static void conv2d_forward_im2col(Conv2dLayer *cl, const Mat2D *m, ActFun act, layer_t *pool) {
+  const size_t k_size = cl->kernels[0].rows;
+  const size_t pixels = cl->a[0].rows * cl->a[0].cols;
+
+  Mat2D ws = conv_weight_rows(cl);
+  Mat2D patches = alloc_Mat2D(pixels, ws.cols, MEM_SCRATCH);
+  im2col(m, cl->channels, k_size, k_size, cl->stride, cl->padding, patches.elems);
+
+  Mat2D out = alloc_Mat2D(cl->kernel_count, pixels, MEM_SCRATCH);
+  mul_T_Mat2D(&ws, &patches, &out);
+
+  for (size_t k = 0; k < cl->kernel_count; ++k) {
+    Mat2D plane = { .cols = cl->a[k].cols, .rows = cl->a[k].rows, .elems = &out.elems[k * pixels] };
+    for (size_t p = 0; p < pixels; ++p) {
+      plane.elems[p] = activate(plane.elems[p] + cl->bias[k], act);
+    }
+
+    if (pool) pool2D(pool->kind, &plane, &pool->pl.a[k], pool->pl.pool_size, pool->pl.stride);
+    else memcpy(cl->a[k].elems, plane.elems, sizeof(double) * pixels);
+  }
+
+  destroy_Mat2D(&out);
+  destroy_Mat2D(&patches);
+  destroy_Mat2D(&ws);
+}
+
+// conv + bias + activation of the output pixel (r, c) of kernel k, summing over every input channel
+static inline double conv2d_pixel(const Conv2dLayer *cl, const Mat2D *in, size_t k, size_t r, size_t c, ActFun act) {
+  const Mat2D *kernels = &cl->kernels[k * cl->channels];
+  double sum = cl->bias[k];
+
+  for (size_t ch = 0; ch < cl->channels; ++ch) {
+    for (size_t kr = 0; kr < kernels[ch].rows; ++kr) {
+      int row = (int) r * cl->stride - cl->padding + kr;
+      if (row < 0 || row >= (int) in[ch].rows) continue;
+
+      for (size_t kc = 0; kc < kernels[ch].cols; ++kc) {
+        int col = (int) c * cl->stride - cl->padding + kc;
+        if (col >= 0 && col < (int) in[ch].cols) {
+          sum += MAT2D_GET(in[ch], row, col) * MAT2D_GET(kernels[ch], kr, kc);
+        }
+      }
+    }
+  }
+
+  return activate(sum, act);
+}
+
+static void conv2d_forward(Conv2dLayer *cl, const Mat2D *in, ActFun act) {
+  #pragma omp parallel for
+  for (size_t k = 0; k < cl->kernel_count; ++k) {
+    for (size_t r = 0; r < cl->a[k].rows; ++r) {
+      for (size_t c = 0; c < cl->a[k].cols; ++c) {
+        MAT2D_GET(cl->a[k], r, c) = conv2d_pixel(cl, in, k, r, c, act);
+      }
+    }
+  }
+}
+
+// only the conv outputs covered by a pooling window are computed, straight into the pooling layer
+static void conv2d_pool_forward(Conv2dLayer *cl, const Mat2D *in, ActFun act, layer_t *pool) {
+  const size_t ps = pool->pl.pool_size;
+
+  #pragma omp parallel for
+  for (size_t k = 0; k < cl->kernel_count; ++k) {
+    Mat2D *out = &pool->pl.a[k];
+    for (size_t i = 0; i < out->rows; ++i) {
+      for (size_t j = 0; j < out->cols; ++j) {
+        double acc = pool->kind == MAX_POOL ? -INFINITY : 0.0;
+
+        for (size_t pi = 0; pi < ps; ++pi) {
+          for (size_t pj = 0; pj < ps; ++pj) {
+            double val = conv2d_pixel(cl, in, k, i * ps + pi, j * ps + pj, act);
+            acc = pool->kind == MAX_POOL ? fmax(acc, val) : acc + val;
+          }
+        }
+
+        MAT2D_GET((*out), i, j) = pool->kind == MAX_POOL ? acc : acc / (ps * ps);
+      }
+    }
+  }
+}
+
+// every channel through its own k x k kernel into dw, then the 1 x 1 mix of dw into the planes
+static void separable_forward(SeparableConvLayer *sl, const Mat2D *in, ActFun act) {
+  const size_t k2 = sl->kernel_size * sl->kernel_size;
+  const size_t pixels = sl->dw.cols;
+
+  #pragma omp parallel for
+  for (size_t c = 0; c < sl->channels; ++c) {
+    Mat2D out = { .cols = sl->a[0].cols, .rows = sl->a[0].rows, .elems = &sl->dw.elems[c * pixels] };
+    depthwise_conv2D(&in[c], &sl->depthwise.elems[c * k2], sl->kernel_size, sl->stride, sl->padding, &out);
+  }
+
+  pointwise_conv2D(&sl->pointwise, &sl->dw, sl->bias, sl->a);
+
+  #pragma omp parallel for
+  for (size_t k = 0; k < sl->kernel_count; ++k) {
+    for (size_t p = 0; p < pixels; ++p) {
+      sl->a[k].elems[p] = activate(sl->a[k].elems[p], act);
+    }
+  }
+}
+
+// the values of feature f in m, a plane per feature or one element of a column each
+static double *feature_values(const BatchNormLayer *bn, const Mat2D *m, size_t f, size_t *pixels) {
+  *pixels = bn->channels ? m[f].rows * m[f].cols : 1;
+  return bn->channels ? m[f].elems : &m->elems[f];
+}
+
+// the statistics the passes normalize with, of the batch while nn_fit is on one
+static const double *batch_norm_mean(const BatchNormLayer *bn) {
+  return bn->stage == BN_RUNNING ? bn->mean : bn->batch;
+}
+
+// the normalization, gamma, beta and the activation in one pass
+static void batch_norm_forward(BatchNormLayer *bn, const Mat2D *in, ActFun act) {
+  const double *mean = batch_norm_mean(bn), *var = &mean[bn->features];
+
+  #pragma omp parallel for
+  for (size_t f = 0; f < bn->features; ++f) {
+    const double s = bn->gamma[f] / sqrt(var[f] + bn->eps);
+    const double t = bn->beta[f] - mean[f] * s;
+    size_t pixels;
+    const double *x = feature_values(bn, in, f, &pixels);
+    double *y = feature_values(bn, bn->a, f, &pixels);
+
+    for (size_t p = 0; p < pixels; ++p) {
+      y[p] = activate(x[p] * s + t, act);
+    }
+  }
+}
+
+static void conv2d_dispatch(Conv2dLayer *cl, const Mat2D *m, ActFun act, layer_t *pool, const KernelChoice *kc) {
+  if (cl->q) conv2d_forward_q(cl, m, act, pool);
+  else if (cl->h) conv2d_forward_h(cl, m, act, pool);
+  else if (kc->algo == ALGO_CONV_IM2COL) conv2d_forward_im2col(cl, m, act, pool);
+  else if (pool) conv2d_pool_forward(cl, m, act, pool);
+  else conv2d_forward(cl, m, act);
+}
+
+// returns the thread count to restore
+static int set_threads(int threads) {
+  const int prev = omp_get_max_threads();
+  if (threads > 0) omp_set_num_threads(threads);
+  return prev;
+}
+
+// the threads that share a profiled network add to the same counters
+static void profile_add(nn_t *nn, size_t l, enum nn_phase phase, double start) {
+  LayerProfile *lp = &nn->prof[l][phase];
+  const double dt = omp_get_wtime() - start;
+  #pragma omp atomic
+  lp->time += dt;
+  #pragma omp atomic
+  lp->calls++;
+}
+
+// runs the layers below end
+static void forward_layers(nn_t *nn, const Mat2D *input, size_t channels, size_t end) {
   assert(nn->layers[0].kind == _INPUT);
 
   const Mat2D *m = input;
-  Mat2D ws_t, conv_aux;
   nn->layers[0].il.input = input;
+  enum mem_phase phase = mem_set_phase(MEM_PHASE_FORWARD);
 
-  for (size_t l = 1; l < nn->layer_count; ++l) {
-    layer_t layer = nn->layers[l];
-    switch (layer.kind) {
-      case DENSE:
-        ws_t = transpose_Mat2D(&layer.dl.ws);
-        Mat2D_col_mul(&ws_t, m, &layer.dl.a);
-        destroy_Mat2D(&ws_t);
+  for (size_t l = 1; l < end; ++l) {
+    layer_t *layer = &nn->layers[l];
+    layer_t *pool = l + 1 < nn->layer_count && (nn->layers[l + 1].fusion & FUSED) && nn->layers[l + 1].kind != FLATTEN
+      ? &nn->layers[l + 1]
+      : NULL;
 
-        add_column_scalar(&layer.dl.a, layer.dl.bias);
-        activate_col(&layer.dl.a, layer.act);
-        m = &nn->layers[l].dl.a;
+    if (layer->fusion & FUSED) {
+      m = nn_layer_output(layer);
+      continue;
+    }
+
+    double t = nn->prof ? omp_get_wtime() : 0.0;
+    const int threads = set_threads(layer->kc.threads);
+
+    switch (layer->kind) {
+      case DENSE:
+        dense_forward(&layer->dl, m, layer->act, &layer->kc);
+        m = &layer->dl.a;
         break;
       case CONV2D:
-        assert(layer.cl.channels == channels);
+        assert(layer->cl.channels == channels);
 
-        conv_aux = new_Mat2D(layer.cl.a[0].rows, layer.cl.a[0].cols);
-        for (size_t k = 0; k < layer.cl.kernel_count; ++k) {
-          zero_init_Mat2D(&layer.cl.a[k]);
-          for (size_t c = 0; c < channels; ++c) {
-            convolution2D(&m[c], &layer.cl.kernels[k * channels + c], layer.cl.stride, layer.cl.padding, &conv_aux);
-            sum_Mat2D(&layer.cl.a[k], &conv_aux);
-          }
-          add_scalar_Mat2D(&layer.cl.a[k], layer.cl.bias[k]);
-        }
-        destroy_Mat2D(&conv_aux);
-        channels = layer.cl.kernel_count;
-        m = nn->layers[l].cl.a;
+        conv2d_dispatch(&layer->cl, m, layer->act, pool, &layer->kc);
+
+        channels = layer->cl.kernel_count;
+        m = layer->cl.a;
         break;
-      case MAX_POOL:
-        for (size_t c = 0; c < channels; ++c) {
-          max_pooling2D(&m[c], &layer.pl.a[c], layer.pl.pool_size);
-        }
-        m = nn->layers[l].pl.a;
+      case SEPARABLE_CONV2D:
+        assert(layer->sl.channels == channels);
+        separable_forward(&layer->sl, m, layer->act);
+        channels = layer->sl.kernel_count;
+        m = layer->sl.a;
+        break;
+      case BATCH_NORM:
+        batch_norm_forward(&layer->bn, m, layer->act);
+        m = layer->bn.a;
         break;
+      case MAX_POOL:
       case AVG_POOL:
         for (size_t c = 0; c < channels; ++c) {
-          avg_pooling2D(&m[c], &layer.pl.a[c], layer.pl.pool_size);
+          pool2D(layer->kind, &m[c], &layer->pl.a[c], layer->pl.pool_size, layer->pl.stride);
         }
-        m = nn->layers[l].pl.a;
+        m = layer->pl.a;
         break;
-      case FLATTEN:
-        for (size_t c = 0; c < channels; ++c) {
-          memcpy(&layer.fl.a.elems[c * m[c].cols * m[c].rows], m[c].elems, sizeof(double) * m[c].rows * m[c].cols);
+      case GLOBAL_AVG_POOL:
+        assert(layer->gp.channels == channels);
+        global_avg_pooling2D(m, channels, layer->gp.a.elems);
+        m = &layer->gp.a;
+        break;
+      case FLATTEN: {
+        // planes one after the other in memory already are the column, it is a reshape of their view
+        mat_t in;
+        layer->fl.viewed = mat_of_planes(m, channels, &in) == 0 && mat_is_contiguous(&in);
+        if (layer->fl.viewed) {
+          const mat_t col = mat_reshape(&in, 2, (size_t[]) { mat_size(&in), 1 });
+          layer->fl.view = mat_to_Mat2D(&col);
+        } else {
+          for (size_t c = 0; c < channels; ++c) {
+            memcpy(&layer->fl.a.elems[c * m[c].cols * m[c].rows], m[c].elems, sizeof(double) * m[c].rows * m[c].cols);
+          }
         }
-        m = &nn->layers[l].fl.a;
+        m = nn_layer_output(layer);
         break;
+      }
       default:
         assert("unreachable" && 0);
     }
+    if (layer->kc.threads) omp_set_num_threads(threads);
+
+    if (nn->prof) profile_add(nn, l, PHASE_FORWARD, t);
   }
+
+  mem_set_phase(phase);
+}
+
+void nn_forward(nn_t *nn, const Mat2D *input, size_t channels) {
+  forward_layers(nn, input, channels, nn->layer_count);
 }
 
 inline const Mat2D *nn_layer_output(const layer_t *l) {
@@ -489,9 +1627,12 @@ inline const Mat2D *nn_layer_output(const layer_t *l) {
     case DENSE: return &l->dl.a;
     case _INPUT: return l->il.input;
     case CONV2D: return l->cl.a;
+    case SEPARABLE_CONV2D: return l->sl.a;
+    case BATCH_NORM: return l->bn.a;
     case MAX_POOL:
     case AVG_POOL: return l->pl.a;
-    case FLATTEN: return &l->fl.a;
+    case FLATTEN: return l->fl.viewed ? &l->fl.view : &l->fl.a;
+    case GLOBAL_AVG_POOL: return &l->gp.a;
     default:
       assert("unreachable" && 0);
     }
@@ -501,78 +1642,1580 @@ inline const Mat2D *nn_output(const nn_t *nn) {
   return nn_layer_output(&nn->layers[nn->layer_count - 1]);
 }
 
-nn_t nn_backprop(const nn_t *nn, const Mat2D *y) {
-  const Mat2D *o = nn_output(nn);
-  assert(nn->layers[0].kind == _INPUT && nn->layers[0].il.input != NULL);
-  assert(nn->layers[nn->layer_count - 1].kind == DENSE && "output layer must be a dense layer");
-  assert(o->cols == y->cols && o->rows == y->rows);
+// the outputs of layer l and l - 1 again, from the closest kept layer below them
+// backprop reaches a segment of recomputed layers from the kept layer above it, the segment is replayed
+// once from the kept layer below and its outputs stay in nn->recompute until backprop is past it
+static void nn_recompute(nn_t *nn, size_t l) {
+  if ((nn->layers[l].fusion & RECOMPUTED) || !(nn->layers[l - 1].fusion & RECOMPUTED)) return;
 
-  nn_t g = nn_copy_structure(nn);
-  nn_init_zero(&g);
-  const Mat2D *g_o = nn_output(&g);
+  size_t from = l - 1;
+  while (from > 0 && (nn->layers[from].fusion & RECOMPUTED)) --from;
 
-  for (size_t i = 0; i < g_o->rows; ++i) {
-    g_o->elems[i] = o->elems[i] - y->elems[i];
+  for (size_t i = from + 1; i < l; ++i) {
+    layer_t *layer = &nn->layers[i];
+    dense_forward(&layer->dl, nn_layer_output(&nn->layers[i - 1]), layer->act, &layer->kc);
   }
+}
 
-  for (size_t l = g.layer_count - 1; l > 0; --l) {
-    if (g.layers[l].kind == DENSE) {
-      #pragma omp parallel for shared(g, nn, l) // TODO: see if this is worth with the atomics
-      for (size_t i = 0; i < g.layers[l].dl.a.rows; ++i) {
-        const double de = g.layers[l].dl.a.elems[i];
-        const double da = dactf(nn->layers[l].dl.a.elems[i], g.layers[l].act);
-        const double delta = de * da;
-        #pragma omp atomic
-        g.layers[l].dl.bias += delta;
+static void separable_backward(const nn_t *nn, nn_t *g, size_t l) {
+  const SeparableConvLayer *sl = &nn->layers[l].sl;
+  SeparableConvLayer *gl = &g->layers[l].sl;
+  const Mat2D *in = nn_layer_output(&nn->layers[l - 1]);
+  Mat2D *g_in = l > 1 ? (Mat2D *) nn_layer_output(&g->layers[l - 1]) : NULL;
+  const size_t k2 = sl->kernel_size * sl->kernel_size;
+  const size_t pixels = sl->dw.cols;
 
-        const Mat2D *prev_act = nn_layer_output(&g.layers[l-1]);
-        for(size_t j = 0; j < prev_act->rows; ++j) {
-          const double w = MAT2D_GET(nn->layers[l].dl.ws, j, i);
-          const double a = nn_layer_output(&nn->layers[l-1])->elems[j];
-          if (l > 1) {
-            #pragma omp atomic
-            prev_act->elems[j] += w * delta;
-          }
-          MAT2D_GET(g.layers[l].dl.ws, j, i) += a * delta;
-        }
+  // through the activation in place, then the pointwise weights and the bias
+  #pragma omp parallel for
+  for (size_t k = 0; k < sl->kernel_count; ++k) {
+    double *delta = gl->a[k].elems;
+    double db = 0.0;
+    for (size_t p = 0; p < pixels; ++p) {
+      delta[p] *= dactf(sl->a[k].elems[p], g->layers[l].act);
+      db += delta[p];
+    }
+    gl->bias[k] += db;
+
+    for (size_t c = 0; c < sl->channels; ++c) {
+      const double *x = &sl->dw.elems[c * pixels];
+      double dw = 0.0;
+      for (size_t p = 0; p < pixels; ++p) {
+        dw += delta[p] * x[p];
       }
+      MAT2D_GET(gl->pointwise, k, c) += dw;
     }
   }
 
-  return g;
-}
+  // the depthwise output, then its kernel and input, every channel is independent
+  #pragma omp parallel for
+  for (size_t c = 0; c < sl->channels; ++c) {
+    double *g_dw = &gl->dw.elems[c * pixels];
+    memset(g_dw, 0, sizeof(double) * pixels);
+    for (size_t k = 0; k < sl->kernel_count; ++k) {
+      const double w = MAT2D_GET(sl->pointwise, k, c);
+      for (size_t p = 0; p < pixels; ++p) {
+        g_dw[p] += w * gl->a[k].elems[p];
+      }
+    }
 
-// each row of the train_data is an input
-void nn_fit(nn_t *nn, const Mat2D *train_data, const Mat2D *labels, size_t batch_size, double lr) {
-  assert(nn_output(nn)->rows == labels->cols && train_data->rows == labels->rows);
-  assert(batch_size != 0);
-  nn_t total_g = nn_copy_structure(nn);
-  nn_init_zero(&total_g);
+    Mat2D g_out = { .cols = sl->a[0].cols, .rows = sl->a[0].rows, .elems = g_dw };
+    depthwise_conv2D_backward(&in[c], &sl->depthwise.elems[c * k2], sl->kernel_size, sl->stride, sl->padding,
+                              &g_out, &gl->depthwise.elems[c * k2], g_in ? &g_in[c] : NULL);
+  }
+}
 
-  for (size_t i = 0; i < train_data->rows; ++i) {
-    Mat2D x = (Mat2D) {
-      .cols = 1,
-      .rows = train_data->cols,
-      .elems = &train_data->elems[i * train_data->cols],
-    };
-
-    Mat2D y = (Mat2D) {
-      .cols = 1,
-      .rows = labels->cols,
-      .elems = &labels->elems[i * labels->cols],
-    };
-
-    nn_forward(nn, &x, 1);
-    nn_t g = nn_backprop(nn, &y);
-    nn_add_gradient(&total_g, &g);
+// with the running statistics every value is an affine map of its input. with the batch ones the mean and
+// var depend on every input of the batch as well, which takes off the means of delta and delta x̂:
+// dx = gamma / sd (delta - mean(delta) - x̂ mean(delta x̂))
+static void batch_norm_backward(const nn_t *nn, nn_t *g, size_t l) {
+  const BatchNormLayer *bn = &nn->layers[l].bn;
+  BatchNormLayer *gb = &g->layers[l].bn;
+  const Mat2D *in = nn_layer_output(&nn->layers[l - 1]);
+  const Mat2D *g_in = nn_layer_output(&g->layers[l - 1]);
+  const double *mean = batch_norm_mean(bn), *var = &mean[bn->features];
+  const double *dmean = &bn->batch[2 * bn->features], *dxmean = &bn->batch[3 * bn->features];
+  const int batch = bn->stage == BN_BATCH_GRAD;
+  assert(bn->stage != BN_BATCH && "the batch means of delta are not gathered yet");
 
-    if (i % batch_size == 0) {
-      nn_learn(nn, &total_g, batch_size, lr);
-      nn_init_zero(&total_g);
+  #pragma omp parallel for
+  for (size_t f = 0; f < bn->features; ++f) {
+    const double inv_sd = 1.0 / sqrt(var[f] + bn->eps);
+    size_t pixels;
+    const double *x = feature_values(bn, in, f, &pixels);
+    const double *y = feature_values(bn, bn->a, f, &pixels);
+    const double *dy = feature_values(gb, gb->a, f, &pixels);
+    double *dx = feature_values(gb, g_in, f, &pixels);
+    double dgamma = 0.0, dbeta = 0.0;
+
+    for (size_t p = 0; p < pixels; ++p) {
+      const double delta = dy[p] * dactf(y[p], g->layers[l].act);
+      const double xhat = (x[p] - mean[f]) * inv_sd;
+      dbeta += delta;
+      dgamma += delta * xhat;
+      dx[p] += bn->gamma[f] * inv_sd * (batch ? delta - dmean[f] - xhat * dxmean[f] : delta);
     }
+    gb->gamma[f] += dgamma;
+    gb->beta[f] += dbeta;
+  }
+}
 
-    nn_destroy(&g);
+// adds the sums of x and x² of the input of every feature of the sample in nn to the batch mean and var
+static void batch_norm_gather(nn_t *nn, size_t l) {
+  BatchNormLayer *bn = &nn->layers[l].bn;
+  const Mat2D *in = nn_layer_output(&nn->layers[l - 1]);
+
+  #pragma omp parallel for
+  for (size_t f = 0; f < bn->features; ++f) {
+    size_t pixels;
+    const double *x = feature_values(bn, in, f, &pixels);
+    double sum = 0.0, sq = 0.0;
+    for (size_t p = 0; p < pixels; ++p) {
+      sum += x[p];
+      sq += x[p] * x[p];
+    }
+    bn->batch[f] += sum;
+    bn->batch[bn->features + f] += sq;
   }
+}
 
-  nn_destroy(&total_g);
+// then the sums of delta and delta x̂, from the gradient g of its output
+static void batch_norm_gather_grad(nn_t *nn, const nn_t *g, size_t l) {
+  BatchNormLayer *bn = &nn->layers[l].bn;
+  const BatchNormLayer *gb = &g->layers[l].bn;
+  const Mat2D *in = nn_layer_output(&nn->layers[l - 1]);
+
+  #pragma omp parallel for
+  for (size_t f = 0; f < bn->features; ++f) {
+    const double inv_sd = 1.0 / sqrt(bn->batch[bn->features + f] + bn->eps);
+    size_t pixels;
+    const double *x = feature_values(bn, in, f, &pixels);
+    const double *y = feature_values(bn, bn->a, f, &pixels);
+    const double *dy = feature_values(gb, gb->a, f, &pixels);
+    double sum = 0.0, xsum = 0.0;
+    for (size_t p = 0; p < pixels; ++p) {
+      const double delta = dy[p] * dactf(y[p], g->layers[l].act);
+      sum += delta;
+      xsum += delta * (x[p] - bn->batch[f]) * inv_sd;
+    }
+    bn->batch[2 * bn->features + f] += sum;
+    bn->batch[3 * bn->features + f] += xsum;
+  }
+}
+
+// the gathered sums of rows samples, on every rank, become means. the sums of x and x² give the mean and var
+static void batch_norm_finish(nn_t *nn, size_t l, size_t rows) {
+  BatchNormLayer *bn = &nn->layers[l].bn;
+  const int grad = bn->stage == BN_BATCH;
+  double *s = &bn->batch[grad ? 2 * bn->features : 0];
+  size_t pixels;
+  feature_values(bn, bn->a, 0, &pixels);
+  const double n = (double) rows * pixels * (nn->dist ? nn->dist->size : 1);
+
+  if (nn->dist) dist_allreduce(nn->dist, s, 2 * bn->features);
+  for (size_t f = 0; f < bn->features; ++f) {
+    s[f] /= n;
+    s[bn->features + f] = grad ? s[bn->features + f] / n : fmax(s[bn->features + f] / n - s[f] * s[f], 0.0);
+  }
+  bn->stage = grad ? BN_BATCH_GRAD : BN_BATCH;
+}
+
+// the running statistics follow the ones of the batch of rows samples with weight momentum, the first
+// batches as a plain average. the var is the unbiased one
+static void batch_norm_track(nn_t *nn, size_t rows) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    BatchNormLayer *bn = &nn->layers[l].bn;
+    if (nn->layers[l].kind != BATCH_NORM) continue;
+
+    size_t pixels;
+    feature_values(bn, bn->a, 0, &pixels);
+    const double n = (double) rows * pixels * (nn->dist ? nn->dist->size : 1);
+    const double w = fmax(bn->momentum, 1.0 / (bn->seen + 1.0));
+    for (size_t f = 0; f < bn->features; ++f) {
+      bn->mean[f] += w * (bn->batch[f] - bn->mean[f]);
+      bn->var[f] += w * (bn->batch[bn->features + f] * (n > 1.0 ? n / (n - 1.0) : 1.0) - bn->var[f]);
+    }
+    bn->seen++;
+    bn->stage = BN_RUNNING;
+  }
+}
+
+static void pool_backward(const nn_t *nn, nn_t *g, size_t l) {
+  const PoolingLayer *pl = &g->layers[l].pl;
+  const Mat2D *in = nn_layer_output(&nn->layers[l - 1]);
+  Mat2D *g_in = (Mat2D *) nn_layer_output(&g->layers[l - 1]);
+
+  #pragma omp parallel for
+  for (size_t c = 0; c < pl->channels; ++c) {
+    if (g->layers[l].kind == MAX_POOL) max_pooling2D_backward(&in[c], &pl->a[c], pl->pool_size, pl->stride, &g_in[c]);
+    else avg_pooling2D_backward(&pl->a[c], pl->pool_size, pl->stride, &g_in[c]);
+  }
+}
+
+static void flatten_backward(nn_t *g, size_t l) {
+  size_t count;
+  Mat2D *g_in = layer_planes(&g->layers[l - 1], &count);
+  const double *g_out = g->layers[l].fl.a.elems;
+  assert(g_in != NULL && "flatten follows a conv or a pooling layer");
+
+  for (size_t c = 0; c < count; ++c) {
+    const size_t plane = g_in[c].rows * g_in[c].cols;
+    for (size_t p = 0; p < plane; ++p) {
+      g_in[c].elems[p] += g_out[c * plane + p];
+    }
+  }
+}
+
+// every pixel of a plane took the same share of its mean
+static void global_pool_backward(nn_t *g, size_t l) {
+  size_t count;
+  Mat2D *g_in = layer_planes(&g->layers[l - 1], &count);
+  const double *g_out = g->layers[l].gp.a.elems;
+  assert(g_in != NULL && count == g->layers[l].gp.channels && "global pooling follows a conv or a pooling layer");
+
+  #pragma omp parallel for
+  for (size_t c = 0; c < count; ++c) {
+    const size_t plane = g_in[c].rows * g_in[c].cols;
+    const double share = g_out[c] / plane;
+    #pragma omp simd
+    for (size_t p = 0; p < plane; ++p) {
+      g_in[c].elems[p] += share;
+    }
+  }
+}
+
+// the gradient of the layers above stop added to g, which has the structure of nn and starts zeroed.
+// g then holds the gradient of the output of stop
+static void backprop_into(nn_t *nn, nn_t *g, const Mat2D *y, size_t stop) {
+  const Mat2D *o = nn_output(nn);
+  assert(nn->layers[0].kind == _INPUT && nn->layers[0].il.input != NULL);
+  assert(nn->layers[nn->layer_count - 1].kind == DENSE && "output layer must be a dense layer");
+  assert(o->cols == y->cols && o->rows == y->rows);
+  assert(nn->arena == NULL && "an inference plan keeps no activations to backprop");
+
+  enum mem_phase phase = mem_set_phase(MEM_PHASE_BACKWARD);
+  const Mat2D *g_o = nn_output(g);
+
+  for (size_t i = 0; i < g_o->rows; ++i) {
+    g_o->elems[i] = o->elems[i] - y->elems[i];
+  }
+
+  for (size_t l = g->layer_count - 1; l > stop; --l) {
+    double t = nn->prof ? omp_get_wtime() : 0.0;
+    nn_recompute(nn, l);
+
+    if (g->layers[l].kind == DENSE) {
+      #pragma omp parallel for shared(g, nn, l) // TODO: see if this is worth with the atomics
+      for (size_t i = 0; i < g->layers[l].dl.a.rows; ++i) {
+        const double de = g->layers[l].dl.a.elems[i];
+        const double da = dactf(nn->layers[l].dl.a.elems[i], g->layers[l].act);
+        const double delta = de * da;
+        // a dead relu unit passes nothing back
+        if (delta == 0.0) continue;
+        #pragma omp atomic
+        g->layers[l].dl.bias += delta;
+
+        // the sizes come from nn, g may have been copied before its input was set
+        const Mat2D *prev_act = nn_layer_output(&g->layers[l-1]);
+        const Mat2D *in = nn_layer_output(&nn->layers[l-1]);
+        for(size_t j = 0; j < in->rows; ++j) {
+          const double w = MAT2D_GET(nn->layers[l].dl.ws, j, i);
+          const double a = in->elems[j];
+          if (l > 1) {
+            #pragma omp atomic
+            prev_act->elems[j] += w * delta;
+          }
+          if (a != 0.0) MAT2D_GET(g->layers[l].dl.ws, j, i) += a * delta;
+        }
+      }
+    } else if (g->layers[l].kind == SEPARABLE_CONV2D) {
+      separable_backward(nn, g, l);
+    } else if (g->layers[l].kind == BATCH_NORM) {
+      batch_norm_backward(nn, g, l);
+    } else if (l > 1 && (g->layers[l].kind == MAX_POOL || g->layers[l].kind == AVG_POOL)) {
+      pool_backward(nn, g, l);
+    } else if (l > 1 && g->layers[l].kind == FLATTEN) {
+      flatten_backward(g, l);
+    } else if (l > 1 && g->layers[l].kind == GLOBAL_AVG_POOL) {
+      global_pool_backward(g, l);
+    }
+
+    if (nn->prof) profile_add(nn, l, PHASE_BACKWARD, t);
+  }
+
+  mem_set_phase(phase);
+}
+
+static nn_t backprop_layers(nn_t *nn, const Mat2D *y, size_t stop) {
+  nn_t g = nn_copy_structure(nn);
+  nn_init_zero(&g);
+  backprop_into(nn, &g, y, stop);
+  return g;
+}
+
+nn_t nn_backprop(nn_t *nn, const Mat2D *y) {
+  return backprop_layers(nn, y, 0);
+}
+
+// the blocks nn_learn updates, in layer order: the weights and the bias of every dense layer, the params
+// of every separable and batch norm layer
+static size_t trainable_params(const nn_t *nn) {
+  size_t n = 0;
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (nn->layers[l].kind == DENSE) n += nn->layers[l].dl.ws.rows * nn->layers[l].dl.ws.cols + 1;
+    else if (nn->layers[l].kind == SEPARABLE_CONV2D) n += separable_params(&nn->layers[l].sl);
+    else if (nn->layers[l].kind == BATCH_NORM) n += 2 * nn->layers[l].bn.features;
+  }
+  return n;
+}
+
+// copies the trainable blocks of nn to buf, or back from buf when unpack is set
+static void pack_trainable(nn_t *nn, double *buf, int unpack) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    double *block = NULL;
+    size_t n = 0;
+    switch (nn->layers[l].kind) {
+      case DENSE: {
+        DenseLayer *dl = &nn->layers[l].dl;
+        block = dl->ws.elems;
+        n = dl->ws.rows * dl->ws.cols;
+        if (unpack) dl->bias = buf[n];
+        else buf[n] = dl->bias;
+        break;
+      }
+      case SEPARABLE_CONV2D:
+        block = nn->layers[l].sl.params;
+        n = separable_params(&nn->layers[l].sl);
+        break;
+      case BATCH_NORM:
+        block = nn->layers[l].bn.params;
+        n = 2 * nn->layers[l].bn.features;
+        break;
+      default:
+        continue;
+    }
+
+    if (unpack) memcpy(block, buf, sizeof(double) * n);
+    else memcpy(buf, block, sizeof(double) * n);
+    buf += n + (nn->layers[l].kind == DENSE);
+  }
+}
+
+// sums the gradients of every rank in place, every rank then takes the same step
+static void dist_sum_gradient(dist_t *dist, nn_t *g) {
+  const size_t n = trainable_params(g);
+  double *buf = (double *) mem_alloc(sizeof(double) * n, MEM_SCRATCH);
+  assert(buf != NULL && "not enough memory");
+
+  pack_trainable(g, buf, 0);
+  dist_allreduce(dist, buf, n);
+  pack_trainable(g, buf, 1);
+  mem_free(buf);
+}
+
+size_t nn_input_view(const nn_t *nn, const double *row, Mat2D *x) {
+  const InputLayer *il = &nn->layers[0].il;
+
+  if (il->width == 1) {
+    const mat_t col = mat_view((double *) row, 2, (size_t[]) { il->channels * il->height, 1 });
+    x[0] = mat_to_Mat2D(&col);
+    return 1;
+  }
+
+  const mat_t planes = mat_view((double *) row, 3, (size_t[]) { il->channels, il->height, il->width });
+  for (size_t c = 0; c < il->channels; ++c) {
+    const mat_t plane = mat_select(&planes, 0, c);
+    x[c] = mat_to_Mat2D(&plane);
+  }
+  return il->channels;
+}
+
+// views the i-th row of data as an input of nn, x must have room for one Mat2D per input channel
+static size_t nn_row_input(const nn_t *nn, const Mat2D *data, size_t i, Mat2D *x) {
+  assert(data->cols == nn->layers[0].il.channels * nn->layers[0].il.height * nn->layers[0].il.width && "data rows do not match the input layer");
+  return nn_input_view(nn, &data->elems[i * data->cols], x);
+}
+
+// one row of data through nn, then back to the output of layer stop
+static nn_t fit_sample(nn_t *nn, const Mat2D *data, const Mat2D *labels, size_t i, size_t stop) {
+  Mat2D x[nn->layers[0].il.channels ? nn->layers[0].il.channels : 1];
+  size_t c = nn_row_input(nn, data, i, x);
+
+  Mat2D y = (Mat2D) {
+    .cols = 1,
+    .rows = labels->cols,
+    .elems = &labels->elems[i * labels->cols],
+  };
+
+  nn_forward(nn, x, c);
+  return backprop_layers(nn, &y, stop);
+}
+
+static void fit_step(nn_t *nn, nn_t *total_g, size_t batch_size, double lr) {
+  if (nn->dist) dist_sum_gradient(nn->dist, total_g);
+  nn_learn(nn, total_g, nn->dist ? batch_size * nn->dist->size : batch_size, lr);
+  nn_init_zero(total_g);
+  if (nn->ckpt && nn->ckpt_every && nn->opt.t % nn->ckpt_every == 0) nn_checkpoint(nn);
+  mem_end_step();
+}
+
+// a BATCH_NORM needs the whole batch before any sample can go past it, so each batch takes a pass per
+// layer: the forward ones gather the mean and var of every BATCH_NORM from the lowest up, the backward
+// ones the means of delta and delta x̂ from the highest down, then the step runs on both
+static void fit_batch_norm(nn_t *nn, nn_t *total_g, const Mat2D *data, const Mat2D *labels, size_t batch_size, double lr) {
+  Mat2D x[nn->layers[0].il.channels ? nn->layers[0].il.channels : 1];
+
+  // the batches of the steps nn_fit takes, after the first row and then every batch_size rows
+  for (size_t begin = 0, end = 1; end <= data->rows; begin = end, end += batch_size) {
+    for (size_t l = 1; l < nn->layer_count; ++l) {
+      BatchNormLayer *bn = &nn->layers[l].bn;
+      if (nn->layers[l].kind != BATCH_NORM) continue;
+
+      memset(bn->batch, 0, sizeof(double) * 2 * bn->features);
+      for (size_t i = begin; i < end; ++i) {
+        size_t c = nn_row_input(nn, data, i, x);
+        forward_layers(nn, x, c, l);
+        batch_norm_gather(nn, l);
+      }
+      batch_norm_finish(nn, l, end - begin);
+    }
+
+    for (size_t l = nn->layer_count - 1; l > 0; --l) {
+      BatchNormLayer *bn = &nn->layers[l].bn;
+      if (nn->layers[l].kind != BATCH_NORM) continue;
+
+      memset(&bn->batch[2 * bn->features], 0, sizeof(double) * 2 * bn->features);
+      for (size_t i = begin; i < end; ++i) {
+        nn_t g = fit_sample(nn, data, labels, i, l);
+        batch_norm_gather_grad(nn, &g, l);
+        nn_destroy(&g);
+      }
+      batch_norm_finish(nn, l, end - begin);
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+      nn_t g = fit_sample(nn, data, labels, i, 0);
+      nn_add_gradient(total_g, &g);
+      nn_destroy(&g);
+    }
+    batch_norm_track(nn, end - begin);
+    fit_step(nn, total_g, batch_size, lr);
+  }
+}
+
+// each row of the train_data is an input
+void nn_fit(nn_t *nn, const Mat2D *train_data, const Mat2D *labels, size_t batch_size, double lr) {
+  assert(nn_output(nn)->rows == labels->cols && train_data->rows == labels->rows);
+  assert(batch_size != 0);
+  int batch_norm = 0;
+  // the forward pass would read the inference copies, not the weights nn_learn updates
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const layer_t *layer = &nn->layers[l];
+    assert((layer->kind != DENSE || (layer->dl.q == NULL && layer->dl.h == NULL)) && "nn_dequantize and nn_full_weights before training");
+    assert((layer->kind != CONV2D || (layer->cl.q == NULL && layer->cl.h == NULL)) && "nn_dequantize and nn_full_weights before training");
+    batch_norm |= layer->kind == BATCH_NORM;
+  }
+  nn_t total_g = nn_copy_structure(nn);
+  nn_init_zero(&total_g);
+
+  if (batch_norm) {
+    fit_batch_norm(nn, &total_g, train_data, labels, batch_size, lr);
+    nn_destroy(&total_g);
+    return;
+  }
+
+  for (size_t i = 0; i < train_data->rows; ++i) {
+    nn_t g = fit_sample(nn, train_data, labels, i, 0);
+    nn_add_gradient(&total_g, &g);
+    if (i % batch_size == 0) fit_step(nn, &total_g, batch_size, lr);
+
+    nn_destroy(&g);
+  }
+
+  nn_destroy(&total_g);
+}
+
+// the steps of other threads may land between these reads and writes, that is the point of hogwild.
+// the rows a zero input left out hold no gradient, the others are zeroed again for the next sample
+static void hogwild_step(DenseLayer *dl, DenseLayer *g, const Mat2D *prev, double lr) {
+  for (size_t j = 0; j < dl->ws.rows; ++j) {
+    if (prev->elems[j] == 0.0) continue;
+    double *w = &dl->ws.elems[j * dl->ws.cols];
+    double *gw = &g->ws.elems[j * g->ws.cols];
+    for (size_t i = 0; i < dl->ws.cols; ++i) {
+      w[i] -= lr * gw[i];
+      gw[i] = 0.0;
+    }
+  }
+  dl->bias -= lr * g->bias;
+  g->bias = 0.0;
+  memset(g->a.elems, 0, sizeof(double) * g->a.rows);
+}
+
+static double sample_loss(const double *o, const double *y, size_t n, int cross_entropy) {
+  double loss = 0.0;
+  for (size_t j = 0; j < n; ++j) {
+    loss += cross_entropy ? -y[j] * log(fmax(o[j], 1e-12)) : (o[j] - y[j]) * (o[j] - y[j]) / n;
+  }
+  return loss;
+}
+
+nn_train_stats_t nn_fit_hogwild(nn_t *nn, const Mat2D *train_data, const Mat2D *labels, double lr, int threads) {
+  assert(nn_output(nn)->rows == labels->cols && train_data->rows == labels->rows);
+  assert(nn->opt.kind == SGD && "the optimizer state would be shared by every thread");
+  assert(nn->arena == NULL && nn->dist == NULL);
+  assert(nn->layers[0].il.width == 1 && "each row is one input vector");
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const DenseLayer *dl = &nn->layers[l].dl;
+    assert(nn->layers[l].kind == DENSE && "only dense layers can be trained");
+    assert(dl->q == NULL && dl->h == NULL && dl->sparse == NULL && "the inference copies would go stale");
+    assert(dl->mask == NULL && "pruned weights would grow back");
+  }
+
+  const int cross_entropy = nn->layers[nn->layer_count - 1].act == SOFTMAX;
+  const double start = omp_get_wtime();
+  double loss = 0.0;
+
+  #pragma omp parallel num_threads(threads > 0 ? threads : omp_get_max_threads()) reduction(+:loss)
+  {
+    nn_t ctx = nn_new_context(nn);
+    // one gradient per thread for every sample, hogwild_step leaves it zeroed
+    nn_t g = nn_copy_structure(&ctx);
+    nn_init_zero(&g);
+    Mat2D x;
+
+    #pragma omp for schedule(dynamic, 16)
+    for (size_t i = 0; i < train_data->rows; ++i) {
+      Mat2D y = (Mat2D) { .cols = 1, .rows = labels->cols, .elems = &labels->elems[i * labels->cols] };
+
+      // the context copied the biases, take the latest ones
+      for (size_t l = 1; l < ctx.layer_count; ++l) {
+        ctx.layers[l].dl.bias = nn->layers[l].dl.bias;
+      }
+
+      nn_row_input(&ctx, train_data, i, &x);
+      nn_forward(&ctx, &x, 1);
+      loss += sample_loss(nn_output(&ctx)->elems, y.elems, y.rows, cross_entropy);
+
+      backprop_into(&ctx, &g, &y, 0);
+      for (size_t l = 1; l < ctx.layer_count; ++l) {
+        hogwild_step(&nn->layers[l].dl, &g.layers[l].dl, nn_layer_output(&ctx.layers[l - 1]), lr);
+      }
+    }
+
+    nn_destroy(&g);
+    nn_destroy(&ctx);
+  }
+
+  const double seconds = omp_get_wtime() - start;
+  return (nn_train_stats_t) {
+    .samples = train_data->rows,
+    .seconds = seconds,
+    .throughput = seconds > 0.0 ? train_data->rows / seconds : 0.0,
+    .loss = train_data->rows ? loss / train_data->rows : 0.0,
+  };
+}
+
+static double max_abs(const Mat2D *m, size_t count) {
+  double max = 0.0;
+  for (size_t c = 0; c < count; ++c) {
+    for (size_t i = 0; i < m[c].rows * m[c].cols; ++i) {
+      max = fmax(max, fabs(m[c].elems[i]));
+    }
+  }
+  return max;
+}
+
+static QLayer *new_qlayer(const Mat2D *ws, double in_max) {
+  QLayer *q = (QLayer *) mem_alloc(sizeof(QLayer), MEM_WEIGHTS);
+  assert(q != NULL && "not enough memory");
+
+  q->ws = alloc_QMat2D(ws->rows, ws->cols, MEM_WEIGHTS);
+  quantize_rows_Mat2D(ws, &q->ws);
+  q->in_scale = in_max > 0.0 ? in_max / 127.0 : 1.0f;
+
+  return q;
+}
+
+double nn_quantize(nn_t *nn, const Mat2D *samples) {
+  const size_t channels = nn->layers[0].il.channels ? nn->layers[0].il.channels : 1;
+  const size_t out_size = nn_output(nn)->rows * nn_output(nn)->cols;
+  double *in_max = (double *) mem_calloc(nn->layer_count, sizeof(double), MEM_SCRATCH);
+  Mat2D fp_out = alloc_Mat2D(samples->rows, out_size, MEM_SCRATCH);
+  Mat2D x[channels];
+  assert(nn->arena == NULL && "calibration reads every layer output, quantize before the inference plan");
+
+  nn_dequantize(nn);
+
+  // calibration, the scale of each layer input is the max |activation| seen on the samples
+  for (size_t i = 0; i < samples->rows; ++i) {
+    size_t c = nn_row_input(nn, samples, i, x);
+    nn_forward(nn, x, c);
+    memcpy(&fp_out.elems[i * out_size], nn_output(nn)->elems, sizeof(double) * out_size);
+
+    for (size_t l = 1; l < nn->layer_count; ++l) {
+      const Mat2D *in = l == 1 ? x : nn_layer_output(&nn->layers[l - 1]);
+      if (nn->layers[l].kind == DENSE) {
+        in_max[l] = fmax(in_max[l], max_abs(in, 1));
+      } else if (nn->layers[l].kind == CONV2D) {
+        in_max[l] = fmax(in_max[l], max_abs(in, nn->layers[l].cl.channels));
+      }
+    }
+  }
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    if (layer->kind == DENSE) {
+      Mat2D ws_t = transpose_Mat2D(&layer->dl.ws);
+      layer->dl.q = new_qlayer(&ws_t, in_max[l]);
+      destroy_Mat2D(&ws_t);
+    } else if (layer->kind == CONV2D) {
+      Mat2D ws = conv_weight_rows(&layer->cl);
+      layer->cl.q = new_qlayer(&ws, in_max[l]);
+      destroy_Mat2D(&ws);
+    }
+  }
+
+  double err = 0.0;
+  for (size_t i = 0; i < samples->rows; ++i) {
+    size_t c = nn_row_input(nn, samples, i, x);
+    nn_forward(nn, x, c);
+    for (size_t j = 0; j < out_size; ++j) {
+      err = fmax(err, fabs(nn_output(nn)->elems[j] - MAT2D_GET(fp_out, i, j)));
+    }
+  }
+
+  destroy_Mat2D(&fp_out);
+  mem_free(in_max);
+  return err;
+}
+
+void nn_dequantize(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (nn->layers[l].kind == DENSE) {
+      destroy_qlayer(&nn->layers[l].dl.q);
+    } else if (nn->layers[l].kind == CONV2D) {
+      destroy_qlayer(&nn->layers[l].cl.q);
+    }
+  }
+}
+
+static HMat2D *new_half(const Mat2D *ws, enum half_format format) {
+  HMat2D *h = (HMat2D *) mem_alloc(sizeof(HMat2D), MEM_WEIGHTS);
+  assert(h != NULL && "not enough memory");
+
+  *h = alloc_HMat2D(ws->rows, ws->cols, format, MEM_WEIGHTS);
+  half_Mat2D(ws, h);
+  return h;
+}
+
+void nn_half_weights(nn_t *nn, enum half_format format) {
+  nn_full_weights(nn);
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    if (layer->kind == DENSE) {
+      Mat2D ws_t = transpose_Mat2D(&layer->dl.ws);
+      layer->dl.h = new_half(&ws_t, format);
+      destroy_Mat2D(&ws_t);
+    } else if (layer->kind == CONV2D) {
+      Mat2D ws = conv_weight_rows(&layer->cl);
+      layer->cl.h = new_half(&ws, format);
+      destroy_Mat2D(&ws);
+    }
+  }
+}
+
+void nn_full_weights(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (nn->layers[l].kind == DENSE) {
+      destroy_half(&nn->layers[l].dl.h);
+    } else if (nn->layers[l].kind == CONV2D) {
+      destroy_half(&nn->layers[l].cl.h);
+    }
+  }
+}
+
+static const char *layer_name(enum layer_kind kind) {
+  switch (kind) {
+    case _INPUT: return "input";
+    case DENSE: return "dense";
+    case CONV2D: return "conv2d";
+    case SEPARABLE_CONV2D: return "sep_conv2d";
+    case BATCH_NORM: return "batch_norm";
+    case MAX_POOL: return "max_pool";
+    case AVG_POOL: return "avg_pool";
+    case GLOBAL_AVG_POOL: return "global_avg_pool";
+    case FLATTEN: return "flatten";
+    default: assert(0 && "unreachable");
+  }
+}
+
+static size_t weight_bytes(const QLayer *q, const HMat2D *h) {
+  return q ? sizeof(int8_t) : h ? sizeof(uint16_t) : sizeof(double);
+}
+
+// flops and bytes moved by one call of each layer, fused layers cost nothing on
+// their own, their work is accounted to the layer that computes them
+static void nn_layer_costs(nn_t *nn) {
+  const InputLayer *il = &nn->layers[0].il;
+  size_t in = il->height * il->width * (il->channels ? il->channels : 1);
+  size_t channels = il->channels;
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    LayerProfile *fwd = &nn->prof[l][PHASE_FORWARD];
+    LayerProfile *bwd = &nn->prof[l][PHASE_BACKWARD];
+    size_t out = in;
+
+    switch (layer->kind) {
+      case DENSE:
+        out = layer->dl.a.rows;
+        fwd->flops = 2.0 * in * out + 2.0 * out;
+        fwd->bytes = weight_bytes(layer->dl.q, layer->dl.h) * in * out + sizeof(double) * (in + out);
+        if (layer->dl.sparse && !layer->dl.q && !layer->dl.h) {
+          const CSRMat2D *sp = layer->dl.sparse;
+          fwd->flops = 2.0 * sp->nnz + 2.0 * out;
+          fwd->bytes = (sizeof(double) + sizeof(uint32_t)) * sp->nnz + sizeof(size_t) * (out + 1) + sizeof(double) * (in + out);
+        }
+        bwd->flops = 4.0 * in * out + 2.0 * out;
+        bwd->bytes = sizeof(double) * (3.0 * in * out + 2.0 * in + 2.0 * out);
+        break;
+      case CONV2D: {
+        const layer_t *next = l + 1 < nn->layer_count ? &nn->layers[l + 1] : NULL;
+        const size_t k_elems = layer->cl.kernels[0].rows * layer->cl.kernels[0].cols;
+        const size_t plane = layer->cl.a[0].rows * layer->cl.a[0].cols;
+        size_t pixels = plane;
+        out = layer->cl.kernel_count * plane;
+
+        if (next && (next->fusion & FUSED) && next->kind != FLATTEN) {
+          // only the pixels covered by the pooling windows are computed
+          pixels = next->pl.a[0].rows * next->pl.a[0].cols * next->pl.pool_size * next->pl.pool_size;
+          out = layer->cl.kernel_count * next->pl.a[0].rows * next->pl.a[0].cols;
+        }
+
+        fwd->flops = layer->cl.kernel_count * pixels * (2.0 * channels * k_elems + 2.0);
+        fwd->bytes = weight_bytes(layer->cl.q, layer->cl.h) * layer->cl.kernel_count * channels * k_elems
+          + sizeof(double) * (in + out);
+        channels = layer->cl.kernel_count;
+        out = channels * plane;
+        break;
+      }
+      case SEPARABLE_CONV2D: {
+        const size_t k2 = layer->sl.kernel_size * layer->sl.kernel_size;
+        const size_t pixels = layer->sl.dw.cols;
+        out = layer->sl.kernel_count * pixels;
+        fwd->flops = 2.0 * channels * pixels * k2 + layer->sl.kernel_count * pixels * (2.0 * channels + 2.0);
+        fwd->bytes = sizeof(double) * (separable_params(&layer->sl) + in + 2.0 * channels * pixels + out);
+        // the weight gradients and the input gradient, each as costly as the forward pass
+        bwd->flops = 2.0 * fwd->flops;
+        bwd->bytes = sizeof(double) * (2.0 * separable_params(&layer->sl) + 2.0 * in + 3.0 * channels * pixels + 2.0 * out);
+        channels = layer->sl.kernel_count;
+        break;
+      }
+      case BATCH_NORM:
+        fwd->flops = 2.0 * out;
+        fwd->bytes = sizeof(double) * (2.0 * out + 4.0 * layer->bn.features);
+        bwd->flops = 6.0 * out;
+        bwd->bytes = sizeof(double) * (4.0 * out + 4.0 * layer->bn.features);
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+        out = channels * layer->pl.a[0].rows * layer->pl.a[0].cols;
+        if (layer->fusion & FUSED) break;
+        fwd->flops = (double) out * layer->pl.pool_size * layer->pl.pool_size;
+        fwd->bytes = sizeof(double) * (out * layer->pl.pool_size * layer->pl.pool_size + out);
+        break;
+      case GLOBAL_AVG_POOL:
+        out = layer->gp.channels;
+        fwd->flops = in;
+        fwd->bytes = sizeof(double) * (in + out);
+        bwd->flops = in;
+        bwd->bytes = sizeof(double) * (in + out);
+        break;
+      case FLATTEN:
+        out = layer->fl.a.rows;
+        if (layer->fusion & FUSED) break;
+        fwd->bytes = 2.0 * sizeof(double) * out;
+        break;
+      default:
+        assert(0 && "unreachable");
+    }
+
+    in = out;
+  }
+}
+
+void nn_enable_profiling(nn_t *nn) {
+  mem_free(nn->prof);
+  nn->prof = mem_calloc(nn->layer_count, sizeof(*nn->prof), MEM_OTHER);
+  assert(nn->prof != NULL && "not enough memory");
+
+  nn_layer_costs(nn);
+}
+
+void nn_disable_profiling(nn_t *nn) {
+  mem_free(nn->prof);
+  nn->prof = NULL;
+}
+
+void nn_reset_profile(nn_t *nn) {
+  for (size_t l = 0; nn->prof && l < nn->layer_count; ++l) {
+    for (size_t p = 0; p < PHASE_COUNT; ++p) {
+      nn->prof[l][p].time = 0.0;
+      nn->prof[l][p].calls = 0;
+    }
+  }
+}
+
+const LayerProfile *nn_profile(const nn_t *nn, size_t layer, enum nn_phase phase) {
+  assert(nn->prof != NULL && layer < nn->layer_count && phase < PHASE_COUNT);
+  return &nn->prof[layer][phase];
+}
+
+void nn_print_profile(const nn_t *nn) {
+  const char *phases[PHASE_COUNT] = { "fwd", "bwd" };
+  assert(nn->prof != NULL);
+
+  printf("%-5s %-10s %-5s %10s %12s %12s %10s %10s\n", "layer", "kind", "phase", "calls", "total ms", "avg us", "GFLOP/s", "GB/s");
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    for (size_t p = 0; p < PHASE_COUNT; ++p) {
+      const LayerProfile *lp = &nn->prof[l][p];
+      if (lp->calls == 0) continue;
+
+      printf("%-5zu %-10s %-5s %10zu %12.3f %12.3f %10.3f %10.3f\n",
+             l, layer_name(nn->layers[l].kind), phases[p], lp->calls, lp->time * 1e3, lp->time / lp->calls * 1e6,
+             lp->time > 0.0 ? lp->flops * lp->calls / lp->time / 1e9 : 0.0,
+             lp->time > 0.0 ? lp->bytes * lp->calls / lp->time / 1e9 : 0.0);
+    }
+  }
+}
+
+static size_t planes_bytes(const Mat2D *planes, size_t count, unsigned fusion) {
+  if (fusion & OUTPUT_VIEW || planes[0].elems == NULL) return 0;
+  return sizeof(double) * count * planes[0].rows * planes[0].cols;
+}
+
+void nn_memory_footprint(const nn_t *nn, size_t bytes[MEM_KIND_COUNT]) {
+  memset(bytes, 0, sizeof(size_t) * MEM_KIND_COUNT);
+  size_t recomputed = 0, segment = 0, kept_scratch = 0;
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const layer_t *layer = &nn->layers[l];
+    size_t ws, a, scratch = 0;
+
+    switch (layer->kind) {
+      case DENSE:
+        ws = sizeof(double) * layer->dl.ws.rows * layer->dl.ws.cols;
+        a = sizeof(double) * layer->dl.a.rows * layer->dl.a.cols;
+        bytes[MEM_WEIGHTS] += ws + (layer->dl.q ? layer->dl.q->ws.rows * (layer->dl.q->ws.cols + sizeof(float)) : 0);
+        // the segments of recomputed outputs share one buffer, as large as the largest segment
+        if (layer->fusion & RECOMPUTED) {
+          segment = (nn->layers[l - 1].fusion & RECOMPUTED ? segment : 0) + a;
+          recomputed = segment > recomputed ? segment : recomputed;
+        } else {
+          bytes[MEM_ACTIVATIONS] += a;
+        }
+        // the nonzero indices and the int8 input stay allocated
+        kept_scratch += (sizeof(size_t) + sizeof(int8_t)) * layer->dl.ws.rows;
+        // the gradient of every sample plus the batch accumulator
+        bytes[MEM_GRADIENTS] += 2 * (ws + a);
+        scratch = layer->dl.q ? 0 : ws;
+        if (layer->dl.h) {
+          bytes[MEM_WEIGHTS] += sizeof(uint16_t) * layer->dl.ws.rows * layer->dl.ws.cols;
+          if (!layer->dl.q) scratch = sizeof(float) * layer->dl.ws.rows;
+        }
+        if (layer->dl.sparse) {
+          const CSRMat2D *sp = layer->dl.sparse;
+          bytes[MEM_WEIGHTS] += (sizeof(double) + sizeof(uint32_t)) * sp->nnz + sizeof(size_t) * (sp->rows + 1);
+          if (!layer->dl.q && !layer->dl.h) scratch = 0;
+        }
+        if (layer->dl.mask) bytes[MEM_WEIGHTS] += layer->dl.ws.rows * layer->dl.ws.cols;
+        break;
+      case CONV2D: {
+        const size_t k_elems = layer->cl.kernels[0].rows * layer->cl.kernels[0].cols;
+        const size_t pixels = layer->cl.a[0].rows * layer->cl.a[0].cols;
+        bytes[MEM_WEIGHTS] += sizeof(double) * layer->cl.kernel_count * (layer->cl.channels * k_elems + 1);
+        if (layer->cl.q) {
+          bytes[MEM_WEIGHTS] += layer->cl.q->ws.rows * (layer->cl.q->ws.cols + sizeof(float));
+          scratch = pixels * (layer->cl.channels * k_elems + sizeof(float)) + sizeof(double) * layer->cl.kernel_count * pixels;
+        }
+        if (layer->cl.h) {
+          bytes[MEM_WEIGHTS] += sizeof(uint16_t) * layer->cl.kernel_count * layer->cl.channels * k_elems;
+          if (!layer->cl.q) scratch = sizeof(float) * pixels * layer->cl.channels * k_elems + sizeof(double) * layer->cl.kernel_count * pixels;
+        }
+        bytes[MEM_ACTIVATIONS] += planes_bytes(layer->cl.a, layer->cl.kernel_count, layer->fusion);
+        break;
+      }
+      case SEPARABLE_CONV2D: {
+        const size_t params = sizeof(double) * separable_params(&layer->sl);
+        const size_t planes = sizeof(double) * layer->sl.kernel_count * layer->sl.dw.cols;
+        ws = sizeof(double) * layer->sl.dw.rows * layer->sl.dw.cols;
+        bytes[MEM_WEIGHTS] += params;
+        bytes[MEM_ACTIVATIONS] += ws + planes_bytes(layer->sl.a, layer->sl.kernel_count, layer->fusion);
+        bytes[MEM_GRADIENTS] += 2 * (params + ws + planes);
+        break;
+      }
+      case BATCH_NORM: {
+        const size_t params = sizeof(double) * 2 * layer->bn.features;
+        a = sizeof(double) * batch_norm_planes(&layer->bn) * layer->bn.a[0].rows * layer->bn.a[0].cols;
+        // gamma and beta, then the running mean and var and the four batch statistics
+        bytes[MEM_WEIGHTS] += 4 * params;
+        bytes[MEM_ACTIVATIONS] += layer->bn.channels ? planes_bytes(layer->bn.a, layer->bn.channels, layer->fusion) : a;
+        bytes[MEM_GRADIENTS] += 2 * (params + a);
+        break;
+      }
+      case MAX_POOL:
+      case AVG_POOL:
+        a = sizeof(double) * layer->pl.channels * layer->pl.a[0].rows * layer->pl.a[0].cols;
+        bytes[MEM_ACTIVATIONS] += planes_bytes(layer->pl.a, layer->pl.channels, layer->fusion);
+        bytes[MEM_GRADIENTS] += 2 * a;
+        break;
+      case GLOBAL_AVG_POOL:
+        bytes[MEM_ACTIVATIONS] += sizeof(double) * layer->gp.channels;
+        bytes[MEM_GRADIENTS] += 2 * sizeof(double) * layer->gp.channels;
+        break;
+      case FLATTEN:
+        bytes[MEM_ACTIVATIONS] += sizeof(double) * layer->fl.a.rows;
+        bytes[MEM_GRADIENTS] += 2 * sizeof(double) * layer->fl.a.rows;
+        break;
+      default:
+        assert(0 && "unreachable");
+    }
+
+    // temporaries only live while their layer runs
+    bytes[MEM_SCRATCH] = scratch > bytes[MEM_SCRATCH] ? scratch : bytes[MEM_SCRATCH];
+  }
+
+  bytes[MEM_SCRATCH] += kept_scratch;
+  bytes[MEM_ACTIVATIONS] += recomputed;
+  if (nn->arena) bytes[MEM_ACTIVATIONS] = arena_bytes(nn);
+
+  bytes[MEM_OTHER] = sizeof(layer_t) * nn->capacity + (nn->prof ? sizeof(*nn->prof) * nn->layer_count : 0);
+}
+
+nn_t nn_new_context(const nn_t *nn) {
+  nn_t ctx = (nn_t) {
+    .layer_count = nn->layer_count,
+    .capacity = nn->layer_count,
+    .layers = (layer_t *) mem_alloc(sizeof(layer_t) * nn->layer_count, MEM_OTHER),
+    .shared_weights = 1,
+  };
+  assert(ctx.layers != NULL && "not enough memory");
+
+  memcpy(ctx.layers, nn->layers, sizeof(layer_t) * nn->layer_count);
+  ctx.layers[0].il.input = NULL;
+
+  for (size_t l = 1; l < ctx.layer_count; ++l) {
+    layer_t *layer = &ctx.layers[l];
+    layer_t *next = l + 1 < ctx.layer_count ? &ctx.layers[l + 1] : NULL;
+    const Mat2D *shape = nn_layer_output(&nn->layers[l]);
+
+    switch (layer->kind) {
+      case DENSE:
+        layer->dl.a = alloc_Mat2D(shape->rows, shape->cols, MEM_ACTIVATIONS);
+        alloc_dense_scratch(&layer->dl);
+        layer->fusion &= ~RECOMPUTED;
+        break;
+      case CONV2D:
+        layer->cl.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * layer->cl.kernel_count, MEM_ACTIVATIONS);
+        alloc_planes(layer, next, layer->cl.a, layer->cl.kernel_count, shape->rows, shape->cols);
+        break;
+      case SEPARABLE_CONV2D:
+        layer->sl.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * layer->sl.kernel_count, MEM_ACTIVATIONS);
+        alloc_planes(layer, next, layer->sl.a, layer->sl.kernel_count, shape->rows, shape->cols);
+        layer->sl.dw = alloc_Mat2D(layer->sl.dw.rows, layer->sl.dw.cols, MEM_ACTIVATIONS);
+        break;
+      case BATCH_NORM:
+        layer->bn.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * batch_norm_planes(&layer->bn), MEM_ACTIVATIONS);
+        if (layer->bn.channels) alloc_planes(layer, next, layer->bn.a, layer->bn.channels, shape->rows, shape->cols);
+        else layer->bn.a[0] = alloc_Mat2D(shape->rows, 1, MEM_ACTIVATIONS);
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+        layer->pl.a = (Mat2D *) mem_alloc(sizeof(Mat2D) * layer->pl.channels, MEM_ACTIVATIONS);
+        alloc_planes(layer, next, layer->pl.a, layer->pl.channels, shape->rows, shape->cols);
+        break;
+      case GLOBAL_AVG_POOL:
+        layer->gp.a = alloc_Mat2D(layer->gp.channels, 1, MEM_ACTIVATIONS);
+        break;
+      case FLATTEN:
+        // a fused flatten buffer was allocated with the planes of the previous layer
+        if (!(layer->fusion & FUSED)) layer->fl.a = alloc_Mat2D(shape->rows, 1, MEM_ACTIVATIONS);
+        layer->fl.viewed = 0;
+        break;
+      default:
+        assert(0 && "unreachable");
+    }
+  }
+
+  if (nn->arena) nn_plan(&ctx, 1);
+  return ctx;
+}
+
+void nn_set_numa(nn_t *nn, NumaPolicy policy) {
+  nn->numa = policy;
+  if (policy.pin) topo_pin_threads(0);
+  build_replicas(nn);
+}
+
+static void cpu_model(char *buf, size_t size) {
+  char line[256];
+  snprintf(buf, size, "unknown");
+
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  while (fgets(line, sizeof(line), f)) {
+    char *value = strchr(line, ':');
+    if (strncmp(line, "model name", 10) != 0 || value == NULL) continue;
+
+    value += strspn(value, ": \t");
+    value[strcspn(value, "\n")] = '\0';
+    snprintf(buf, size, "%s", value);
+    break;
+  }
+  fclose(f);
+}
+
+// the shape the choice of layer l depends on, 0 when the layer is not tuned
+static int tune_key(const nn_t *nn, size_t l, char *key, size_t size) {
+  const layer_t *layer = &nn->layers[l];
+  const layer_t *next = l + 1 < nn->layer_count ? &nn->layers[l + 1] : NULL;
+
+  if (layer->kind == DENSE && !layer->dl.q && !layer->dl.h && !layer->dl.sparse) {
+    snprintf(key, size, "dense %zu %zu", layer->dl.ws.rows, layer->dl.ws.cols);
+    return 1;
+  }
+  if (layer->kind != CONV2D || layer->cl.q || layer->cl.h) return 0;
+
+  const InputLayer *il = &nn->layers[0].il;
+  const size_t rows = l == 1 ? il->height : nn_layer_output(&nn->layers[l - 1])[0].rows;
+  const size_t cols = l == 1 ? il->width : nn_layer_output(&nn->layers[l - 1])[0].cols;
+  const int pooled = next && (next->fusion & FUSED) && next->kind != FLATTEN;
+  snprintf(key, size, "conv2d %zu %zu %zu %zux%zu %d %d %s %zu", layer->cl.channels, layer->cl.kernel_count,
+           layer->cl.kernels[0].rows, rows, cols, layer->cl.stride, layer->cl.padding,
+           pooled ? layer_name(next->kind) : "none", pooled ? next->pl.pool_size : 0);
+  return 1;
+}
+
+// lines of cpu model, thread count, key and choice, separated by tabs
+static int cache_lookup(const char *path, const char *cpu, int threads, const char *key, KernelChoice *kc) {
+  char line[512];
+  int found = 0;
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return 0;
+  while (!found && fgets(line, sizeof(line), f)) {
+    char *fields[4];
+    char *save = NULL;
+    size_t n = 0;
+    for (char *t = strtok_r(line, "\t\n", &save); t && n < 4; t = strtok_r(NULL, "\t\n", &save)) fields[n++] = t;
+
+    int algo, tile, th;
+    if (n == 4 && strcmp(fields[0], cpu) == 0 && atoi(fields[1]) == threads && strcmp(fields[2], key) == 0 &&
+        sscanf(fields[3], "%d %d %d", &algo, &tile, &th) == 3) {
+      *kc = (KernelChoice) { .algo = algo, .tile = tile, .threads = th };
+      found = 1;
+    }
+  }
+
+  fclose(f);
+  return found;
+}
+
+static void cache_store(const char *path, const char *cpu, int threads, const char *key, const KernelChoice *kc) {
+  FILE *f = fopen(path, "a");
+  if (f == NULL) return;
+  fprintf(f, "%s\t%d\t%s\t%d %d %d\n", cpu, threads, key, kc->algo, kc->tile, kc->threads);
+  fclose(f);
+}
+
+// timing data, random() is left alone so the weights initialized after nn_compile do not change
+static Mat2D scratch_Mat2D(size_t rows, size_t cols) {
+  Mat2D m = alloc_Mat2D(rows, cols, MEM_SCRATCH);
+  for (size_t i = 0; i < rows * cols; ++i) {
+    m.elems[i] = (double) (i % 17) / 17.0 - 0.5;
+  }
+  return m;
+}
+
+static size_t tune_candidates(const layer_t *layer, KernelChoice *out) {
+  const int max = omp_get_max_threads();
+  const int threads[] = { 0, max >= 4 ? max / 2 : 0, max > 1 ? 1 : 0 };
+  const int tiles[] = { 32, 128, 512 };
+  size_t n = 0;
+
+  for (size_t t = 0; t < 3; ++t) {
+    if (t > 0 && threads[t] == 0) continue;
+    if (layer->kind == DENSE) {
+      out[n++] = (KernelChoice) { .algo = ALGO_DEFAULT, .threads = threads[t] };
+      // a tile covering every output once is enough
+      for (size_t i = 0; i < 3 && (i == 0 || tiles[i - 1] < (int) layer->dl.ws.cols); ++i) {
+        out[n++] = (KernelChoice) { .algo = ALGO_DENSE_AXPY, .tile = tiles[i], .threads = threads[t] };
+      }
+    } else {
+      out[n++] = (KernelChoice) { .algo = ALGO_DEFAULT, .threads = threads[t] };
+      out[n++] = (KernelChoice) { .algo = ALGO_CONV_IM2COL, .threads = threads[t] };
+    }
+  }
+  return n;
+}
+
+// best of a few runs after a warm up, the outputs land in the layer's own buffers
+static double time_choice(layer_t *layer, layer_t *pool, const Mat2D *in, const KernelChoice *kc) {
+  const int threads = set_threads(kc->threads);
+  double best = INFINITY;
+
+  for (int run = 0; run < 4; ++run) {
+    double t = omp_get_wtime();
+    if (layer->kind == DENSE) dense_forward(&layer->dl, in, layer->act, kc);
+    else conv2d_dispatch(&layer->cl, in, layer->act, pool, kc);
+    t = omp_get_wtime() - t;
+    if (run > 0 && t < best) best = t;
+  }
+
+  if (kc->threads) omp_set_num_threads(threads);
+  return best;
+}
+
+static KernelChoice fastest_choice(nn_t *nn, size_t l) {
+  layer_t tmp = nn->layers[l];
+  layer_t *next = l + 1 < nn->layer_count ? &nn->layers[l + 1] : NULL;
+  layer_t *pool = next && (next->fusion & FUSED) && next->kind != FLATTEN ? next : NULL;
+  const InputLayer *il = &nn->layers[0].il;
+  const size_t channels = tmp.kind == DENSE ? 1 : tmp.cl.channels;
+  Mat2D in[channels], ws = { 0 }, bias = { 0 };
+  Mat2D kernels[tmp.kind == DENSE ? 1 : tmp.cl.kernel_count * tmp.cl.channels];
+
+  // the same shapes on scratch weights, the weights are not initialized yet
+  if (tmp.kind == DENSE) {
+    in[0] = scratch_Mat2D(tmp.dl.ws.rows, 1);
+    ws = scratch_Mat2D(tmp.dl.ws.rows, tmp.dl.ws.cols);
+    tmp.dl.ws = ws;
+  } else {
+    const Mat2D *prev = l == 1 ? NULL : nn_layer_output(&nn->layers[l - 1]);
+    for (size_t c = 0; c < channels; ++c) {
+      in[c] = scratch_Mat2D(prev ? prev[0].rows : il->height, prev ? prev[0].cols : il->width);
+    }
+    for (size_t k = 0; k < tmp.cl.kernel_count * tmp.cl.channels; ++k) {
+      kernels[k] = scratch_Mat2D(tmp.cl.kernels[k].rows, tmp.cl.kernels[k].cols);
+    }
+    bias = scratch_Mat2D(tmp.cl.kernel_count, 1);
+    tmp.cl.kernels = kernels;
+    tmp.cl.bias = bias.elems;
+  }
+
+  KernelChoice choices[12];
+  const size_t n = tune_candidates(&tmp, choices);
+  KernelChoice best = choices[0];
+  double best_time = INFINITY;
+  for (size_t i = 0; i < n; ++i) {
+    const double t = time_choice(&tmp, pool, in, &choices[i]);
+    if (t < best_time) {
+      best_time = t;
+      best = choices[i];
+    }
+  }
+
+  for (size_t c = 0; c < channels; ++c) destroy_Mat2D(&in[c]);
+  for (size_t k = 0; tmp.kind == CONV2D && k < tmp.cl.kernel_count * tmp.cl.channels; ++k) destroy_Mat2D(&kernels[k]);
+  destroy_Mat2D(&ws);
+  destroy_Mat2D(&bias);
+  return best;
+}
+
+size_t nn_autotune(nn_t *nn, const char *cache_path) {
+  char cpu[128], key[160];
+  const int threads = omp_get_max_threads();
+  size_t timed = 0;
+  cpu_model(cpu, sizeof(cpu));
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    if (!tune_key(nn, l, key, sizeof(key))) continue;
+    if (cache_path && cache_lookup(cache_path, cpu, threads, key, &layer->kc)) continue;
+
+    layer->kc = fastest_choice(nn, l);
+    timed++;
+    if (cache_path) cache_store(cache_path, cpu, threads, key, &layer->kc);
+  }
+
+  return timed;
+}
+
+void nn_set_autotune(nn_t *nn, const char *cache_path) {
+  nn->autotune = 1;
+  nn->tune_cache = cache_path;
+}
+
+typedef struct {
+  double *buf; // NULL only counts
+  size_t n;
+  int load;
+} state_walk_t;
+
+static void move_state(state_walk_t *w, double *x, size_t n) {
+  if (w->buf && w->load) memcpy(x, &w->buf[w->n], sizeof(double) * n);
+  else if (w->buf) memcpy(&w->buf[w->n], x, sizeof(double) * n);
+  w->n += n;
+}
+
+// the weights and the optimizer state of every layer in layer order, returns the doubles moved
+static size_t walk_state(nn_t *nn, double *buf, int load) {
+  state_walk_t w = { .buf = buf, .load = load };
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    DenseLayer *dl = &nn->layers[l].dl;
+    Conv2dLayer *cl = &nn->layers[l].cl;
+    SeparableConvLayer *sl = &nn->layers[l].sl;
+    BatchNormLayer *bn = &nn->layers[l].bn;
+
+    switch (nn->layers[l].kind) {
+      case DENSE:
+        move_state(&w, dl->ws.elems, dl->ws.rows * dl->ws.cols);
+        move_state(&w, &dl->bias, 1);
+        if (dl->m.elems) {
+          move_state(&w, dl->m.elems, dl->m.rows * dl->m.cols);
+          move_state(&w, &dl->bias_m, 1);
+        }
+        if (dl->v.elems) {
+          move_state(&w, dl->v.elems, dl->v.rows * dl->v.cols);
+          move_state(&w, &dl->bias_v, 1);
+        }
+        if (dl->shift.elems) move_state(&w, dl->shift.elems, dl->shift.rows);
+        break;
+      case CONV2D:
+        for (size_t k = 0; k < cl->kernel_count * cl->channels; ++k) {
+          move_state(&w, cl->kernels[k].elems, cl->kernels[k].rows * cl->kernels[k].cols);
+        }
+        move_state(&w, cl->bias, cl->kernel_count);
+        break;
+      case SEPARABLE_CONV2D:
+        move_state(&w, sl->params, separable_params(sl));
+        if (sl->m) move_state(&w, sl->m, separable_params(sl));
+        if (sl->v) move_state(&w, sl->v, separable_params(sl));
+        break;
+      case BATCH_NORM:
+        move_state(&w, bn->params, 2 * bn->features);
+        // mean then var
+        move_state(&w, bn->mean, 2 * bn->features);
+        move_state(&w, &bn->seen, 1);
+        if (bn->m) move_state(&w, bn->m, 2 * bn->features);
+        if (bn->v) move_state(&w, bn->v, 2 * bn->features);
+        break;
+      default:
+        break;
+    }
+  }
+
+  return w.n;
+}
+
+void nn_set_dist(nn_t *nn, dist_t *dist) {
+  nn->dist = dist;
+  if (dist == NULL) return;
+
+  // every weight and the optimizer state, so the ranks step from the same point
+  const size_t n = walk_state(nn, NULL, 0);
+  double *buf = (double *) mem_alloc(sizeof(double) * n, MEM_SCRATCH);
+  assert(buf != NULL && "not enough memory");
+
+  walk_state(nn, buf, 0);
+  dist_broadcast(dist, buf, n);
+  walk_state(nn, buf, 1);
+  mem_free(buf);
+  nn_prune_update(nn);
+}
+
+static uint64_t fnv1a(uint64_t h, size_t x) {
+  for (size_t i = 0; i < sizeof(x); ++i) {
+    h = (h ^ ((x >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// the kind, activation and shape of every layer and the optimizer, what the layout of walk_state and the
+// meaning of its doubles depend on
+static uint64_t state_fingerprint(const nn_t *nn) {
+  uint64_t h = fnv1a(0xcbf29ce484222325ULL, nn->opt.kind);
+
+  for (size_t l = 0; l < nn->layer_count; ++l) {
+    const layer_t *layer = &nn->layers[l];
+    size_t shape[5] = { 0 };
+
+    switch (layer->kind) {
+      case _INPUT:
+        shape[0] = layer->il.height, shape[1] = layer->il.width, shape[2] = layer->il.channels;
+        break;
+      case DENSE:
+        shape[0] = layer->dl.ws.rows, shape[1] = layer->dl.ws.cols, shape[2] = layer->dl.shift.elems != NULL;
+        break;
+      case CONV2D:
+        shape[0] = layer->cl.kernel_count, shape[1] = layer->cl.channels, shape[2] = layer->cl.kernels[0].rows;
+        shape[3] = layer->cl.padding, shape[4] = layer->cl.stride;
+        break;
+      case SEPARABLE_CONV2D:
+        shape[0] = layer->sl.kernel_count, shape[1] = layer->sl.channels, shape[2] = layer->sl.kernel_size;
+        shape[3] = layer->sl.padding, shape[4] = layer->sl.stride;
+        break;
+      case BATCH_NORM:
+        shape[0] = layer->bn.features, shape[1] = layer->bn.channels;
+        break;
+      case MAX_POOL:
+      case AVG_POOL:
+        shape[0] = layer->pl.pool_size, shape[1] = layer->pl.stride;
+        break;
+      case GLOBAL_AVG_POOL:
+        shape[0] = layer->gp.channels;
+        break;
+      default:
+        break;
+    }
+
+    h = fnv1a(fnv1a(h, layer->kind), layer->act);
+    for (size_t i = 0; i < 5; ++i) h = fnv1a(h, shape[i]);
+  }
+  return h;
+}
+
+void nn_set_checkpoint(nn_t *nn, const char *path, size_t every) {
+  assert(!nn->shared_weights && "a context has no optimizer state of its own");
+  if (nn->ckpt) ckpt_close(nn->ckpt);
+
+  nn->ckpt = path ? ckpt_open(path, walk_state(nn, NULL, 0), state_fingerprint(nn)) : NULL;
+  nn->ckpt_every = every;
+}
+
+void nn_checkpoint(nn_t *nn) {
+  assert(nn->ckpt != NULL && "no checkpoint set");
+  // the ranks hold the same weights
+  if (nn->dist && nn->dist->rank != 0) return;
+
+  walk_state(nn, ckpt_stage(nn->ckpt), 0);
+  ckpt_commit(nn->ckpt, nn->opt.t);
+}
+
+size_t nn_checkpoint_wait(nn_t *nn) {
+  return nn->ckpt ? ckpt_wait(nn->ckpt) : 0;
+}
+
+int nn_load_checkpoint(nn_t *nn, const char *path) {
+  // the inference copies would keep the weights from before the load
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const layer_t *layer = &nn->layers[l];
+    assert((layer->kind != DENSE || (layer->dl.q == NULL && layer->dl.h == NULL)) && "nn_dequantize and nn_full_weights before loading");
+    assert((layer->kind != CONV2D || (layer->cl.q == NULL && layer->cl.h == NULL)) && "nn_dequantize and nn_full_weights before loading");
+  }
+  const size_t n = walk_state(nn, NULL, 0);
+  double *buf = (double *) mem_alloc(sizeof(double) * n, MEM_SCRATCH);
+  assert(buf != NULL && "not enough memory");
+
+  size_t step;
+  const int err = ckpt_read(path, buf, n, state_fingerprint(nn), &step);
+  if (err == 0) {
+    walk_state(nn, buf, 1);
+    nn_prune_update(nn);
+    nn->opt.t = step;
+  }
+
+  mem_free(buf);
+  return err;
+}
+
+static size_t argmax(const double *x, size_t n) {
+  size_t max = 0;
+  for (size_t i = 1; i < n; ++i) {
+    if (x[i] > x[max]) max = i;
+  }
+  return max;
+}
+
+void nn_evaluate(const nn_t *nn, const Mat2D *data, const Mat2D *labels, nn_metrics_t *metrics) {
+  assert(data->rows == labels->rows && nn_output(nn)->rows == labels->cols);
+
+  const size_t classes = labels->cols;
+  const size_t channels = nn->layers[0].il.channels ? nn->layers[0].il.channels : 1;
+  const int cross_entropy = nn->layers[nn->layer_count - 1].act == SOFTMAX;
+  double loss = 0.0;
+  size_t correct = 0;
+
+  metrics->classes = classes;
+  metrics->confusion = (size_t *) mem_calloc(classes * classes, sizeof(size_t), MEM_OTHER);
+  assert(metrics->confusion != NULL && "not enough memory");
+
+  if (nn->replicas) refresh_replicas(nn);
+
+  #pragma omp parallel reduction(+:loss, correct)
+  {
+    nn_t ctx = nn_new_context(nn);
+    if (nn->replicas) {
+      const int node = topo_current_node();
+      use_replica(&ctx, &nn->replicas[node < nn->replica_nodes ? node : 0]);
+    }
+    size_t *confusion = (size_t *) mem_calloc(classes * classes, sizeof(size_t), MEM_SCRATCH);
+    Mat2D x[channels];
+
+    #pragma omp for schedule(static)
+    for (size_t i = 0; i < data->rows; ++i) {
+      size_t c = nn_row_input(&ctx, data, i, x);
+      nn_forward(&ctx, x, c);
+
+      const double *o = nn_output(&ctx)->elems;
+      const double *y = &labels->elems[i * classes];
+      const size_t truth = argmax(y, classes);
+      const size_t pred = argmax(o, classes);
+
+      loss += sample_loss(o, y, classes, cross_entropy);
+      correct += truth == pred;
+      confusion[truth * classes + pred]++;
+    }
+
+    #pragma omp critical
+    for (size_t i = 0; i < classes * classes; ++i) {
+      metrics->confusion[i] += confusion[i];
+    }
+
+    mem_free(confusion);
+    nn_destroy(&ctx);
+  }
+
+  metrics->loss = loss / data->rows;
+  metrics->accuracy = (double) correct / data->rows;
+}
+
+void nn_destroy_metrics(nn_metrics_t *metrics) {
+  mem_free(metrics->confusion);
+  metrics->confusion = NULL;
+  metrics->classes = 0;
+}
+
+Optimizer nn_optimizer(OptKind kind) {
+  switch (kind) {
+    case SGD: return (Optimizer) { .kind = SGD };
+    case MOMENTUM:
+    case NESTEROV: return (Optimizer) { .kind = kind, .momentum = 0.9 };
+    case ADAM: return (Optimizer) { .kind = ADAM, .beta1 = 0.9, .beta2 = 0.999, .eps = 1e-8 };
+    default: assert(0 && "unreachable");
+  }
+}
+
+// the moments of another optimizer, or of an earlier run of this one, do not belong to a new t = 0
+static void free_optimizer_state(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    switch (layer->kind) {
+      case DENSE:
+        destroy_Mat2D(&layer->dl.m);
+        destroy_Mat2D(&layer->dl.v);
+        layer->dl.bias_m = layer->dl.bias_v = 0.0;
+        break;
+      case SEPARABLE_CONV2D:
+        mem_free(layer->sl.m);
+        mem_free(layer->sl.v);
+        layer->sl.m = layer->sl.v = NULL;
+        break;
+      case BATCH_NORM:
+        mem_free(layer->bn.m);
+        mem_free(layer->bn.v);
+        layer->bn.m = layer->bn.v = NULL;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void nn_set_optimizer(nn_t *nn, Optimizer opt) {
+  assert(!nn->shared_weights && "set the optimizer of the network the context was made from");
+  nn->opt = opt;
+  nn->opt.t = 0;
+  free_optimizer_state(nn);
+
+  // already compiled, the state is allocated now
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    if (nn->layers[l].kind == DENSE && nn->layers[l].dl.ws.elems != NULL) {
+      alloc_optimizer_state(nn);
+      return;
+    }
+  }
+}
+
+size_t nn_prune(nn_t *nn, double sparsity) {
+  size_t zeros = 0;
+
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    DenseLayer *dl = &nn->layers[l].dl;
+    if (nn->layers[l].kind != DENSE) continue;
+
+    const size_t n = dl->ws.rows * dl->ws.cols;
+    const size_t layer_zeros = prune_Mat2D(&dl->ws, sparsity);
+    zeros += layer_zeros;
+    destroy_sparse(&dl->sparse);
+    // nothing to keep at zero any more, training is free to move every weight again
+    if (layer_zeros == 0) {
+      mem_free(dl->mask);
+      dl->mask = NULL;
+      continue;
+    }
+
+    if (dl->mask == NULL) dl->mask = (uint8_t *) mem_alloc(n, MEM_WEIGHTS);
+    assert(dl->mask != NULL && "not enough memory");
+    for (size_t i = 0; i < n; ++i) dl->mask[i] = dl->ws.elems[i] != 0.0;
+
+    // CSR reads a value and a column index per nonzero, it wins while that is less than the dense weights
+    if ((sizeof(double) + sizeof(uint32_t)) * (n - layer_zeros) >= sizeof(double) * n) continue;
+
+    Mat2D ws_t = transpose_Mat2D(&dl->ws);
+    dl->sparse = (CSRMat2D *) mem_alloc(sizeof(CSRMat2D), MEM_WEIGHTS);
+    assert(dl->sparse != NULL && "not enough memory");
+    *dl->sparse = alloc_CSRMat2D(&ws_t, MEM_WEIGHTS);
+    destroy_Mat2D(&ws_t);
+  }
+
+  return zeros;
+}
+
+// every dense layer owns its output again
+static void dense_own_outputs(nn_t *nn) {
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    layer_t *layer = &nn->layers[l];
+    if (!(layer->fusion & RECOMPUTED)) continue;
+
+    layer->dl.a = alloc_Mat2D(layer->dl.a.rows, 1, MEM_ACTIVATIONS);
+    layer->fusion &= ~RECOMPUTED;
+  }
+
+  mem_free(nn->recompute);
+  nn->recompute = NULL;
+}
+
+size_t nn_set_activation_budget(nn_t *nn, size_t bytes) {
+  assert(!nn->shared_weights && "set the budget on the network, not on a context");
+  assert(nn->arena == NULL && "an inference plan has no training activations");
+  dense_own_outputs(nn);
+
+  const size_t n = nn->layer_count - 1;
+  size_t all = 0;
+  for (size_t l = 1; l <= n; ++l) {
+    assert(nn->layers[l].kind == DENSE && "checkpointing needs a dense network");
+    all += sizeof(double) * nn->layers[l].dl.a.rows;
+  }
+  if (bytes == 0 || all <= bytes) return all;
+
+  // the least recomputation that fits. the k - 1 layers between two kept ones are a segment, every
+  // segment lays its outputs out from the start of one buffer as large as the largest segment
+  for (size_t k = 2; k <= n; ++k) {
+    size_t kept = 0, segment = 0, largest = 0;
+    for (size_t l = 1; l <= n; ++l) {
+      const size_t rows = nn->layers[l].dl.a.rows;
+      if (l % k == 0 || l == n) {
+        kept += sizeof(double) * rows;
+        segment = 0;
+      } else {
+        segment += rows;
+        largest = segment > largest ? segment : largest;
+      }
+    }
+    if (kept + sizeof(double) * largest > bytes) continue;
+
+    nn->recompute = (double *) mem_alloc(sizeof(double) * largest, MEM_ACTIVATIONS);
+    assert(nn->recompute != NULL && "not enough memory");
+
+    for (size_t l = 1, offset = 0; l < n; ++l) {
+      DenseLayer *dl = &nn->layers[l].dl;
+      if (l % k == 0) {
+        offset = 0;
+        continue;
+      }
+
+      destroy_Mat2D(&dl->a);
+      dl->a = (Mat2D) { .cols = 1, .rows = nn->layers[l].dl.ws.cols, .elems = &nn->recompute[offset] };
+      offset += dl->a.rows;
+      nn->layers[l].fusion |= RECOMPUTED;
+    }
+
+    return kept + sizeof(double) * largest;
+  }
+
+  assert(0 && "activation budget too small");
+  return 0;
 }
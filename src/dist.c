@@ -0,0 +1,252 @@
+#include "dist.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// the head of the shared mapping, the slots and the result follow it
+struct dist_shared {
+  pthread_barrier_t barrier;
+  _Alignas(64) double data[];
+};
+
+static size_t shared_bytes(int size, size_t chunk) {
+  return sizeof(struct dist_shared) + sizeof(double) * chunk * (size + 1);
+}
+
+static struct dist_shared *map_shared(int size, size_t chunk) {
+  char name[64];
+  snprintf(name, sizeof(name), "/cnn-dist-%d", (int) getpid());
+
+  // the name only lives until the mapping exists, the children inherit the mapping
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  assert(fd != -1 && "could not create the shared memory");
+  int err = ftruncate(fd, shared_bytes(size, chunk));
+  assert(err == 0 && "could not size the shared memory");
+
+  struct dist_shared *shared = mmap(NULL, shared_bytes(size, chunk), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(shared != MAP_FAILED && "could not map the shared memory");
+  close(fd);
+  shm_unlink(name);
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&shared->barrier, &attr, size);
+  pthread_barrierattr_destroy(&attr);
+
+  return shared;
+}
+
+dist_t dist_fork(int size, size_t chunk, enum dist_transport transport) {
+  assert(size > 0 && chunk > 0);
+
+  dist_t d = {
+    .rank = 0,
+    .size = size,
+    .transport = transport,
+    .chunk = chunk,
+    .shared = map_shared(size, chunk),
+    .next = -1,
+    .prev = -1,
+    .children = (pid_t *) mem_calloc(size, sizeof(pid_t), MEM_OTHER),
+  };
+  d.slots = d.shared->data;
+  d.sum = &d.shared->data[chunk * size];
+
+  // pair k links rank k to rank k + 1
+  int (*pairs)[2] = mem_alloc(sizeof(int[2]) * size, MEM_OTHER);
+  assert(pairs != NULL && d.children != NULL && "not enough memory");
+  for (int k = 0; transport == DIST_SOCKET && size > 1 && k < size; ++k) {
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[k]);
+    assert(err == 0 && "could not create the ring sockets");
+  }
+
+  // whatever is buffered would be written once per process
+  fflush(NULL);
+  for (int r = 1; r < size; ++r) {
+    pid_t pid = fork();
+    assert(pid != -1 && "could not fork");
+    if (pid == 0) {
+      d.rank = r;
+      mem_free(d.children);
+      d.children = NULL;
+      break;
+    }
+    d.children[r] = pid;
+  }
+
+  if (transport == DIST_SOCKET && size > 1) {
+    const int prev = (d.rank + size - 1) % size;
+    for (int k = 0; k < size; ++k) {
+      if (k == d.rank) d.next = pairs[k][0];
+      else close(pairs[k][0]);
+      if (k == prev) d.prev = pairs[k][1];
+      else close(pairs[k][1]);
+    }
+    fcntl(d.next, F_SETFL, fcntl(d.next, F_GETFL) | O_NONBLOCK);
+    fcntl(d.prev, F_SETFL, fcntl(d.prev, F_GETFL) | O_NONBLOCK);
+
+    d.recv = (double *) mem_alloc(sizeof(double) * chunk, MEM_SCRATCH);
+    assert(d.recv != NULL && "not enough memory");
+  }
+  mem_free(pairs);
+
+  return d;
+}
+
+int dist_finalize(dist_t *d) {
+  if (d->next != -1) close(d->next);
+  if (d->prev != -1) close(d->prev);
+  mem_free(d->recv);
+
+  if (d->rank != 0) {
+    munmap(d->shared, shared_bytes(d->size, d->chunk));
+    fflush(NULL);
+    _exit(0);
+  }
+
+  int failed = 0;
+  for (int r = 1; r < d->size; ++r) {
+    int status;
+    if (waitpid(d->children[r], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+
+  pthread_barrier_destroy(&d->shared->barrier);
+  munmap(d->shared, shared_bytes(d->size, d->chunk));
+  mem_free(d->children);
+  *d = (dist_t) { .next = -1, .prev = -1 };
+  return failed;
+}
+
+void dist_barrier(dist_t *d) {
+  pthread_barrier_wait(&d->shared->barrier);
+}
+
+// sends and receives at the same time, every rank sends first so blocking on either would deadlock the ring
+static void sendrecv(int out, const void *sbuf, size_t sbytes, int in, void *rbuf, size_t rbytes) {
+  size_t sent = 0, got = 0;
+
+  while (sent < sbytes || got < rbytes) {
+    struct pollfd fds[2] = {
+      { .fd = out, .events = sent < sbytes ? POLLOUT : 0 },
+      { .fd = in, .events = got < rbytes ? POLLIN : 0 },
+    };
+    if (poll(fds, 2, -1) == -1) {
+      assert(errno == EINTR && "poll failed");
+      continue;
+    }
+
+    // POLLHUP is reported even on the side that is done
+    if (sent < sbytes && (fds[0].revents & POLLOUT)) {
+      ssize_t k = write(out, (const char *) sbuf + sent, sbytes - sent);
+      assert((k > 0 || errno == EAGAIN) && "could not send to the next rank");
+      if (k > 0) sent += k;
+    }
+    if (got < rbytes && (fds[1].revents & (POLLIN | POLLHUP))) {
+      ssize_t k = read(in, (char *) rbuf + got, rbytes - got);
+      assert((k > 0 || (k == -1 && errno == EAGAIN)) && "the previous rank is gone");
+      if (k > 0) got += k;
+    }
+  }
+}
+
+// [begin, end) of segment s when n elements are split in size segments
+static void segment(size_t n, int size, int s, size_t *begin, size_t *end) {
+  *begin = n * s / size;
+  *end = n * (s + 1) / size;
+}
+
+// reduce-scatter then all-gather around the ring, segment s is summed starting at rank s + 1
+static void ring_allreduce(dist_t *d, double *x, size_t n) {
+  const int p = d->size;
+  size_t sb, se, rb, re;
+
+  for (int step = 0; step < p - 1; ++step) {
+    segment(n, p, (d->rank - step + p) % p, &sb, &se);
+    segment(n, p, (d->rank - step - 1 + 2 * p) % p, &rb, &re);
+    sendrecv(d->next, &x[sb], sizeof(double) * (se - sb), d->prev, d->recv, sizeof(double) * (re - rb));
+    for (size_t i = rb; i < re; ++i) {
+      x[i] = d->recv[i - rb] + x[i];
+    }
+  }
+
+  for (int step = 0; step < p - 1; ++step) {
+    segment(n, p, (d->rank + 1 - step + p) % p, &sb, &se);
+    segment(n, p, (d->rank - step + p) % p, &rb, &re);
+    sendrecv(d->next, &x[sb], sizeof(double) * (se - sb), d->prev, &x[rb], sizeof(double) * (re - rb));
+  }
+}
+
+// every rank sums its slice of the slots in rank order, then copies the whole result
+static void shm_allreduce(dist_t *d, double *x, size_t n) {
+  size_t begin, end;
+  segment(n, d->size, d->rank, &begin, &end);
+
+  memcpy(&d->slots[d->rank * d->chunk], x, sizeof(double) * n);
+  dist_barrier(d);
+
+  for (size_t i = begin; i < end; ++i) {
+    double sum = d->slots[i];
+    for (int r = 1; r < d->size; ++r) {
+      sum += d->slots[r * d->chunk + i];
+    }
+    d->sum[i] = sum;
+  }
+  dist_barrier(d);
+
+  // the next call only writes the result after every rank passed its first barrier
+  memcpy(x, d->sum, sizeof(double) * n);
+}
+
+void dist_allreduce(dist_t *d, double *x, size_t n) {
+  if (d->size == 1) return;
+
+  for (size_t off = 0; off < n; off += d->chunk) {
+    const size_t block = n - off < d->chunk ? n - off : d->chunk;
+    if (d->transport == DIST_SOCKET) ring_allreduce(d, &x[off], block);
+    else shm_allreduce(d, &x[off], block);
+  }
+}
+
+void dist_broadcast(dist_t *d, double *x, size_t n) {
+  if (d->size == 1) return;
+
+  for (size_t off = 0; off < n; off += d->chunk) {
+    const size_t block = n - off < d->chunk ? n - off : d->chunk;
+    const size_t bytes = sizeof(double) * block;
+
+    if (d->transport == DIST_SOCKET) {
+      // down the ring, the last rank does not send back to 0
+      if (d->rank != 0) sendrecv(d->next, NULL, 0, d->prev, &x[off], bytes);
+      if (d->rank != d->size - 1) sendrecv(d->next, &x[off], bytes, d->prev, NULL, 0);
+      continue;
+    }
+
+    // the other ranks may still be copying the result of the previous call
+    dist_barrier(d);
+    if (d->rank == 0) memcpy(d->sum, &x[off], bytes);
+    dist_barrier(d);
+    if (d->rank != 0) memcpy(&x[off], d->sum, bytes);
+    dist_barrier(d);
+  }
+}
+
+Mat2D dist_shard(const dist_t *d, const Mat2D *data) {
+  const size_t rows = data->rows / d->size;
+  return (Mat2D) {
+    .cols = data->cols,
+    .rows = rows,
+    .elems = &data->elems[d->rank * rows * data->cols],
+  };
+}
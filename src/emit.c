@@ -0,0 +1,296 @@
+#include "cnn.h"
+#include "mat.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+// what the layer being emitted reads: the name of its buffer and its shape, planes of h x w or a column of size
+typedef struct {
+  FILE *f;
+  char src[24];
+  size_t h, w, size;
+} emitter_t;
+
+static const char *act_fn(ActFun act) {
+  switch (act) {
+    case SIGMOID: return "sigmoid";
+    case RELU: return "relu";
+    case TANH: return "tanh";
+    case SOFTMAX:
+    case LINEAR: return "linear";
+    default: assert(0 && "unreachable");
+  }
+}
+
+// %.17g reads back as the same double
+static void emit_values(FILE *f, const double *x, size_t n, size_t *written) {
+  for (size_t i = 0; i < n; ++i, ++*written) {
+    fprintf(f, "%s%.17g,", *written % 4 ? " " : "\n  ", x[i]);
+  }
+}
+
+static void emit_array(FILE *f, const char *name, size_t l, const double *x, size_t n) {
+  size_t written = 0;
+  fprintf(f, "static const double %s%zu[%zu] = {", name, l, n);
+  emit_values(f, x, n, &written);
+  fprintf(f, "\n};\n");
+}
+
+// values out of the layer, given the values into it
+static size_t output_size(const layer_t *layer, size_t in) {
+  switch (layer->kind) {
+    case DENSE: return layer->dl.ws.cols;
+    case CONV2D: return layer->cl.kernel_count * layer->cl.a[0].rows * layer->cl.a[0].cols;
+    case SEPARABLE_CONV2D: return layer->sl.kernel_count * layer->sl.a[0].rows * layer->sl.a[0].cols;
+    case MAX_POOL:
+    case AVG_POOL: return layer->pl.channels * layer->pl.a[0].rows * layer->pl.a[0].cols;
+    case GLOBAL_AVG_POOL: return layer->gp.channels;
+    case BATCH_NORM:
+    case FLATTEN: return in;
+    default: assert(0 && "unreachable");
+  }
+}
+
+// the output buffer, the weights and the biases of layer l, at file scope
+static void emit_data(FILE *f, const layer_t *layer, size_t l, size_t size) {
+  if (layer->kind != FLATTEN) fprintf(f, "static double a%zu[%zu];\n", l, size);
+
+  switch (layer->kind) {
+    case DENSE: {
+      const DenseLayer *dl = &layer->dl;
+      // one row per output, read along the inputs
+      Mat2D ws_t = transpose_Mat2D(&dl->ws);
+      emit_array(f, "w", l, ws_t.elems, ws_t.rows * ws_t.cols);
+      destroy_Mat2D(&ws_t);
+      if (dl->shift.elems) emit_array(f, "s", l, dl->shift.elems, dl->shift.rows);
+      break;
+    }
+    case CONV2D: {
+      const Conv2dLayer *cl = &layer->cl;
+      const size_t k2 = cl->kernels[0].rows * cl->kernels[0].cols;
+      size_t written = 0;
+      fprintf(f, "static const double w%zu[%zu] = {", l, cl->kernel_count * cl->channels * k2);
+      for (size_t k = 0; k < cl->kernel_count * cl->channels; ++k) {
+        emit_values(f, cl->kernels[k].elems, k2, &written);
+      }
+      fprintf(f, "\n};\n");
+      emit_array(f, "b", l, cl->bias, cl->kernel_count);
+      break;
+    }
+    case SEPARABLE_CONV2D: {
+      const SeparableConvLayer *sl = &layer->sl;
+      emit_array(f, "d", l, sl->depthwise.elems, sl->depthwise.rows * sl->depthwise.cols);
+      emit_array(f, "w", l, sl->pointwise.elems, sl->pointwise.rows * sl->pointwise.cols);
+      emit_array(f, "b", l, sl->bias, sl->kernel_count);
+      fprintf(f, "static double dw%zu[%zu];\n", l, sl->channels * sl->a[0].rows * sl->a[0].cols);
+      break;
+    }
+    case BATCH_NORM: {
+      const BatchNormLayer *bn = &layer->bn;
+      double st[2 * bn->features];
+      for (size_t i = 0; i < bn->features; ++i) {
+        st[i] = bn->gamma[i] / sqrt(bn->var[i] + bn->eps);
+        st[bn->features + i] = bn->beta[i] - bn->mean[i] * st[i];
+      }
+      emit_array(f, "w", l, st, bn->features);
+      emit_array(f, "b", l, &st[bn->features], bn->features);
+      break;
+    }
+    case MAX_POOL:
+    case AVG_POOL:
+    case GLOBAL_AVG_POOL:
+    case FLATTEN:
+      break;
+    default:
+      assert(0 && "unreachable");
+  }
+}
+
+// the loops of layer l, every bound a constant
+static void emit_layer(emitter_t *e, const layer_t *layer, size_t l) {
+  FILE *f = e->f;
+  const char *act = act_fn(layer->act);
+  const char *in = e->src;
+
+  fprintf(f, "\n  // %zu\n", l);
+  switch (layer->kind) {
+    case DENSE: {
+      const DenseLayer *dl = &layer->dl;
+      fprintf(f,
+        "  for (int i = 0; i < %zu; ++i) {\n"
+        "    double sum = 0.0;\n"
+        "    for (int j = 0; j < %zu; ++j) sum += %s[j] * w%zu[i * %zu + j];\n",
+        dl->ws.cols, dl->ws.rows, in, l, dl->ws.rows);
+      // the shift is added after the bias, like nn_forward
+      if (dl->shift.elems) fprintf(f, "    a%zu[i] = %s(sum + %.17g + s%zu[i]);\n  }\n", l, act, dl->bias, l);
+      else fprintf(f, "    a%zu[i] = %s(sum + %.17g);\n  }\n", l, act, dl->bias);
+      if (layer->act == SOFTMAX) fprintf(f, "  softmax(a%zu, %zu);\n", l, dl->ws.cols);
+      break;
+    }
+    case CONV2D: {
+      const Conv2dLayer *cl = &layer->cl;
+      const size_t ks = cl->kernels[0].rows, oh = cl->a[0].rows, ow = cl->a[0].cols;
+      fprintf(f,
+        "  for (int k = 0; k < %zu; ++k) {\n"
+        "    for (int r = 0; r < %zu; ++r) {\n"
+        "      for (int c = 0; c < %zu; ++c) {\n"
+        "        double sum = b%zu[k];\n"
+        "        for (int ch = 0; ch < %zu; ++ch) {\n"
+        "          for (int kr = 0; kr < %zu; ++kr) {\n"
+        "            const int row = r * %d - %d + kr;\n"
+        "            if (row < 0 || row >= %zu) continue;\n"
+        "            for (int kc = 0; kc < %zu; ++kc) {\n"
+        "              const int col = c * %d - %d + kc;\n"
+        "              if (col >= 0 && col < %zu) sum += %s[(ch * %zu + row) * %zu + col] * w%zu[((k * %zu + ch) * %zu + kr) * %zu + kc];\n"
+        "            }\n"
+        "          }\n"
+        "        }\n"
+        "        a%zu[(k * %zu + r) * %zu + c] = %s(sum);\n"
+        "      }\n"
+        "    }\n"
+        "  }\n",
+        cl->kernel_count, oh, ow, l, cl->channels, ks, cl->stride, cl->padding, e->h, ks, cl->stride, cl->padding,
+        e->w, in, e->h, e->w, l, cl->channels, ks, ks, l, oh, ow, act);
+      e->h = oh;
+      e->w = ow;
+      break;
+    }
+    case SEPARABLE_CONV2D: {
+      const SeparableConvLayer *sl = &layer->sl;
+      const size_t ks = sl->kernel_size, oh = sl->a[0].rows, ow = sl->a[0].cols, pixels = oh * ow;
+      fprintf(f,
+        "  for (int ch = 0; ch < %zu; ++ch) {\n"
+        "    for (int r = 0; r < %zu; ++r) {\n"
+        "      for (int c = 0; c < %zu; ++c) {\n"
+        "        double sum = 0.0;\n"
+        "        for (int kr = 0; kr < %zu; ++kr) {\n"
+        "          const int row = r * %d - %d + kr;\n"
+        "          if (row < 0 || row >= %zu) continue;\n"
+        "          for (int kc = 0; kc < %zu; ++kc) {\n"
+        "            const int col = c * %d - %d + kc;\n"
+        "            if (col >= 0 && col < %zu) sum += %s[(ch * %zu + row) * %zu + col] * d%zu[(ch * %zu + kr) * %zu + kc];\n"
+        "          }\n"
+        "        }\n"
+        "        dw%zu[(ch * %zu + r) * %zu + c] = sum;\n"
+        "      }\n"
+        "    }\n"
+        "  }\n"
+        "  for (int k = 0; k < %zu; ++k) {\n"
+        "    for (int p = 0; p < %zu; ++p) a%zu[k * %zu + p] = b%zu[k];\n"
+        "    for (int ch = 0; ch < %zu; ++ch) {\n"
+        "      for (int p = 0; p < %zu; ++p) a%zu[k * %zu + p] += w%zu[k * %zu + ch] * dw%zu[ch * %zu + p];\n"
+        "    }\n"
+        "    for (int p = 0; p < %zu; ++p) a%zu[k * %zu + p] = %s(a%zu[k * %zu + p]);\n"
+        "  }\n",
+        sl->channels, oh, ow, ks, sl->stride, sl->padding, e->h, ks, sl->stride, sl->padding, e->w, in, e->h, e->w,
+        l, ks, ks, l, oh, ow,
+        sl->kernel_count, pixels, l, pixels, l, sl->channels, pixels, l, pixels, l, sl->channels, l, pixels,
+        pixels, l, pixels, act, l, pixels);
+      e->h = oh;
+      e->w = ow;
+      break;
+    }
+    case BATCH_NORM: {
+      const BatchNormLayer *bn = &layer->bn;
+      const size_t pixels = e->size / bn->features;
+      fprintf(f,
+        "  for (int i = 0; i < %zu; ++i) {\n"
+        "    for (int p = 0; p < %zu; ++p) a%zu[i * %zu + p] = %s(%s[i * %zu + p] * w%zu[i] + b%zu[i]);\n"
+        "  }\n",
+        bn->features, pixels, l, pixels, act, in, pixels, l, l);
+      if (layer->act == SOFTMAX) fprintf(f, "  softmax(a%zu, %zu);\n", l, e->size);
+      break;
+    }
+    case MAX_POOL:
+    case AVG_POOL: {
+      const PoolingLayer *pl = &layer->pl;
+      const size_t ps = pl->pool_size, st = pl->stride, oh = pl->a[0].rows, ow = pl->a[0].cols;
+      const int max = layer->kind == MAX_POOL;
+      fprintf(f,
+        "  for (int ch = 0; ch < %zu; ++ch) {\n"
+        "    for (int i = 0; i < %zu; ++i) {\n"
+        "      for (int j = 0; j < %zu; ++j) {\n"
+        "        double acc = %s;\n"
+        "        for (int pi = 0; pi < %zu; ++pi) {\n"
+        "          for (int pj = 0; pj < %zu; ++pj) {\n"
+        "            const double v = %s[(ch * %zu + i * %zu + pi) * %zu + j * %zu + pj];\n"
+        "            %s;\n"
+        "          }\n"
+        "        }\n"
+        "        a%zu[(ch * %zu + i) * %zu + j] = acc / %zu;\n"
+        "      }\n"
+        "    }\n"
+        "  }\n",
+        pl->channels, oh, ow, max ? "-INFINITY" : "0.0", ps, ps, in, e->h, st, e->w, st,
+        max ? "acc = acc < v ? v : acc" : "acc += v", l, oh, ow, max ? (size_t) 1 : ps * ps);
+      e->h = oh;
+      e->w = ow;
+      break;
+    }
+    case GLOBAL_AVG_POOL: {
+      const size_t pixels = e->h * e->w;
+      fprintf(f,
+        "  for (int ch = 0; ch < %zu; ++ch) {\n"
+        "    double sum = 0.0;\n"
+        "    for (int p = 0; p < %zu; ++p) sum += %s[ch * %zu + p];\n"
+        "    a%zu[ch] = sum / %zu;\n"
+        "  }\n",
+        layer->gp.channels, pixels, in, pixels, l, pixels);
+      e->h = layer->gp.channels;
+      e->w = 1;
+      break;
+    }
+    case FLATTEN:
+      // the planes already are the flattened column
+      fprintf(f, "  // flatten reads %s as it is\n", in);
+      break;
+    default:
+      assert(0 && "unreachable");
+  }
+}
+
+int nn_emit_c(const nn_t *nn, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return -1;
+
+  const InputLayer *il = &nn->layers[0].il;
+  const size_t in_size = il->height * il->width * (il->channels ? il->channels : 1);
+
+  fprintf(f,
+    "// generated by nn_emit_c, every shape is a constant and the weights are embedded.\n"
+    "// cnn_forward reads the input channel by channel, row by row, and is not reentrant\n"
+    "#include <math.h>\n"
+    "#include <string.h>\n\n"
+    "static inline double sigmoid(double x) { return 1 / (1 + exp(-x)); }\n"
+    "static inline double relu(double x) { return x > 0.0 ? x : 0.0; }\n"
+    "static inline double linear(double x) { return x; }\n\n"
+    "static inline void softmax(double *x, int n) {\n"
+    "  double max = x[0], sum = 0.0;\n"
+    "  for (int i = 1; i < n; ++i) max = max > x[i] ? max : x[i];\n"
+    "  for (int i = 0; i < n; ++i) {\n"
+    "    x[i] -= max;\n"
+    "    sum += exp(x[i]);\n"
+    "  }\n"
+    "  for (int i = 0; i < n; ++i) x[i] = exp(x[i]) / sum;\n"
+    "}\n\n");
+
+  size_t size = in_size;
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    size = output_size(&nn->layers[l], size);
+    emit_data(f, &nn->layers[l], l, size);
+  }
+
+  fprintf(f, "\nconst unsigned cnn_input_size = %zu, cnn_output_size = %zu;\n\n", in_size, size);
+  fprintf(f, "void cnn_forward(const double *in, double *out) {\n");
+  emitter_t e = { .f = f, .src = "in", .h = il->height, .w = il->width, .size = in_size };
+  for (size_t l = 1; l < nn->layer_count; ++l) {
+    const layer_t *layer = &nn->layers[l];
+    emit_layer(&e, layer, l);
+    if (layer->kind != FLATTEN) snprintf(e.src, sizeof(e.src), "a%zu", l);
+    e.size = output_size(layer, e.size);
+  }
+  fprintf(f, "\n  memcpy(out, %s, sizeof(double) * %zu);\n}\n", e.src, e.size);
+
+  const int err = ferror(f);
+  return fclose(f) == 0 && !err ? 0 : -1;
+}
@@ -133,7 +133,6 @@ void print_mnist(const Mat2D *number, const char *end) {
 }
 
 int main(void) {
-  omp_set_num_threads(1);
   srandom(time(NULL));
   nn_t mnist_nn = new_nn(IMG_SIZE, 1, 0);
   nn_add_dense_layer(&mnist_nn, 32, SIGMOID);
@@ -144,6 +143,9 @@ int main(void) {
 
   Mat2D imgs = read_imgs(TRAIN_IMGS, 1, 25);
   Mat2D labels = read_labels(TRAIN_LBLS, 1, 25);
+  // held out, the accuracy on these is the one that tells how the network generalizes
+  Mat2D test_imgs = read_imgs(TEST_IMGS, 1, MAX_TEST);
+  Mat2D test_labels = read_labels(TEST_LBLS, 1, MAX_TEST);
 
   int first_img = (float) random() / (float) RAND_MAX * imgs.rows;
   printf("first image: %d\n", first_img);
@@ -159,6 +161,13 @@ int main(void) {
 
   for (int e = 0; e < MAX_EPOCH; ++e) {
     nn_fit(&mnist_nn, &imgs, &labels, 1, 1.0);
+
+    if ((e + 1) % 10 == 0) {
+      nn_metrics_t metrics;
+      nn_evaluate(&mnist_nn, &test_imgs, &test_labels, &metrics);
+      printf("epoch %d: test loss %f, test accuracy %.2f%%\n", e + 1, metrics.loss, metrics.accuracy * 100.0);
+      nn_destroy_metrics(&metrics);
+    }
   }
 
   nn_forward(&mnist_nn, &((Mat2D) {1, imgs.cols, img}), 1);
@@ -166,6 +175,8 @@ int main(void) {
   printf("got (after training): ");
   print_Mat2D(o1, "\n");
 
+  destroy_Mat2D(&test_labels);
+  destroy_Mat2D(&test_imgs);
   destroy_Mat2D(&labels);
   destroy_Mat2D(&imgs);
   nn_destroy(&mnist_nn);
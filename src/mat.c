@@ -1,15 +1,18 @@
 #include "mat.h"
+#include "rng.h"
 #include <assert.h>
+#include <immintrin.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
 #include <string.h>
 
-Mat2D new_Mat2D(const size_t rows, const size_t cols) {
+Mat2D alloc_Mat2D(const size_t rows, const size_t cols, enum mem_kind kind) {
   Mat2D m = (Mat2D) {
     .cols = cols,
     .rows = rows,
-    .elems = (double *)malloc(rows * cols * sizeof(double))
+    .elems = (double *)mem_alloc(rows * cols * sizeof(double), kind)
   };
 
   assert(m.elems != NULL && "not enough memory");
@@ -17,8 +20,12 @@ Mat2D new_Mat2D(const size_t rows, const size_t cols) {
   return m;
 }
 
+Mat2D new_Mat2D(const size_t rows, const size_t cols) {
+  return alloc_Mat2D(rows, cols, MEM_OTHER);
+}
+
 void destroy_Mat2D(Mat2D *m) {
-  free(m->elems);
+  mem_free(m->elems);
   m->elems = NULL;
   m->cols = 0;
   m->rows = 0;
@@ -69,19 +76,20 @@ void Mat2D_col_mul(const Mat2D *mat, const Mat2D *vec, Mat2D *out) {
 }
 
 void random_init_Mat2D(Mat2D *m, const double min, const double max) {
-  const double diff = max - min;
-
-  for (size_t i = 0; i < m->rows; ++i) {
-    for (size_t j = 0; j < m->cols; ++j) {
-      MAT2D_GET((*m), i, j) = (double) random() / (double) RAND_MAX * diff + min;
-    }
-  }
+  rng_fill((rng_t) { .seed = rng_seed() }, 0, m->elems, m->rows * m->cols, min, max);
 }
 
 void zero_init_Mat2D(Mat2D *m) {
   memset(m->elems, 0, sizeof(double) * m->cols * m->rows);
 }
 
+void first_touch_Mat2D(Mat2D *m) {
+  #pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < m->rows; ++i) {
+    memset(&m->elems[i * m->cols], 0, sizeof(double) * m->cols);
+  }
+}
+
 // m += s
 void add_scalar_Mat2D(Mat2D *m, const double s) {
   #pragma omp parallel for
@@ -123,8 +131,9 @@ void print_Mat2D(const Mat2D *m, const char *end) {
   printf("%s", end);
 }
 
+// the transpose is accounted as scratch, the library only uses it as a temporary
 Mat2D transpose_Mat2D(const Mat2D *m) {
-  Mat2D m_t = new_Mat2D(m->cols, m->rows);
+  Mat2D m_t = alloc_Mat2D(m->cols, m->rows, MEM_SCRATCH);
 
   #pragma omp parallel for
   for (size_t i = 0; i < m->rows; ++i) {
@@ -136,7 +145,23 @@ Mat2D transpose_Mat2D(const Mat2D *m) {
   return m_t;
 }
 
-void convolution2D(const Mat2D *input, const Mat2D *kernel, int stride, int padding, Mat2D *out) {
+// the kernels read their input through a plane of rows x cols whose rows start ld elements apart, a
+// Mat2D is the plane with ld = cols and a mat_t view can be a slice of a wider one
+typedef struct {
+  size_t rows, cols, ld;
+  const double *elems;
+} plane_t;
+
+static plane_t plane_of_Mat2D(const Mat2D *m) {
+  return (plane_t) { .rows = m->rows, .cols = m->cols, .ld = m->cols, .elems = m->elems };
+}
+
+static plane_t plane_of_mat(const mat_t *m) {
+  assert(m->dim_count == 2 && (m->strides[1] == 1 || m->dims[1] == 1) && "the columns of a plane are adjacent");
+  return (plane_t) { .rows = m->dims[0], .cols = m->dims[1], .ld = m->strides[0], .elems = &m->elems[m->offset] };
+}
+
+static void plane_convolution2D(const plane_t *input, const Mat2D *kernel, int stride, int padding, Mat2D *out) {
   assert(stride > 0);
   assert(out->rows == (input->rows - kernel->rows + 2 * padding) / stride + 1);
   assert(out->cols == (input->cols - kernel->cols + 2 * padding) / stride + 1);
@@ -151,7 +176,7 @@ void convolution2D(const Mat2D *input, const Mat2D *kernel, int stride, int padd
           int col = (int) c * stride - padding + kc;
 
           if (row >= 0 && row < (int) input->rows && col >= 0 && col < (int) input->cols) {
-            sum += MAT2D_GET((*input), row, col) * MAT2D_GET((*kernel), kr, kc);
+            sum += input->elems[row * input->ld + col] * MAT2D_GET((*kernel), kr, kc);
           }
         }
       }
@@ -161,40 +186,988 @@ void convolution2D(const Mat2D *input, const Mat2D *kernel, int stride, int padd
   }
 }
 
-void max_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size) {
-  assert(out->cols == input->cols / pool_size && out->rows == input->rows / pool_size);
+void convolution2D(const Mat2D *input, const Mat2D *kernel, int stride, int padding, Mat2D *out) {
+  const plane_t in = plane_of_Mat2D(input);
+  plane_convolution2D(&in, kernel, stride, padding, out);
+}
+
+void mat_convolution2D(const mat_t *input, const Mat2D *kernel, int stride, int padding, Mat2D *out) {
+  const plane_t in = plane_of_mat(input);
+  plane_convolution2D(&in, kernel, stride, padding, out);
+}
+
+// a window row at a time across the whole output row, the inner loop runs over the outputs and vectorizes
+static void plane_max_pooling2D(const plane_t *input, Mat2D *out, size_t pool_size, size_t stride) {
+  assert(stride > 0 && input->rows >= pool_size && input->cols >= pool_size);
+  assert(out->rows == (input->rows - pool_size) / stride + 1 && out->cols == (input->cols - pool_size) / stride + 1);
 
   for (size_t i = 0; i < out->rows; ++i) {
-    for (size_t j = 0; j < out->cols; ++j) {
-      double max = MAT2D_GET((*input), i * pool_size, j * pool_size);
+    double *o = &out->elems[i * out->cols];
+    for (size_t j = 0; j < out->cols; ++j) o[j] = -INFINITY;
 
-      for (size_t pi = 0; pi < pool_size; ++pi) {
-        for (size_t pj = 0; pj < pool_size; ++pj) {
-          double val = MAT2D_GET((*input), i * pool_size + pi, j * pool_size + pj);
-          max = max < val ? val : max;
+    for (size_t pi = 0; pi < pool_size; ++pi) {
+      const double *in = &input->elems[(i * stride + pi) * input->ld];
+      for (size_t pj = 0; pj < pool_size; ++pj) {
+        #pragma omp simd
+        for (size_t j = 0; j < out->cols; ++j) {
+          const double val = in[j * stride + pj];
+          o[j] = o[j] < val ? val : o[j];
         }
       }
-
-      MAT2D_GET((*out), i, j) = max;
     }
   }
 }
 
-void avg_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size) {
-  assert(out->cols == input->cols / pool_size && out->rows == input->rows / pool_size);
+void max_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size, size_t stride) {
+  const plane_t in = plane_of_Mat2D(input);
+  plane_max_pooling2D(&in, out, pool_size, stride);
+}
+
+void mat_max_pooling2D(const mat_t *input, Mat2D *out, size_t pool_size, size_t stride) {
+  const plane_t in = plane_of_mat(input);
+  plane_max_pooling2D(&in, out, pool_size, stride);
+}
+
+// the window is summed in the same order as one output at a time
+static void plane_avg_pooling2D(const plane_t *input, Mat2D *out, size_t pool_size, size_t stride) {
+  assert(stride > 0 && input->rows >= pool_size && input->cols >= pool_size);
+  assert(out->rows == (input->rows - pool_size) / stride + 1 && out->cols == (input->cols - pool_size) / stride + 1);
   size_t total_pool_size = pool_size * pool_size;
 
   for (size_t i = 0; i < out->rows; ++i) {
-    for (size_t j = 0; j < out->cols; ++j) {
+    double *o = &out->elems[i * out->cols];
+    memset(o, 0, sizeof(double) * out->cols);
+
+    for (size_t pi = 0; pi < pool_size; ++pi) {
+      const double *in = &input->elems[(i * stride + pi) * input->ld];
+      for (size_t pj = 0; pj < pool_size; ++pj) {
+        #pragma omp simd
+        for (size_t j = 0; j < out->cols; ++j) {
+          o[j] += in[j * stride + pj];
+        }
+      }
+    }
+
+    for (size_t j = 0; j < out->cols; ++j) o[j] /= total_pool_size;
+  }
+}
+
+void avg_pooling2D(const Mat2D *input, Mat2D *out, size_t pool_size, size_t stride) {
+  const plane_t in = plane_of_Mat2D(input);
+  plane_avg_pooling2D(&in, out, pool_size, stride);
+}
+
+void mat_avg_pooling2D(const mat_t *input, Mat2D *out, size_t pool_size, size_t stride) {
+  const plane_t in = plane_of_mat(input);
+  plane_avg_pooling2D(&in, out, pool_size, stride);
+}
+
+void global_avg_pooling2D(const Mat2D *planes, size_t channels, double *out) {
+  for (size_t c = 0; c < channels; ++c) {
+    const size_t pixels = planes[c].rows * planes[c].cols;
+    const double *x = planes[c].elems;
+    double sum = 0.0;
+
+    #pragma omp simd reduction(+:sum)
+    for (size_t p = 0; p < pixels; ++p) {
+      sum += x[p];
+    }
+    out[c] = sum / pixels;
+  }
+}
+
+// rows [lo, hi) of a k_size window starting at first that fall inside [0, size)
+static inline void window_range(int first, int k_size, int size, int *lo, int *hi) {
+  *lo = first < 0 ? -first : 0;
+  *hi = first + k_size > size ? size - first : k_size;
+}
+
+static void plane_depthwise_conv2D(const plane_t *input, const double *kernel, size_t k_size, int stride, int padding, Mat2D *out) {
+  assert(stride > 0);
+  assert(out->rows == (input->rows - k_size + 2 * padding) / stride + 1);
+  assert(out->cols == (input->cols - k_size + 2 * padding) / stride + 1);
+  const int k = k_size, in_cols = input->cols;
+
+  for (size_t r = 0; r < out->rows; ++r) {
+    const int row0 = (int) r * stride - padding;
+    int kr_lo, kr_hi;
+    window_range(row0, k, input->rows, &kr_lo, &kr_hi);
+
+    for (size_t c = 0; c < out->cols; ++c) {
+      const int col0 = (int) c * stride - padding;
+      int kc_lo, kc_hi;
+      window_range(col0, k, in_cols, &kc_lo, &kc_hi);
+
       double sum = 0.0;
+      for (int kr = kr_lo; kr < kr_hi; ++kr) {
+        const double *in = &input->elems[(row0 + kr) * input->ld];
+        const double *w = &kernel[kr * k];
+        for (int kc = kc_lo; kc < kc_hi; ++kc) {
+          sum += in[col0 + kc] * w[kc];
+        }
+      }
+
+      MAT2D_GET((*out), r, c) = sum;
+    }
+  }
+}
+
+void depthwise_conv2D(const Mat2D *input, const double *kernel, size_t k_size, int stride, int padding, Mat2D *out) {
+  const plane_t in = plane_of_Mat2D(input);
+  plane_depthwise_conv2D(&in, kernel, k_size, stride, padding, out);
+}
+
+void mat_depthwise_conv2D(const mat_t *input, const double *kernel, size_t k_size, int stride, int padding, Mat2D *out) {
+  const plane_t in = plane_of_mat(input);
+  plane_depthwise_conv2D(&in, kernel, k_size, stride, padding, out);
+}
+
+void depthwise_conv2D_backward(const Mat2D *input, const double *kernel, size_t k_size, int stride, int padding,
+                               const Mat2D *grad_out, double *grad_kernel, Mat2D *grad_input) {
+  const int k = k_size, in_cols = input->cols;
+
+  for (size_t r = 0; r < grad_out->rows; ++r) {
+    const int row0 = (int) r * stride - padding;
+    int kr_lo, kr_hi;
+    window_range(row0, k, input->rows, &kr_lo, &kr_hi);
+
+    for (size_t c = 0; c < grad_out->cols; ++c) {
+      const double g = MAT2D_GET((*grad_out), r, c);
+      if (g == 0.0) continue;
+
+      const int col0 = (int) c * stride - padding;
+      int kc_lo, kc_hi;
+      window_range(col0, k, in_cols, &kc_lo, &kc_hi);
+
+      for (int kr = kr_lo; kr < kr_hi; ++kr) {
+        const double *in = &input->elems[(row0 + kr) * in_cols];
+        double *gw = &grad_kernel[kr * k];
+        for (int kc = kc_lo; kc < kc_hi; ++kc) {
+          gw[kc] += g * in[col0 + kc];
+        }
+        if (grad_input == NULL) continue;
+
+        double *gin = &grad_input->elems[(row0 + kr) * in_cols];
+        const double *w = &kernel[kr * k];
+        for (int kc = kc_lo; kc < kc_hi; ++kc) {
+          gin[col0 + kc] += g * w[kc];
+        }
+      }
+    }
+  }
+}
+
+// one axpy per weight, the pixels of a plane are streamed contiguously
+void pointwise_conv2D(const Mat2D *weights, const Mat2D *in, const double *bias, Mat2D *out) {
+  assert(weights->cols == in->rows);
+
+  #pragma omp parallel for
+  for (size_t k = 0; k < weights->rows; ++k) {
+    assert(out[k].rows * out[k].cols == in->cols);
+    double *o = out[k].elems;
+    for (size_t p = 0; p < in->cols; ++p) {
+      o[p] = bias[k];
+    }
+
+    for (size_t c = 0; c < in->rows; ++c) {
+      const double w = MAT2D_GET((*weights), k, c);
+      const double *x = &in->elems[c * in->cols];
+      for (size_t p = 0; p < in->cols; ++p) {
+        o[p] += w * x[p];
+      }
+    }
+  }
+}
+
+void max_pooling2D_backward(const Mat2D *input, const Mat2D *grad_out, size_t pool_size, size_t stride, Mat2D *grad_input) {
+  for (size_t i = 0; i < grad_out->rows; ++i) {
+    for (size_t j = 0; j < grad_out->cols; ++j) {
+      size_t mi = i * stride, mj = j * stride;
+
+      for (size_t pi = 0; pi < pool_size; ++pi) {
+        for (size_t pj = 0; pj < pool_size; ++pj) {
+          if (MAT2D_GET((*input), i * stride + pi, j * stride + pj) > MAT2D_GET((*input), mi, mj)) {
+            mi = i * stride + pi;
+            mj = j * stride + pj;
+          }
+        }
+      }
+
+      MAT2D_GET((*grad_input), mi, mj) += MAT2D_GET((*grad_out), i, j);
+    }
+  }
+}
+
+void avg_pooling2D_backward(const Mat2D *grad_out, size_t pool_size, size_t stride, Mat2D *grad_input) {
+  for (size_t i = 0; i < grad_out->rows; ++i) {
+    for (size_t j = 0; j < grad_out->cols; ++j) {
+      const double g = MAT2D_GET((*grad_out), i, j) / (pool_size * pool_size);
 
       for (size_t pi = 0; pi < pool_size; ++pi) {
         for (size_t pj = 0; pj < pool_size; ++pj) {
-          sum += MAT2D_GET((*input), i * pool_size + pi, j * pool_size + pj);
+          MAT2D_GET((*grad_input), i * stride + pi, j * stride + pj) += g;
         }
       }
+    }
+  }
+}
+
+QMat2D alloc_QMat2D(const size_t rows, const size_t cols, enum mem_kind kind) {
+  QMat2D m = (QMat2D) {
+    .cols = cols,
+    .rows = rows,
+    .elems = (int8_t *)mem_alloc(rows * cols * sizeof(int8_t), kind),
+    .scales = (float *)mem_alloc(rows * sizeof(float), kind),
+  };
+
+  assert(m.elems != NULL && m.scales != NULL && "not enough memory");
+
+  return m;
+}
+
+QMat2D new_QMat2D(const size_t rows, const size_t cols) {
+  return alloc_QMat2D(rows, cols, MEM_OTHER);
+}
+
+void destroy_QMat2D(QMat2D *m) {
+  mem_free(m->elems);
+  mem_free(m->scales);
+  m->elems = NULL;
+  m->scales = NULL;
+  m->cols = 0;
+  m->rows = 0;
+}
+
+// symmetric quantization to [-127, 127], -128 is never produced so the
+// VNNI path below can use the abs/sign trick without overflowing
+static inline int8_t quantize(double x, float scale) {
+  long q = lround(x / scale);
+  return q > 127 ? 127 : q < -127 ? -127 : (int8_t) q;
+}
+
+// one scale per row, scale = max(|row|) / 127
+void quantize_rows_Mat2D(const Mat2D *m, QMat2D *q) {
+  assert(m->rows == q->rows && m->cols == q->cols);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < m->rows; ++i) {
+    double max = 0.0;
+    for (size_t j = 0; j < m->cols; ++j) {
+      max = fmax(max, fabs(MAT2D_GET((*m), i, j)));
+    }
+
+    q->scales[i] = max > 0.0 ? max / 127.0 : 1.0f;
+    for (size_t j = 0; j < m->cols; ++j) {
+      MAT2D_GET((*q), i, j) = quantize(MAT2D_GET((*m), i, j), q->scales[i]);
+    }
+  }
+}
+
+void quantize_vec(const double *x, size_t n, float scale, int8_t *out) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = quantize(x[i], scale);
+  }
+}
+
+static int32_t qdot_scalar(const int8_t *a, const int8_t *b, size_t n) {
+  int32_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += (int32_t) a[i] * (int32_t) b[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static inline int32_t hsum_epi32(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+// widen to int16 and multiply-add pairs into int32 lanes
+__attribute__((target("avx2")))
+static int32_t qdot_avx2(const int8_t *a, const int8_t *b, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) &a[i]));
+    __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) &b[i]));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+
+  return hsum_epi32(acc) + qdot_scalar(&a[i], &b[i], n - i);
+}
+
+// vpdpbusd takes u8 x s8, so multiply |a| by b with the sign of a
+__attribute__((target("avx2,avxvnni")))
+static int32_t qdot_avxvnni(const int8_t *a, const int8_t *b, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i *) &a[i]);
+    __m256i vb = _mm256_loadu_si256((const __m256i *) &b[i]);
+    acc = _mm256_dpbusd_avx_epi32(acc, _mm256_abs_epi8(va), _mm256_sign_epi8(vb, va));
+  }
+
+  return hsum_epi32(acc) + qdot_avx2(&a[i], &b[i], n - i);
+}
+
+static int32_t (*qdot)(const int8_t *, const int8_t *, size_t) = qdot_scalar;
+
+__attribute__((constructor))
+static void select_qdot(void) {
+  if (__builtin_cpu_supports("avxvnni")) qdot = qdot_avxvnni;
+  else if (__builtin_cpu_supports("avx2")) qdot = qdot_avx2;
+}
+
+// out = dequant(mat * vec), accumulating in int32
+void QMat2D_col_mul(const QMat2D *mat, const int8_t *vec, float vec_scale, Mat2D *out) {
+  assert(out->rows == mat->rows && out->cols == 1);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < mat->rows; ++i) {
+    int32_t sum = qdot(&mat->elems[i * mat->cols], vec, mat->cols);
+    out->elems[i] = (double) sum * mat->scales[i] * vec_scale;
+  }
+}
 
-      MAT2D_GET((*out), i, j) = sum / total_pool_size;
+// out = dequant(m1 * m2^T), both operands are row-major so every output is a contiguous dot product
+void QMat2D_mul_T(const QMat2D *m1, const QMat2D *m2, Mat2D *out) {
+  assert(m1->cols == m2->cols);
+  assert(out->rows == m1->rows && out->cols == m2->rows);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < m1->rows; ++i) {
+    for (size_t j = 0; j < m2->rows; ++j) {
+      int32_t sum = qdot(&m1->elems[i * m1->cols], &m2->elems[j * m2->cols], m1->cols);
+      MAT2D_GET((*out), i, j) = (double) sum * m1->scales[i] * m2->scales[j];
     }
   }
 }
+
+// quantizes the patches seen by a k_rows x k_cols kernel, one output pixel per row,
+// laid out as [channel][kernel row][kernel col]. padding is stored as 0
+void quantize_im2col(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, float scale, QMat2D *out) {
+  assert(stride > 0);
+  const size_t out_rows = (input[0].rows - k_rows + 2 * padding) / stride + 1;
+  const size_t out_cols = (input[0].cols - k_cols + 2 * padding) / stride + 1;
+  assert(out->rows == out_rows * out_cols && out->cols == channels * k_rows * k_cols);
+
+  #pragma omp parallel for
+  for (size_t r = 0; r < out_rows; ++r) {
+    for (size_t c = 0; c < out_cols; ++c) {
+      int8_t *patch = &out->elems[(r * out_cols + c) * out->cols];
+      out->scales[r * out_cols + c] = scale;
+
+      for (size_t ch = 0; ch < channels; ++ch) {
+        for (size_t kr = 0; kr < k_rows; ++kr) {
+          for (size_t kc = 0; kc < k_cols; ++kc) {
+            int row = (int) r * stride - padding + kr;
+            int col = (int) c * stride - padding + kc;
+
+            *patch++ = row >= 0 && row < (int) input[ch].rows && col >= 0 && col < (int) input[ch].cols
+              ? quantize(MAT2D_GET(input[ch], row, col), scale)
+              : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+HMat2D alloc_HMat2D(const size_t rows, const size_t cols, enum half_format format, enum mem_kind kind) {
+  HMat2D m = (HMat2D) {
+    .cols = cols,
+    .rows = rows,
+    .format = format,
+    .elems = (uint16_t *)mem_alloc(rows * cols * sizeof(uint16_t), kind),
+  };
+
+  assert(m.elems != NULL && "not enough memory");
+
+  return m;
+}
+
+HMat2D new_HMat2D(const size_t rows, const size_t cols, enum half_format format) {
+  return alloc_HMat2D(rows, cols, format, MEM_OTHER);
+}
+
+void destroy_HMat2D(HMat2D *m) {
+  mem_free(m->elems);
+  m->elems = NULL;
+  m->cols = 0;
+  m->rows = 0;
+}
+
+// drops the low 16 bits of the fp32 value with round to nearest even
+static uint16_t float_to_bf16(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40; // quiet nan
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static float bf16_to_float(uint16_t h) {
+  uint32_t x = (uint32_t) h << 16;
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+static uint16_t float_to_fp16(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const uint32_t mag = x & 0x7fffffff;
+
+  if (mag >= 0x7f800000) return sign | 0x7c00 | (mag > 0x7f800000 ? 0x200 : 0);
+  if (mag >= 0x477ff000) return sign | 0x7c00; // rounds above 65504
+
+  uint32_t h, rem, half;
+  if (mag < 0x38800000) {
+    // subnormal, the value in units of 2^-24
+    if (mag < 0x33000000) return sign;
+    const uint32_t shift = 126 - (mag >> 23);
+    const uint32_t m = (mag & 0x7fffff) | 0x800000;
+    h = m >> shift;
+    rem = m & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+  } else {
+    // rebias the exponent from 127 to 15, a mantissa carry moves into the exponent
+    h = (mag - 0x38000000) >> 13;
+    rem = mag & 0x1fff;
+    half = 0x1000;
+  }
+
+  if (rem > half || (rem == half && (h & 1))) h++;
+  return sign | h;
+}
+
+static float fp16_to_float(uint16_t h) {
+  const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  const uint32_t e = (h >> 10) & 0x1f;
+  const uint32_t m = h & 0x3ff;
+  uint32_t x;
+  float f;
+
+  if (e == 0) {
+    f = m * 0x1p-24f;
+    memcpy(&x, &f, sizeof(x));
+    x |= sign;
+  } else if (e == 0x1f) {
+    x = sign | 0x7f800000 | (m << 13);
+  } else {
+    x = sign | ((e + 112) << 23) | (m << 13);
+  }
+
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+uint16_t to_half(double x, enum half_format format) {
+  return format == HALF_BF16 ? float_to_bf16((float) x) : float_to_fp16((float) x);
+}
+
+float from_half(uint16_t h, enum half_format format) {
+  return format == HALF_BF16 ? bf16_to_float(h) : fp16_to_float(h);
+}
+
+void half_Mat2D(const Mat2D *m, HMat2D *h) {
+  assert(m->rows == h->rows && m->cols == h->cols);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < m->rows * m->cols; ++i) {
+    h->elems[i] = to_half(m->elems[i], h->format);
+  }
+}
+
+static float hdot_fp16_scalar(const uint16_t *a, const float *b, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    sum += fp16_to_float(a[i]) * b[i];
+  }
+  return sum;
+}
+
+static float hdot_bf16_scalar(const uint16_t *a, const float *b, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    sum += bf16_to_float(a[i]) * b[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static inline float hsum_ps(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+// vcvtph2ps widens 8 halfs per instruction
+__attribute__((target("avx2,f16c,fma")))
+static float hdot_fp16_f16c(const uint16_t *a, const float *b, size_t n) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) &a[i])), _mm256_loadu_ps(&b[i]), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) &a[i + 8])), _mm256_loadu_ps(&b[i + 8]), acc1);
+  }
+
+  float sum = hsum_ps(_mm256_add_ps(acc0, acc1));
+  for (; i < n; ++i) {
+    sum += _cvtsh_ss(a[i]) * b[i];
+  }
+  return sum;
+}
+
+// a bf16 is the top half of an fp32, widening is a zero extend and a shift
+__attribute__((target("avx2,fma")))
+static float hdot_bf16_avx2(const uint16_t *a, const float *b, size_t n) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i w0 = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) &a[i])), 16);
+    __m256i w1 = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) &a[i + 8])), 16);
+    acc0 = _mm256_fmadd_ps(_mm256_castsi256_ps(w0), _mm256_loadu_ps(&b[i]), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_castsi256_ps(w1), _mm256_loadu_ps(&b[i + 8]), acc1);
+  }
+
+  return hsum_ps(_mm256_add_ps(acc0, acc1)) + hdot_bf16_scalar(&a[i], &b[i], n - i);
+}
+
+static float (*hdot_fp16)(const uint16_t *, const float *, size_t) = hdot_fp16_scalar;
+static float (*hdot_bf16)(const uint16_t *, const float *, size_t) = hdot_bf16_scalar;
+
+__attribute__((constructor))
+static void select_hdot(void) {
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    hdot_bf16 = hdot_bf16_avx2;
+    if (__builtin_cpu_supports("f16c")) hdot_fp16 = hdot_fp16_f16c;
+  }
+}
+
+void HMat2D_mul_T(const HMat2D *mat, const float *m, size_t m_rows, Mat2D *out) {
+  assert(out->rows == mat->rows && out->cols == m_rows);
+  float (*hdot)(const uint16_t *, const float *, size_t) = mat->format == HALF_BF16 ? hdot_bf16 : hdot_fp16;
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < mat->rows; ++i) {
+    for (size_t j = 0; j < m_rows; ++j) {
+      MAT2D_GET((*out), i, j) = hdot(&mat->elems[i * mat->cols], &m[j * mat->cols], mat->cols);
+    }
+  }
+}
+
+void HMat2D_col_mul(const HMat2D *mat, const Mat2D *vec, Mat2D *out) {
+  assert(mat->cols == vec->rows && vec->cols == 1);
+  assert(out->rows == mat->rows && out->cols == 1);
+
+  float *x = (float *) mem_alloc(sizeof(float) * vec->rows, MEM_SCRATCH);
+  assert(x != NULL && "not enough memory");
+  for (size_t i = 0; i < vec->rows; ++i) {
+    x[i] = (float) vec->elems[i];
+  }
+
+  HMat2D_mul_T(mat, x, 1, out);
+  mem_free(x);
+}
+
+void im2col_f32(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, float *out) {
+  assert(stride > 0);
+  const size_t out_rows = (input[0].rows - k_rows + 2 * padding) / stride + 1;
+  const size_t out_cols = (input[0].cols - k_cols + 2 * padding) / stride + 1;
+  const size_t patch_size = channels * k_rows * k_cols;
+
+  #pragma omp parallel for
+  for (size_t r = 0; r < out_rows; ++r) {
+    for (size_t c = 0; c < out_cols; ++c) {
+      float *patch = &out[(r * out_cols + c) * patch_size];
+
+      for (size_t ch = 0; ch < channels; ++ch) {
+        for (size_t kr = 0; kr < k_rows; ++kr) {
+          for (size_t kc = 0; kc < k_cols; ++kc) {
+            int row = (int) r * stride - padding + kr;
+            int col = (int) c * stride - padding + kc;
+
+            *patch++ = row >= 0 && row < (int) input[ch].rows && col >= 0 && col < (int) input[ch].cols
+              ? (float) MAT2D_GET(input[ch], row, col)
+              : 0.0f;
+          }
+        }
+      }
+    }
+  }
+}
+
+void im2col(const Mat2D *input, size_t channels, size_t k_rows, size_t k_cols, int stride, int padding, double *out) {
+  assert(stride > 0);
+  const size_t out_rows = (input[0].rows - k_rows + 2 * padding) / stride + 1;
+  const size_t out_cols = (input[0].cols - k_cols + 2 * padding) / stride + 1;
+  const size_t patch_size = channels * k_rows * k_cols;
+
+  #pragma omp parallel for
+  for (size_t r = 0; r < out_rows; ++r) {
+    for (size_t c = 0; c < out_cols; ++c) {
+      double *patch = &out[(r * out_cols + c) * patch_size];
+
+      for (size_t ch = 0; ch < channels; ++ch) {
+        for (size_t kr = 0; kr < k_rows; ++kr) {
+          for (size_t kc = 0; kc < k_cols; ++kc) {
+            int row = (int) r * stride - padding + kr;
+            int col = (int) c * stride - padding + kc;
+
+            *patch++ = row >= 0 && row < (int) input[ch].rows && col >= 0 && col < (int) input[ch].cols
+              ? MAT2D_GET(input[ch], row, col)
+              : 0.0;
+          }
+        }
+      }
+    }
+  }
+}
+
+void mul_T_Mat2D(const Mat2D *m1, const Mat2D *m2, Mat2D *out) {
+  assert(m1->cols == m2->cols);
+  assert(out->rows == m1->rows && out->cols == m2->rows);
+
+  #pragma omp parallel for collapse(2)
+  for (size_t i = 0; i < m1->rows; ++i) {
+    for (size_t j = 0; j < m2->rows; ++j) {
+      const double *a = &m1->elems[i * m1->cols];
+      const double *b = &m2->elems[j * m2->cols];
+      double sum = 0.0;
+      for (size_t k = 0; k < m1->cols; ++k) {
+        sum += a[k] * b[k];
+      }
+      MAT2D_GET((*out), i, j) = sum;
+    }
+  }
+}
+
+void Mat2D_T_col_mul(const Mat2D *mat, const Mat2D *vec, size_t tile, Mat2D *out) {
+  assert(vec->rows == mat->rows && vec->cols == 1);
+  assert(out->rows == mat->cols && out->cols == 1);
+  assert(tile > 0);
+
+  #pragma omp parallel for schedule(static)
+  for (size_t t = 0; t < mat->cols; t += tile) {
+    const size_t n = mat->cols - t < tile ? mat->cols - t : tile;
+    double *o = &out->elems[t];
+    memset(o, 0, sizeof(double) * n);
+
+    for (size_t j = 0; j < mat->rows; ++j) {
+      const double x = vec->elems[j];
+      const double *w = &mat->elems[j * mat->cols + t];
+      if (x == 0.0) continue;
+      for (size_t i = 0; i < n; ++i) {
+        o[i] += x * w[i];
+      }
+    }
+  }
+}
+
+size_t nonzero_rows(const Mat2D *vec, size_t *idx) {
+  size_t n = 0;
+  for (size_t j = 0; j < vec->rows * vec->cols; ++j) {
+    idx[n] = j;
+    n += vec->elems[j] != 0.0;
+  }
+  return n;
+}
+
+void Mat2D_T_gather_col_mul(const Mat2D *mat, const Mat2D *vec, const size_t *idx, size_t n, Mat2D *out) {
+  assert(vec->rows == mat->rows && vec->cols == 1);
+  assert(out->rows == mat->cols && out->cols == 1);
+  const size_t tile = 64;
+
+  #pragma omp parallel for schedule(static)
+  for (size_t t = 0; t < mat->cols; t += tile) {
+    const size_t m = mat->cols - t < tile ? mat->cols - t : tile;
+    double *o = &out->elems[t];
+    memset(o, 0, sizeof(double) * m);
+
+    for (size_t k = 0; k < n; ++k) {
+      const double x = vec->elems[idx[k]];
+      const double *w = &mat->elems[idx[k] * mat->cols + t];
+      for (size_t i = 0; i < m; ++i) {
+        o[i] += x * w[i];
+      }
+    }
+  }
+}
+
+mat_t mat_view(double *elems, size_t dim_count, const size_t *dims) {
+  assert(dim_count > 0 && dim_count <= MAT_MAX_DIMS);
+  mat_t m = { .dim_count = dim_count, .elems = elems };
+
+  size_t stride = 1;
+  for (size_t d = dim_count; d-- > 0;) {
+    m.dims[d] = dims[d];
+    m.strides[d] = stride;
+    stride *= dims[d];
+  }
+  return m;
+}
+
+mat_t mat_of_Mat2D(const Mat2D *m) {
+  return mat_view(m->elems, 2, (size_t[]) { m->rows, m->cols });
+}
+
+int mat_of_planes(const Mat2D *planes, size_t count, mat_t *out) {
+  assert(count > 0);
+  const ptrdiff_t gap = count > 1 ? planes[1].elems - planes[0].elems : 0;
+  if (gap < 0) return -1;
+
+  for (size_t c = 1; c < count; ++c) {
+    assert(planes[c].rows == planes[0].rows && planes[c].cols == planes[0].cols);
+    if (planes[c].elems != planes[0].elems + c * gap) return -1;
+  }
+
+  *out = mat_view(planes[0].elems, 3, (size_t[]) { count, planes[0].rows, planes[0].cols });
+  if (count > 1) out->strides[0] = gap;
+  return 0;
+}
+
+size_t mat_size(const mat_t *m) {
+  size_t n = 1;
+  for (size_t d = 0; d < m->dim_count; ++d) n *= m->dims[d];
+  return n;
+}
+
+double *mat_at(const mat_t *m, const size_t *idx) {
+  size_t at = m->offset;
+  for (size_t d = 0; d < m->dim_count; ++d) {
+    assert(idx[d] < m->dims[d]);
+    at += idx[d] * m->strides[d];
+  }
+  return &m->elems[at];
+}
+
+int mat_is_contiguous(const mat_t *m) {
+  size_t stride = 1;
+  for (size_t d = m->dim_count; d-- > 0;) {
+    // a dimension of 1 is never stepped over, its stride does not matter
+    if (m->dims[d] != 1 && m->strides[d] != stride) return 0;
+    stride *= m->dims[d];
+  }
+  return 1;
+}
+
+mat_t mat_slice(const mat_t *m, size_t dim, size_t begin, size_t end) {
+  assert(dim < m->dim_count && begin <= end && end <= m->dims[dim]);
+  mat_t s = *m;
+  s.offset += begin * m->strides[dim];
+  s.dims[dim] = end - begin;
+  return s;
+}
+
+mat_t mat_select(const mat_t *m, size_t dim, size_t i) {
+  assert(dim < m->dim_count && i < m->dims[dim] && m->dim_count > 1);
+  mat_t s = *m;
+  s.offset += i * m->strides[dim];
+  s.dim_count--;
+  for (size_t d = dim; d < s.dim_count; ++d) {
+    s.dims[d] = m->dims[d + 1];
+    s.strides[d] = m->strides[d + 1];
+  }
+  return s;
+}
+
+mat_t mat_reshape(const mat_t *m, size_t dim_count, const size_t *dims) {
+  assert(mat_is_contiguous(m) && "only a contiguous view can be reshaped without a copy");
+  mat_t r = mat_view(m->elems, dim_count, dims);
+  assert(mat_size(&r) == mat_size(m));
+  r.offset = m->offset;
+  return r;
+}
+
+Mat2D mat_to_Mat2D(const mat_t *m) {
+  assert(m->dim_count == 2 && mat_is_contiguous(m));
+  return (Mat2D) { .cols = m->dims[1], .rows = m->dims[0], .elems = &m->elems[m->offset] };
+}
+
+void mat_copy(const mat_t *src, const mat_t *dst) {
+  assert(src->dim_count == dst->dim_count);
+  for (size_t d = 0; d < src->dim_count; ++d) assert(src->dims[d] == dst->dims[d]);
+
+  if (mat_size(src) == 0) return;
+
+  // the innermost dimension is a run, the outer ones count through an index like an odometer
+  const size_t last = src->dim_count - 1, run = src->dims[last], runs = mat_size(src) / run;
+  size_t idx[MAT_MAX_DIMS] = { 0 };
+  for (size_t r = 0; r < runs; ++r) {
+    const double *x = mat_at(src, idx);
+    double *y = mat_at(dst, idx);
+    if (src->strides[last] == 1 && dst->strides[last] == 1) {
+      memcpy(y, x, sizeof(double) * run);
+    } else {
+      for (size_t i = 0; i < run; ++i) y[i * dst->strides[last]] = x[i * src->strides[last]];
+    }
+
+    for (size_t d = last; d-- > 0;) {
+      if (++idx[d] < src->dims[d]) break;
+      idx[d] = 0;
+    }
+  }
+}
+
+static int cmp_abs(const void *a, const void *b) {
+  double x = fabs(*(const double *) a), y = fabs(*(const double *) b);
+  return (x > y) - (x < y);
+}
+
+size_t prune_Mat2D(Mat2D *m, double sparsity) {
+  assert(sparsity >= 0.0 && sparsity <= 1.0);
+  const size_t n = m->rows * m->cols;
+  const size_t k = (size_t) (sparsity * n);
+  if (k == 0) return 0;
+
+  double *sorted = (double *) mem_alloc(sizeof(double) * n, MEM_SCRATCH);
+  assert(sorted != NULL && "not enough memory");
+  memcpy(sorted, m->elems, sizeof(double) * n);
+  qsort(sorted, n, sizeof(double), cmp_abs);
+  const double threshold = fabs(sorted[k - 1]);
+  mem_free(sorted);
+
+  // ties at the threshold are pruned too
+  size_t zeros = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (fabs(m->elems[i]) <= threshold) m->elems[i] = 0.0;
+    zeros += m->elems[i] == 0.0;
+  }
+  return zeros;
+}
+
+CSRMat2D alloc_CSRMat2D(const Mat2D *m, enum mem_kind kind) {
+  size_t nnz = 0;
+  for (size_t i = 0; i < m->rows * m->cols; ++i) {
+    nnz += m->elems[i] != 0.0;
+  }
+
+  assert(m->cols <= UINT32_MAX);
+  CSRMat2D s = (CSRMat2D) {
+    .cols = m->cols,
+    .rows = m->rows,
+    .nnz = nnz,
+    .vals = (double *) mem_alloc(sizeof(double) * (nnz ? nnz : 1), kind),
+    .col_idx = (uint32_t *) mem_alloc(sizeof(uint32_t) * (nnz ? nnz : 1), kind),
+    .row_ptr = (size_t *) mem_alloc(sizeof(size_t) * (m->rows + 1), kind),
+  };
+  assert(s.vals != NULL && s.col_idx != NULL && s.row_ptr != NULL && "not enough memory");
+
+  size_t p = 0;
+  for (size_t i = 0; i < m->rows; ++i) {
+    s.row_ptr[i] = p;
+    for (size_t j = 0; j < m->cols; ++j) {
+      if (MAT2D_GET((*m), i, j) == 0.0) continue;
+      s.vals[p] = MAT2D_GET((*m), i, j);
+      s.col_idx[p++] = j;
+    }
+  }
+  s.row_ptr[m->rows] = p;
+
+  return s;
+}
+
+CSRMat2D new_CSRMat2D(const Mat2D *m) {
+  return alloc_CSRMat2D(m, MEM_OTHER);
+}
+
+void destroy_CSRMat2D(CSRMat2D *m) {
+  mem_free(m->vals);
+  mem_free(m->col_idx);
+  mem_free(m->row_ptr);
+  *m = (CSRMat2D) { 0 };
+}
+
+void CSRMat2D_mul(const CSRMat2D *mat, const Mat2D *m, Mat2D *out) {
+  assert(mat->cols == m->rows);
+  assert(out->rows == mat->rows && out->cols == m->cols);
+  const size_t k = m->cols;
+
+  if (k == 1) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < mat->rows; ++i) {
+      double sum = 0.0;
+      for (size_t p = mat->row_ptr[i]; p < mat->row_ptr[i + 1]; ++p) {
+        sum += mat->vals[p] * m->elems[mat->col_idx[p]];
+      }
+      out->elems[i] = sum;
+    }
+    return;
+  }
+
+  // every nonzero scales a whole row of m into the output row
+  #pragma omp parallel for
+  for (size_t i = 0; i < mat->rows; ++i) {
+    double *o = &out->elems[i * k];
+    memset(o, 0, sizeof(double) * k);
+    for (size_t p = mat->row_ptr[i]; p < mat->row_ptr[i + 1]; ++p) {
+      const double v = mat->vals[p];
+      const double *row = &m->elems[mat->col_idx[p] * k];
+      #pragma omp simd
+      for (size_t j = 0; j < k; ++j) {
+        o[j] += v * row[j];
+      }
+    }
+  }
+}
+
+// w -= lr * g
+void sgd_step(double *w, const double *g, size_t n, double lr, double scale) {
+  const double step = lr * scale;
+
+  #pragma omp parallel for simd if(n > 4096)
+  for (size_t i = 0; i < n; ++i) {
+    w[i] -= step * g[i];
+  }
+}
+
+// v = mu * v + g, w -= lr * v, or w -= lr * (g + mu * v) with nesterov
+void momentum_step(double *w, const double *g, double *v, size_t n, double lr, double scale, double mu, int nesterov) {
+  #pragma omp parallel for simd if(n > 4096)
+  for (size_t i = 0; i < n; ++i) {
+    const double gi = g[i] * scale;
+    const double vi = mu * v[i] + gi;
+    v[i] = vi;
+    w[i] -= lr * (nesterov ? gi + mu * vi : vi);
+  }
+}
+
+// t is the 1-based step, used for the bias correction of the moments
+void adam_step(double *w, const double *g, double *m, double *v, size_t n, double lr, double scale, double beta1, double beta2, double eps, size_t t) {
+  const double lr_t = lr * sqrt(1.0 - pow(beta2, t)) / (1.0 - pow(beta1, t));
+  const double eps_t = eps * sqrt(1.0 - pow(beta2, t));
+
+  #pragma omp parallel for simd if(n > 4096)
+  for (size_t i = 0; i < n; ++i) {
+    const double gi = g[i] * scale;
+    const double mi = beta1 * m[i] + (1.0 - beta1) * gi;
+    const double vi = beta2 * v[i] + (1.0 - beta2) * gi * gi;
+    m[i] = mi;
+    v[i] = vi;
+    w[i] -= lr_t * mi / (sqrt(vi) + eps_t);
+  }
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+void sort_doubles(double *x, size_t n) {
+  qsort(x, n, sizeof(double), cmp_double);
+}
+
+// nearest rank on sorted samples
+double percentile(const double *sorted, size_t n, double p) {
+  size_t rank = (size_t) ceil(p / 100.0 * n);
+  return sorted[rank == 0 ? 0 : rank - 1];
+}
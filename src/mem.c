@@ -0,0 +1,227 @@
+#include "mem.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// every block is prefixed by a header of one cache line, the block follows aligned
+typedef struct {
+  _Alignas(MEM_ALIGN) size_t size;
+  size_t kind;
+  size_t mapped; // length of the block's own mapping, 0 on the heap
+  int hugetlb;
+} header_t;
+
+static _Atomic size_t live[MEM_KIND_COUNT];
+static _Atomic size_t total;
+static _Atomic size_t peak;
+static _Atomic size_t phase_peak[MEM_PHASE_COUNT];
+static _Atomic size_t allocs;
+static _Atomic size_t frees;
+static _Atomic size_t steps;
+static _Atomic size_t step_start;
+static _Atomic size_t last_step_allocs;
+static _Atomic size_t max_step_allocs;
+static _Atomic int phase = MEM_PHASE_IDLE;
+static _Atomic size_t mapped;
+static _Atomic size_t hugetlb;
+static _Atomic int huge_pages = MEM_HUGE_TRANSPARENT;
+
+static void atomic_max(_Atomic size_t *a, size_t v) {
+  size_t cur = atomic_load(a);
+  while (cur < v && !atomic_compare_exchange_weak(a, &cur, v));
+}
+
+static void account(size_t bytes, enum mem_kind kind) {
+  atomic_fetch_add(&live[kind], bytes);
+  size_t now = atomic_fetch_add(&total, bytes) + bytes;
+  atomic_max(&peak, now);
+  atomic_max(&phase_peak[atomic_load(&phase)], now);
+}
+
+static void unaccount(size_t bytes, enum mem_kind kind) {
+  atomic_fetch_sub(&live[kind], bytes);
+  atomic_fetch_sub(&total, bytes);
+}
+
+static size_t round_up(size_t n, size_t to) {
+  return (n + to - 1) / to * to;
+}
+
+static header_t *map_block(size_t bytes, enum mem_huge_pages mode) {
+  const size_t len = round_up(bytes, MEM_HUGE_PAGE);
+  header_t *h;
+
+  void *p = mode == MEM_HUGE_EXPLICIT
+    ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)
+    : MAP_FAILED;
+  if (p != MAP_FAILED) {
+    h = (header_t *) p;
+    h->hugetlb = 1;
+    atomic_fetch_add(&hugetlb, len);
+  } else {
+    // one huge page more than needed, trimmed on both ends so the block starts on a huge page
+    char *raw = mmap(NULL, len + MEM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char *begin = (char *) round_up((uintptr_t) raw, MEM_HUGE_PAGE);
+    if (begin != raw) munmap(raw, begin - raw);
+    munmap(begin + len, raw + MEM_HUGE_PAGE - begin);
+    madvise(begin, len, MADV_HUGEPAGE);
+
+    h = (header_t *) begin;
+    h->hugetlb = 0;
+  }
+
+  h->mapped = len;
+  atomic_fetch_add(&mapped, len);
+  return h;
+}
+
+// the header and the block, unaccounted
+static header_t *raw_alloc(size_t bytes) {
+  const size_t total = round_up(sizeof(header_t) + bytes, MEM_ALIGN);
+  const enum mem_huge_pages mode = atomic_load(&huge_pages);
+
+  header_t *h = mode != MEM_HUGE_OFF && bytes >= MEM_HUGE_PAGE ? map_block(total, mode) : NULL;
+  if (h) return h;
+
+  h = (header_t *) aligned_alloc(MEM_ALIGN, total);
+  if (h == NULL) return NULL;
+  h->mapped = 0;
+  h->hugetlb = 0;
+  return h;
+}
+
+static void raw_free(header_t *h) {
+  if (h->mapped == 0) {
+    free(h);
+    return;
+  }
+
+  atomic_fetch_sub(&mapped, h->mapped);
+  if (h->hugetlb) atomic_fetch_sub(&hugetlb, h->mapped);
+  munmap(h, h->mapped);
+}
+
+void *mem_alloc(size_t bytes, enum mem_kind kind) {
+  assert(kind < MEM_KIND_COUNT);
+
+  header_t *h = raw_alloc(bytes);
+  if (h == NULL) return NULL;
+
+  h->size = bytes;
+  h->kind = kind;
+  atomic_fetch_add(&allocs, 1);
+  account(bytes, kind);
+
+  return h + 1;
+}
+
+void *mem_calloc(size_t count, size_t size, enum mem_kind kind) {
+  void *p = mem_alloc(count * size, kind);
+  // fresh mappings are already zero, leave their pages to be first touched by whoever uses them
+  if (p && ((header_t *) p - 1)->mapped == 0) memset(p, 0, count * size);
+  return p;
+}
+
+void *mem_realloc(void *p, size_t bytes) {
+  if (p == NULL) return mem_alloc(bytes, MEM_OTHER);
+
+  header_t *h = (header_t *) p - 1;
+  size_t old = h->size;
+  enum mem_kind kind = h->kind;
+
+  // realloc would not keep the alignment
+  header_t *n = raw_alloc(bytes);
+  if (n == NULL) return NULL;
+
+  memcpy(n + 1, h + 1, old < bytes ? old : bytes);
+  raw_free(h);
+  h = n;
+  h->size = bytes;
+  h->kind = kind;
+  atomic_fetch_add(&allocs, 1);
+  unaccount(old, kind);
+  account(bytes, kind);
+
+  return h + 1;
+}
+
+void mem_free(void *p) {
+  if (p == NULL) return;
+
+  header_t *h = (header_t *) p - 1;
+  atomic_fetch_add(&frees, 1);
+  unaccount(h->size, h->kind);
+  raw_free(h);
+}
+
+enum mem_huge_pages mem_set_huge_pages(enum mem_huge_pages mode) {
+  return atomic_exchange(&huge_pages, mode);
+}
+
+enum mem_phase mem_set_phase(enum mem_phase p) {
+  assert(p < MEM_PHASE_COUNT);
+  enum mem_phase prev = atomic_exchange(&phase, p);
+  atomic_max(&phase_peak[p], atomic_load(&total));
+  return prev;
+}
+
+// allocations made since the previous call are the cost of one training step
+void mem_end_step(void) {
+  size_t now = atomic_load(&allocs);
+  size_t count = now - atomic_exchange(&step_start, now);
+
+  atomic_fetch_add(&steps, 1);
+  atomic_store(&last_step_allocs, count);
+  atomic_max(&max_step_allocs, count);
+}
+
+mem_stats_t mem_stats(void) {
+  mem_stats_t s = {
+    .peak = atomic_load(&peak),
+    .allocs = atomic_load(&allocs),
+    .frees = atomic_load(&frees),
+    .steps = atomic_load(&steps),
+    .last_step_allocs = atomic_load(&last_step_allocs),
+    .max_step_allocs = atomic_load(&max_step_allocs),
+    .mapped = atomic_load(&mapped),
+    .hugetlb = atomic_load(&hugetlb),
+  };
+
+  for (size_t k = 0; k < MEM_KIND_COUNT; ++k) s.live[k] = atomic_load(&live[k]);
+  for (size_t p = 0; p < MEM_PHASE_COUNT; ++p) s.phase_peak[p] = atomic_load(&phase_peak[p]);
+
+  return s;
+}
+
+void mem_reset_peaks(void) {
+  size_t now = atomic_load(&total);
+
+  atomic_store(&peak, now);
+  for (size_t p = 0; p < MEM_PHASE_COUNT; ++p) atomic_store(&phase_peak[p], 0);
+  atomic_store(&phase_peak[atomic_load(&phase)], now);
+  atomic_store(&max_step_allocs, 0);
+  atomic_store(&step_start, atomic_load(&allocs));
+}
+
+void mem_print_stats(void) {
+  const char *kinds[MEM_KIND_COUNT] = { "weights", "activations", "gradients", "scratch", "other" };
+  const char *phases[MEM_PHASE_COUNT] = { "idle", "forward", "backward", "update" };
+  mem_stats_t s = mem_stats();
+
+  for (size_t k = 0; k < MEM_KIND_COUNT; ++k) {
+    printf("%-12s %12zu bytes\n", kinds[k], s.live[k]);
+  }
+  printf("%-12s %12zu bytes\n", "peak", s.peak);
+  for (size_t p = 0; p < MEM_PHASE_COUNT; ++p) {
+    printf("peak %-7s %12zu bytes\n", phases[p], s.phase_peak[p]);
+  }
+  printf("%-12s %12zu bytes (%zu from hugetlb)\n", "mapped", s.mapped, s.hugetlb);
+  printf("allocs %zu, frees %zu, allocs per step %zu (max %zu over %zu steps)\n",
+         s.allocs, s.frees, s.last_step_allocs, s.max_step_allocs, s.steps);
+}
@@ -0,0 +1,61 @@
+#include "rng.h"
+#include <stdlib.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+    const uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t) p1;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+uint64_t rng_seed(void) {
+  // random() gives 31 bits
+  return (uint64_t) random() << 33 ^ (uint64_t) random() << 2 ^ (uint64_t) random();
+}
+
+double rng_uniform(rng_t r, uint64_t i) {
+  const uint32_t ctr[4] = { (uint32_t) i, (uint32_t) (i >> 32), (uint32_t) r.stream, (uint32_t) (r.stream >> 32) };
+  const uint32_t key[2] = { (uint32_t) r.seed, (uint32_t) (r.seed >> 32) };
+  uint32_t out[4];
+  philox4x32(ctr, key, out);
+
+  const uint64_t bits = ((uint64_t) out[0] << 32 | out[1]) >> 11;
+  return (double) bits * 0x1.0p-53;
+}
+
+void rng_fill(rng_t r, uint64_t first, double *x, size_t n, double min, double max) {
+  const double diff = max - min;
+
+  #pragma omp parallel for schedule(static)
+  for (size_t k = 0; k < n; ++k) {
+    x[k] = rng_uniform(r, first + k) * diff + min;
+  }
+}
+
+void rng_shuffle(rng_t r, size_t *idx, size_t n) {
+  for (size_t i = n; i > 1; --i) {
+    const size_t j = (size_t) (rng_uniform(r, n - i) * i);
+    const size_t t = idx[i - 1];
+    idx[i - 1] = idx[j];
+    idx[j] = t;
+  }
+}
@@ -0,0 +1,337 @@
+#include "serve.h"
+#include "mem.h"
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// one request, on the stack of its connection thread until a worker marks it done
+typedef struct request {
+  const double *in;
+  double *out;
+  double arrived;
+  int done;
+  pthread_cond_t cond;
+  struct request *next;
+} request_t;
+
+typedef struct conn {
+  serve_t *s;
+  int fd;
+  struct conn *prev, *next;
+} conn_t;
+
+struct serve {
+  const nn_t *nn;
+  serve_config_t config;
+  size_t in_size, out_size;
+  char *path;
+  int fd;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;  // a request came in, a connection went away, or the batch being filled can go
+  pthread_cond_t drained; // a connection went away
+  request_t *head, *tail;
+  size_t count;
+  int filling;            // a worker is waiting for its batch to fill
+  int busy;               // workers running a batch
+  conn_t *conns;
+  size_t conn_count;
+  size_t waiting;         // connections with a request queued or running
+  pthread_t acceptor;
+  pthread_t *workers;
+  // stats
+  double start;
+  size_t requests, batches;
+  double latency[SERVE_LATENCY_WINDOW];
+};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static struct timespec deadline_of(double t) {
+  return (struct timespec) { .tv_sec = (time_t) t, .tv_nsec = (long) ((t - floor(t)) * 1e9) };
+}
+
+static int read_all(int fd, void *p, size_t bytes) {
+  while (bytes > 0) {
+    ssize_t k = read(fd, p, bytes);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return -1;
+    p = (char *) p + k;
+    bytes -= k;
+  }
+  return 0;
+}
+
+// a client gone mid write must not kill the server with SIGPIPE
+static int send_all(int fd, const void *p, size_t bytes) {
+  while (bytes > 0) {
+    ssize_t k = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return -1;
+    p = (const char *) p + k;
+    bytes -= k;
+  }
+  return 0;
+}
+
+static void *worker(void *arg) {
+  serve_t *s = (serve_t *) arg;
+  const size_t channels = s->nn->layers[0].il.channels ? s->nn->layers[0].il.channels : 1;
+  request_t *batch[s->config.max_batch];
+  Mat2D x[channels];
+
+  // the parallelism is across workers, one OpenMP thread each
+  omp_set_num_threads(1);
+  nn_t ctx = nn_new_context(s->nn);
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (!s->stop && (s->count == 0 || s->filling)) pthread_cond_wait(&s->queued, &s->lock);
+    if (s->count == 0) break;
+
+    // the oldest request bounds how long the batch waits to fill
+    s->filling = 1;
+    const struct timespec deadline = deadline_of(s->head->arrived + s->config.max_delay);
+    // a connection has one request at a time, once all of them wait nothing else can come
+    while (!s->stop && s->count < s->config.max_batch && s->waiting < s->conn_count) {
+      if (pthread_cond_timedwait(&s->queued, &s->lock, &deadline) == ETIMEDOUT) break;
+    }
+
+    // a worker runs its batch on one thread, so it takes its share of the queue and leaves the rest to
+    // the workers that are idle with it
+    const size_t idle = s->config.workers - s->busy;
+    const size_t share = (s->count + idle - 1) / idle;
+    const size_t take = share < s->config.max_batch ? share : s->config.max_batch;
+    size_t n = 0;
+    for (; n < take && s->head; ++n) {
+      batch[n] = s->head;
+      s->head = s->head->next;
+    }
+    if (s->head == NULL) s->tail = NULL;
+    s->count -= n;
+    s->filling = 0;
+    s->busy++;
+    // the next idle worker starts on what is left
+    pthread_cond_broadcast(&s->queued);
+    pthread_mutex_unlock(&s->lock);
+
+    for (size_t i = 0; i < n; ++i) {
+      size_t c = nn_input_view(s->nn, batch[i]->in, x);
+      nn_forward(&ctx, x, c);
+      memcpy(batch[i]->out, nn_output(&ctx)->elems, sizeof(double) * s->out_size);
+    }
+
+    const double t = now();
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; i < n; ++i) {
+      s->latency[s->requests++ % SERVE_LATENCY_WINDOW] = t - batch[i]->arrived;
+      batch[i]->done = 1;
+      s->waiting--;
+      pthread_cond_signal(&batch[i]->cond);
+    }
+    s->batches++;
+    s->busy--;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  nn_destroy(&ctx);
+  return NULL;
+}
+
+static void *connection(void *arg) {
+  conn_t *c = (conn_t *) arg;
+  serve_t *s = c->s;
+  double *in = (double *) mem_alloc(sizeof(double) * (s->in_size + s->out_size), MEM_OTHER);
+  assert(in != NULL && "not enough memory");
+  request_t r = { .in = in, .out = &in[s->in_size] };
+  pthread_cond_init(&r.cond, NULL);
+
+  while (read_all(c->fd, in, sizeof(double) * s->in_size) == 0) {
+    r.arrived = now();
+    r.done = 0;
+    r.next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->stop) {
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    if (s->tail) s->tail->next = &r;
+    else s->head = &r;
+    s->tail = &r;
+    s->count++;
+    s->waiting++;
+    pthread_cond_broadcast(&s->queued);
+    while (!r.done) pthread_cond_wait(&r.cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    if (send_all(c->fd, r.out, sizeof(double) * s->out_size) != 0) break;
+  }
+
+  pthread_cond_destroy(&r.cond);
+  mem_free(in);
+
+  // closed under the lock, serve_close must not shut down a descriptor number reused meanwhile
+  pthread_mutex_lock(&s->lock);
+  close(c->fd);
+  if (c->prev) c->prev->next = c->next;
+  else s->conns = c->next;
+  if (c->next) c->next->prev = c->prev;
+  s->conn_count--;
+  pthread_cond_broadcast(&s->drained);
+  pthread_cond_broadcast(&s->queued);
+  pthread_mutex_unlock(&s->lock);
+
+  mem_free(c);
+  return NULL;
+}
+
+static void *acceptor(void *arg) {
+  serve_t *s = (serve_t *) arg;
+
+  for (;;) {
+    int fd = accept(s->fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+
+    conn_t *c = (conn_t *) mem_calloc(1, sizeof(conn_t), MEM_OTHER);
+    assert(c != NULL && "not enough memory");
+    c->s = s;
+    c->fd = fd;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->stop) {
+      pthread_mutex_unlock(&s->lock);
+      close(fd);
+      mem_free(c);
+      break;
+    }
+    c->next = s->conns;
+    if (s->conns) s->conns->prev = c;
+    s->conns = c;
+    s->conn_count++;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_t t;
+    int err = pthread_create(&t, NULL, connection, c);
+    assert(err == 0 && "could not start a connection thread");
+    pthread_detach(t);
+  }
+
+  return NULL;
+}
+
+serve_t *serve_open(const nn_t *nn, const char *path, serve_config_t config) {
+  assert(config.max_batch > 0 && config.max_delay >= 0.0);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  assert(strlen(path) < sizeof(addr.sun_path) && "socket path too long");
+  strcpy(addr.sun_path, path);
+
+  // a socket left by a server that did not shut down cleanly, anything else is not ours to remove
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return NULL;
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  serve_t *s = (serve_t *) mem_calloc(1, sizeof(serve_t), MEM_OTHER);
+  assert(s != NULL && "not enough memory");
+  s->nn = nn;
+  s->config = config;
+  if (s->config.workers <= 0) s->config.workers = omp_get_max_threads();
+  s->in_size = nn->layers[0].il.height * nn->layers[0].il.width
+    * (nn->layers[0].il.channels ? nn->layers[0].il.channels : 1);
+  s->out_size = nn_output(nn)->rows;
+  s->path = strdup(path);
+  s->fd = fd;
+  s->start = now();
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->queued, &attr);
+  pthread_cond_init(&s->drained, NULL);
+  pthread_condattr_destroy(&attr);
+
+  s->workers = (pthread_t *) mem_alloc(sizeof(pthread_t) * s->config.workers, MEM_OTHER);
+  assert(s->path != NULL && s->workers != NULL && "not enough memory");
+  for (int i = 0; i < s->config.workers; ++i) {
+    int err = pthread_create(&s->workers[i], NULL, worker, s);
+    assert(err == 0 && "could not start a worker");
+  }
+  int err = pthread_create(&s->acceptor, NULL, acceptor, s);
+  assert(err == 0 && "could not start the acceptor");
+
+  return s;
+}
+
+void serve_stats(serve_t *s, serve_stats_t *stats) {
+  double sorted[SERVE_LATENCY_WINDOW];
+
+  pthread_mutex_lock(&s->lock);
+  const size_t n = s->requests < SERVE_LATENCY_WINDOW ? s->requests : SERVE_LATENCY_WINDOW;
+  memcpy(sorted, s->latency, sizeof(double) * n);
+  *stats = (serve_stats_t) {
+    .requests = s->requests,
+    .batches = s->batches,
+    .mean_batch = s->batches ? (double) s->requests / s->batches : 0.0,
+    .throughput = s->requests / (now() - s->start),
+  };
+  pthread_mutex_unlock(&s->lock);
+
+  if (n == 0) return;
+  sort_doubles(sorted, n);
+  stats->p50 = percentile(sorted, n, 50.0);
+  stats->p99 = percentile(sorted, n, 99.0);
+  stats->max = sorted[n - 1];
+}
+
+void serve_close(serve_t *s) {
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->queued);
+  pthread_mutex_unlock(&s->lock);
+
+  // wakes the acceptor out of accept, then the connections out of read
+  shutdown(s->fd, SHUT_RDWR);
+  pthread_join(s->acceptor, NULL);
+  pthread_mutex_lock(&s->lock);
+  for (conn_t *c = s->conns; c; c = c->next) shutdown(c->fd, SHUT_RDWR);
+  pthread_mutex_unlock(&s->lock);
+
+  // the workers drain the queue before they stop, so no connection is left waiting
+  for (int i = 0; i < s->config.workers; ++i) pthread_join(s->workers[i], NULL);
+  pthread_mutex_lock(&s->lock);
+  while (s->conn_count > 0) pthread_cond_wait(&s->drained, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+
+  close(s->fd);
+  unlink(s->path);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->queued);
+  pthread_cond_destroy(&s->drained);
+  mem_free(s->workers);
+  free(s->path);
+  mem_free(s);
+}
@@ -0,0 +1,153 @@
+#include "cnn.h"
+#include "serve.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// the network is rebuilt from the same layer list it was trained with, then its weights are read from
+// a checkpoint written by nn_fit or nn_checkpoint
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [-b max_batch] [-d max_delay_ms] [-w workers] [-s stats_seconds] [-o optimizer]\n"
+    "          socket checkpoint HxWxC layer...\n"
+    "\n"
+    "  layers: dense:units:act conv:kernels:size:channels:padding:stride:act\n"
+    "          sep:kernels:size:channels:padding:stride:act maxpool:size[:stride] avgpool:size[:stride]\n"
+    "          gap flatten bn\n"
+    "  act: sigmoid softmax relu tanh linear\n"
+    "  optimizer: the one the checkpoint was trained with, sgd momentum nesterov adam (default sgd)\n",
+    name);
+}
+
+static int parse_act(const char *s, ActFun *act) {
+  const char *names[] = { [SIGMOID] = "sigmoid", [SOFTMAX] = "softmax", [RELU] = "relu", [TANH] = "tanh", [LINEAR] = "linear" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (strcmp(s, names[i]) == 0) {
+      *act = (ActFun) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int parse_layer(nn_t *nn, const char *spec) {
+  size_t a, b, c;
+  int pad, stride;
+  char act_name[16];
+  ActFun act;
+
+  if (sscanf(spec, "dense:%zu:%15s", &a, act_name) == 2 && parse_act(act_name, &act) == 0) {
+    nn_add_dense_layer(nn, a, act);
+  } else if (sscanf(spec, "conv:%zu:%zu:%zu:%d:%d:%15s", &a, &b, &c, &pad, &stride, act_name) == 6 && parse_act(act_name, &act) == 0) {
+    nn_add_conv2d_layer(nn, a, b, c, pad, stride, act);
+  } else if (sscanf(spec, "sep:%zu:%zu:%zu:%d:%d:%15s", &a, &b, &c, &pad, &stride, act_name) == 6 && parse_act(act_name, &act) == 0) {
+    nn_add_depthwise_separable_conv_layer(nn, a, b, c, pad, stride, act);
+  } else if (sscanf(spec, "maxpool:%zu:%zu", &a, &b) == 2) {
+    nn_add_strided_pooling_layer(nn, MAX_POOL, a, b);
+  } else if (sscanf(spec, "avgpool:%zu:%zu", &a, &b) == 2) {
+    nn_add_strided_pooling_layer(nn, AVG_POOL, a, b);
+  } else if (sscanf(spec, "maxpool:%zu", &a) == 1) {
+    nn_add_max_pooling_layer(nn, a);
+  } else if (sscanf(spec, "avgpool:%zu", &a) == 1) {
+    nn_add_avg_pooling_layer(nn, a);
+  } else if (strcmp(spec, "gap") == 0) {
+    nn_add_global_avg_pooling_layer(nn);
+  } else if (strcmp(spec, "flatten") == 0) {
+    nn_add_flatten_layer(nn);
+  } else if (strcmp(spec, "bn") == 0) {
+    nn_add_batch_norm_layer(nn);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_optimizer(const char *s, OptKind *kind) {
+  const char *names[] = { [SGD] = "sgd", [MOMENTUM] = "momentum", [NESTEROV] = "nesterov", [ADAM] = "adam" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (strcmp(s, names[i]) == 0) {
+      *kind = (OptKind) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  serve_config_t config = { .max_batch = 32, .max_delay = 0.002, .workers = 0 };
+  double stats_every = 10.0;
+  OptKind opt = SGD;
+
+  int o;
+  while ((o = getopt(argc, argv, "b:d:w:s:o:h")) != -1) {
+    switch (o) {
+      case 'b': config.max_batch = strtoul(optarg, NULL, 10); break;
+      case 'd': config.max_delay = strtod(optarg, NULL) / 1e3; break;
+      case 'w': config.workers = atoi(optarg); break;
+      case 's': stats_every = strtod(optarg, NULL); break;
+      case 'o':
+        if (parse_optimizer(optarg, &opt) == 0) break;
+        // fallthrough
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  size_t h, w, c;
+  if (argc - optind < 4 || sscanf(argv[optind + 2], "%zux%zux%zu", &h, &w, &c) != 3 || config.max_batch == 0 || stats_every <= 0.0) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *socket_path = argv[optind], *checkpoint = argv[optind + 1];
+
+  nn_t nn = new_nn(h, w, c);
+  for (int i = optind + 3; i < argc; ++i) {
+    if (parse_layer(&nn, argv[i]) != 0) {
+      fprintf(stderr, "bad layer: %s\n", argv[i]);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  nn_set_optimizer(&nn, nn_optimizer(opt));
+  nn_compile(&nn);
+  if (nn_load_checkpoint(&nn, checkpoint) != 0) {
+    fprintf(stderr, "%s is missing or was not written by this network and optimizer\n", checkpoint);
+    nn_destroy(&nn);
+    return 1;
+  }
+  nn_freeze(&nn);
+
+  // only this thread takes the signals, the server threads inherit the mask
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+  serve_t *s = serve_open(&nn, socket_path, config);
+  if (s == NULL) {
+    perror(socket_path);
+    nn_destroy(&nn);
+    return 1;
+  }
+  fprintf(stderr, "serving on %s, batches of up to %zu within %.3f ms\n", socket_path, config.max_batch, config.max_delay * 1e3);
+
+  const struct timespec every = { .tv_sec = (time_t) stats_every, .tv_nsec = (long) ((stats_every - (time_t) stats_every) * 1e9) };
+  for (;;) {
+    const int sig = sigtimedwait(&stop, NULL, &every);
+
+    serve_stats_t st;
+    serve_stats(s, &st);
+    fprintf(stderr, "requests %zu, batches %zu (%.1f per batch), latency p50 %.3f ms p99 %.3f ms max %.3f ms, %.0f requests/s\n",
+            st.requests, st.batches, st.mean_batch, st.p50 * 1e3, st.p99 * 1e3, st.max * 1e3, st.throughput);
+    if (sig == SIGINT || sig == SIGTERM) break;
+  }
+
+  serve_close(s);
+  nn_destroy(&nn);
+  return 0;
+}
@@ -1,7 +1,11 @@
 #include "mat.h"
+#include "rng.h"
 #include "test_utils.h"
-#include <bits/time.h>
-#include <time.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 void mul_test() {
   Mat2D m1 = new_Mat2D(2, 2);
@@ -31,83 +35,6 @@ void mul_test() {
   destroy_Mat2D(&res);
 }
 
-void mul_performace() {
-  struct timespec start, end;
-  const size_t ROWS = 1000;
-  const size_t COLS = 1500;
-  double t = 0.0;
-
-  Mat2D m1 = new_Mat2D(ROWS, COLS);
-  Mat2D m2 = new_Mat2D(COLS, ROWS);
-  Mat2D out = new_Mat2D(ROWS, ROWS);
-
-  for (int i = 0; i < 15; ++i) {
-    random_init_Mat2D(&m1, -100, 100);
-    random_init_Mat2D(&m2, -100, 100);
-    random_init_Mat2D(&out, -100, 100);
-
-    clock_gettime(CLOCK_REALTIME, &start);
-    mul_Mat2D(&m1, &m2, &out);
-    clock_gettime(CLOCK_REALTIME, &end);
-    t += (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/(double)1e9;
-  }
-
-  printf("mean exec time: %f\n", t / 15.0);
-  destroy_Mat2D(&m1);
-  destroy_Mat2D(&m2);
-  destroy_Mat2D(&out);
-}
-
-void vec_mul_performance() {
-  struct timespec start, end;
-  const size_t ROWS = 2500;
-  const size_t COLS = 3000;
-  double t_vec_mat = 0.0, t_mat_mat = 0.0, t_mat_vec = 0.0;
-
-  Mat2D m1 = new_Mat2D(1, COLS);
-  Mat2D m2 = new_Mat2D(COLS, ROWS);
-  Mat2D out = new_Mat2D(1, ROWS);
-
-  Mat2D mat = new_Mat2D(ROWS, COLS);
-  Mat2D col = new_Mat2D(COLS, 1);
-  Mat2D out1 = new_Mat2D(ROWS, 1);
-
-  for (int i = 0; i < 15; ++i) {
-    random_init_Mat2D(&m1, -100, 100);
-    random_init_Mat2D(&m2, -100, 100);
-    random_init_Mat2D(&out, -100, 100);
-    random_init_Mat2D(&mat, -100, 100);
-    random_init_Mat2D(&col, -100, 100);
-    random_init_Mat2D(&out1, -100, 100);
-
-    clock_gettime(CLOCK_REALTIME, &start);
-    vec_Mat2D_mul(&m1, &m2, &out);
-    clock_gettime(CLOCK_REALTIME, &end);
-    t_vec_mat += (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/(double)1e9;
-
-    clock_gettime(CLOCK_REALTIME, &start);
-    Mat2D_col_mul(&mat, &col, &out1);
-    clock_gettime(CLOCK_REALTIME, &end);
-    t_mat_vec += (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/(double)1e9;
-
-    clock_gettime(CLOCK_REALTIME, &start);
-    mul_Mat2D(&m1, &m2, &out);
-    clock_gettime(CLOCK_REALTIME, &end);
-    t_mat_mat += (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/(double)1e9;
-  }
-
-  printf("mean vec_mat exec time: %f\n", t_vec_mat / 15.0);
-  printf("mean mat_vec exec time: %f\n", t_mat_vec / 15.0);
-  printf("mean mat_mat exec time: %f\n", t_mat_mat / 15.0);
-
-  destroy_Mat2D(&m1);
-  destroy_Mat2D(&m2);
-  destroy_Mat2D(&out);
-  destroy_Mat2D(&mat);
-  destroy_Mat2D(&col);
-  destroy_Mat2D(&out1);
-}
-
 void conv_0padding_1stride_test() {
   double i1[] = {
     1.2, 1.5, 2.1, 0.0, 0.0,
@@ -262,7 +189,7 @@ void max_pooling_test() {
     .elems = out,
   };
 
-  max_pooling2D(&input, &output, 2);
+  max_pooling2D(&input, &output, 2, 2);
 
   print_Mat2D(&output, "\n");
 
@@ -292,7 +219,7 @@ void avg_pooling_test() {
     .elems = out,
   };
 
-  avg_pooling2D(&input, &output, 2);
+  avg_pooling2D(&input, &output, 2, 2);
 
   print_Mat2D(&output, "\n");
 
@@ -300,6 +227,433 @@ void avg_pooling_test() {
   assert(out[2] == 0.0); assert(out[3] == 1.0);
 }
 
+void overlapping_pooling_test() {
+  double i1[] = {
+    1.2, 1.5, 2.1, 0.0, 0.0,
+    0.0, 1.0, 1.0, 1.0, 0.0,
+    0.0, 0.0, 1.0, 1.0, 1.0,
+    0.0, 0.0, 1.0, 1.0, 0.0,
+    0.0, 1.0, 1.0, 0.0, 0.0,
+  };
+
+  Mat2D input = {
+    .cols = 5,
+    .rows = 5,
+    .elems = i1,
+  };
+
+  // 3x3 windows two apart share their middle row and column
+  double out[4];
+  Mat2D output = {
+    .cols = 2,
+    .rows = 2,
+    .elems = out,
+  };
+
+  max_pooling2D(&input, &output, 3, 2);
+  assert(out[0] == 2.1); assert(out[1] == 2.1);
+  assert(out[2] == 1.0); assert(out[3] == 1.0);
+
+  avg_pooling2D(&input, &output, 3, 2);
+  assert(fabs(out[0] - 7.8 / 9) < 1e-12); assert(fabs(out[1] - 7.1 / 9) < 1e-12);
+  assert(fabs(out[2] - 4.0 / 9) < 1e-12); assert(fabs(out[3] - 6.0 / 9) < 1e-12);
+
+  // the shared pixels collect the gradient of every window they are in
+  double g[4] = { 1.0, 1.0, 1.0, 1.0 }, gi[25] = { 0 };
+  Mat2D grad_out = { .cols = 2, .rows = 2, .elems = g };
+  Mat2D grad_input = { .cols = 5, .rows = 5, .elems = gi };
+  max_pooling2D_backward(&input, &grad_out, 3, 2, &grad_input);
+  assert(gi[2] == 2.0 && gi[12] == 2.0 && gi[0] == 0.0);
+
+  memset(gi, 0, sizeof(gi));
+  avg_pooling2D_backward(&grad_out, 3, 2, &grad_input);
+  assert(fabs(gi[12] - 4.0 / 9) < 1e-12 && fabs(gi[2] - 2.0 / 9) < 1e-12 && fabs(gi[0] - 1.0 / 9) < 1e-12);
+}
+
+void qmat_mul_test() {
+  const size_t ROWS = 5;
+  const size_t COLS = 67; // exercises the SIMD body and the scalar tail
+
+  Mat2D m = new_Mat2D(ROWS, COLS);
+  for (size_t i = 0; i < ROWS; ++i) {
+    for (size_t j = 0; j < COLS; ++j) {
+      MAT2D_GET(m, i, j) = (double) ((int) ((i * 31 + j * 17) % 255) - 127);
+    }
+    MAT2D_GET(m, i, 0) = 127.0; // scale of every row is exactly 1
+  }
+
+  QMat2D q = new_QMat2D(ROWS, COLS);
+  quantize_rows_Mat2D(&m, &q);
+
+  int8_t vec[COLS];
+  for (size_t j = 0; j < COLS; ++j) {
+    vec[j] = (int8_t) ((int) (j * 7 % 255) - 127);
+  }
+
+  Mat2D out = new_Mat2D(ROWS, 1);
+  QMat2D_col_mul(&q, vec, 1.0f, &out);
+
+  for (size_t i = 0; i < ROWS; ++i) {
+    assert(q.scales[i] == 1.0f);
+    long expected = 0;
+    for (size_t j = 0; j < COLS; ++j) {
+      expected += (long) MAT2D_GET(m, i, j) * vec[j];
+    }
+    assert(out.elems[i] == (double) expected);
+  }
+
+  Mat2D gemm = new_Mat2D(ROWS, ROWS);
+  QMat2D_mul_T(&q, &q, &gemm);
+  for (size_t i = 0; i < ROWS; ++i) {
+    for (size_t j = 0; j < ROWS; ++j) {
+      long expected = 0;
+      for (size_t k = 0; k < COLS; ++k) {
+        expected += (long) MAT2D_GET(m, i, k) * MAT2D_GET(m, j, k);
+      }
+      assert(MAT2D_GET(gemm, i, j) == (double) expected);
+    }
+  }
+
+  destroy_Mat2D(&m);
+  destroy_Mat2D(&out);
+  destroy_Mat2D(&gemm);
+  destroy_QMat2D(&q);
+}
+
+void optimizer_step_test() {
+  double w[] = { 1.0, -2.0, 0.5 };
+  double g[] = { 0.2, -0.4, 0.0 };
+  double v[] = { 0.0, 0.0, 0.0 };
+
+  // two momentum steps with half the gradient each time
+  momentum_step(w, g, v, 3, 0.1, 0.5, 0.9, 0);
+  momentum_step(w, g, v, 3, 0.1, 0.5, 0.9, 0);
+  assert(fabs(v[0] - 0.19) <= 1e-12 && fabs(v[1] + 0.38) <= 1e-12 && v[2] == 0.0);
+  assert(fabs(w[0] - (1.0 - 0.1 * (0.1 + 0.19))) <= 1e-12);
+  assert(fabs(w[1] - (-2.0 + 0.1 * (0.2 + 0.38))) <= 1e-12);
+  assert(w[2] == 0.5);
+
+  // the first bias corrected adam step is lr * g / (|g| + eps)
+  double a[] = { 1.0, -2.0, 0.5 };
+  double m[] = { 0.0, 0.0, 0.0 };
+  double s[] = { 0.0, 0.0, 0.0 };
+  adam_step(a, g, m, s, 3, 0.01, 1.0, 0.9, 0.999, 1e-8, 1);
+  assert(fabs(a[0] - (1.0 - 0.01 * 0.2 / (0.2 + 1e-8))) <= 1e-12);
+  assert(fabs(a[1] - (-2.0 + 0.01 * 0.4 / (0.4 + 1e-8))) <= 1e-12);
+  assert(a[2] == 0.5);
+}
+
+void csr_mul_test() {
+  srandom(7);
+  Mat2D m = new_Mat2D(9, 13);
+  random_init_Mat2D(&m, -1.0, 1.0);
+  assert(prune_Mat2D(&m, 0.75) >= 87);
+  for (size_t j = 0; j < m.cols; ++j) MAT2D_GET(m, 4, j) = 0.0; // an empty row
+
+  CSRMat2D s = new_CSRMat2D(&m);
+  assert(s.row_ptr[4] == s.row_ptr[5]);
+  assert(s.nnz == s.row_ptr[s.rows]);
+
+  Mat2D x = new_Mat2D(13, 3);
+  random_init_Mat2D(&x, -1.0, 1.0);
+  Mat2D dense = new_Mat2D(9, 3);
+  Mat2D sparse = new_Mat2D(9, 3);
+  mul_Mat2D(&m, &x, &dense);
+  CSRMat2D_mul(&s, &x, &sparse);
+  for (size_t i = 0; i < 9 * 3; ++i) {
+    assert(fabs(dense.elems[i] - sparse.elems[i]) <= 1e-12);
+  }
+
+  // a single column takes the spmv path
+  Mat2D vec = { .rows = 13, .cols = 1, .elems = x.elems };
+  Mat2D dense_vec = new_Mat2D(9, 1);
+  Mat2D sparse_vec = new_Mat2D(9, 1);
+  Mat2D_col_mul(&m, &vec, &dense_vec);
+  CSRMat2D_mul(&s, &vec, &sparse_vec);
+  for (size_t i = 0; i < 9; ++i) {
+    assert(fabs(dense_vec.elems[i] - sparse_vec.elems[i]) <= 1e-12);
+  }
+
+  destroy_CSRMat2D(&s);
+  destroy_Mat2D(&m);
+  destroy_Mat2D(&x);
+  destroy_Mat2D(&dense);
+  destroy_Mat2D(&sparse);
+  destroy_Mat2D(&dense_vec);
+  destroy_Mat2D(&sparse_vec);
+}
+
+void half_test() {
+  assert(to_half(1.0, HALF_FP16) == 0x3c00 && to_half(1.0, HALF_BF16) == 0x3f80);
+  assert(to_half(-2.0, HALF_FP16) == 0xc000 && to_half(-2.0, HALF_BF16) == 0xc000);
+  assert(to_half(65504.0, HALF_FP16) == 0x7bff && to_half(65520.0, HALF_FP16) == 0x7c00);
+  assert(to_half(0x1p-24, HALF_FP16) == 0x0001 && to_half(0x1p-25, HALF_FP16) == 0x0000);
+  // ties round to even
+  assert(to_half(1.0 + 0x1p-11, HALF_FP16) == 0x3c00 && to_half(1.0 + 3 * 0x1p-11, HALF_FP16) == 0x3c02);
+  assert(to_half(1.0 + 0x1p-8, HALF_BF16) == 0x3f80 && to_half(1.0 + 3 * 0x1p-8, HALF_BF16) == 0x3f82);
+  assert(from_half(0x3555, HALF_FP16) == 0x1.554p-2f && from_half(0x0001, HALF_FP16) == 0x1p-24f);
+  assert(from_half(0x3e80, HALF_BF16) == 0.25f);
+
+  srandom(3);
+  const size_t ROWS = 7, COLS = 37; // exercises the SIMD body and the scalar tail
+  Mat2D m = new_Mat2D(ROWS, COLS);
+  Mat2D vec = new_Mat2D(COLS, 1);
+  Mat2D expected = new_Mat2D(ROWS, 1);
+  Mat2D out = new_Mat2D(ROWS, 1);
+  random_init_Mat2D(&m, -1.0, 1.0);
+  random_init_Mat2D(&vec, -1.0, 1.0);
+  Mat2D_col_mul(&m, &vec, &expected);
+
+  const enum half_format formats[] = { HALF_FP16, HALF_BF16 };
+  const double tolerance[] = { 1e-2, 5e-2 };
+  for (size_t f = 0; f < 2; ++f) {
+    HMat2D h = new_HMat2D(ROWS, COLS, formats[f]);
+    half_Mat2D(&m, &h);
+    HMat2D_col_mul(&h, &vec, &out);
+
+    for (size_t i = 0; i < ROWS; ++i) {
+      // the same sum over the rounded weights
+      double sum = 0.0;
+      for (size_t j = 0; j < COLS; ++j) {
+        sum += from_half(h.elems[i * COLS + j], formats[f]) * (float) vec.elems[j];
+      }
+      assert(fabs(out.elems[i] - sum) <= 1e-5);
+      assert(fabs(out.elems[i] - expected.elems[i]) <= tolerance[f]);
+    }
+    destroy_HMat2D(&h);
+  }
+
+  destroy_Mat2D(&m);
+  destroy_Mat2D(&vec);
+  destroy_Mat2D(&expected);
+  destroy_Mat2D(&out);
+}
+
+void aligned_alloc_test() {
+  const size_t sizes[] = { 1, 3, 100, 1000, MEM_HUGE_PAGE / sizeof(double) + 5 };
+  const enum mem_huge_pages modes[] = { MEM_HUGE_TRANSPARENT, MEM_HUGE_EXPLICIT, MEM_HUGE_OFF };
+  const mem_stats_t before = mem_stats();
+
+  for (size_t m = 0; m < 3; ++m) {
+    mem_set_huge_pages(modes[m]);
+    for (size_t s = 0; s < 5; ++s) {
+      Mat2D a = new_Mat2D(sizes[s], 1);
+      assert((uintptr_t) a.elems % MEM_ALIGN == 0);
+      for (size_t i = 0; i < a.rows; ++i) a.elems[i] = i;
+
+      // large blocks get their own mapping unless huge pages are off
+      const mem_stats_t s1 = mem_stats();
+      if (a.rows > MEM_HUGE_PAGE / sizeof(double)) assert((s1.mapped > before.mapped) == (modes[m] != MEM_HUGE_OFF));
+
+      a.elems = mem_realloc(a.elems, sizeof(double) * (a.rows + 7));
+      assert((uintptr_t) a.elems % MEM_ALIGN == 0);
+      for (size_t i = 0; i < a.rows; ++i) assert(a.elems[i] == i);
+      destroy_Mat2D(&a);
+    }
+  }
+
+  double *z = mem_calloc(MEM_HUGE_PAGE, 2, MEM_SCRATCH);
+  assert(z != NULL && (uintptr_t) z % MEM_ALIGN == 0);
+  for (size_t i = 0; i < MEM_HUGE_PAGE * 2 / sizeof(double); i += 511) assert(z[i] == 0.0);
+  mem_free(z);
+
+  const mem_stats_t after = mem_stats();
+  assert(after.mapped == before.mapped && after.hugetlb == before.hugetlb);
+  assert(after.live[MEM_OTHER] == before.live[MEM_OTHER] && after.live[MEM_SCRATCH] == before.live[MEM_SCRATCH]);
+}
+
+void depthwise_conv_test() {
+  srandom(3);
+  Mat2D input = new_Mat2D(7, 6);
+  Mat2D kernel = new_Mat2D(3, 3);
+  random_init_Mat2D(&input, -1, 1);
+  random_init_Mat2D(&kernel, -1, 1);
+
+  // the clipped windows match the bounds checked convolution
+  const int params[][2] = { { 1, 0 }, { 1, 1 }, { 2, 1 }, { 2, 2 }, { 3, 2 } };
+  for (size_t t = 0; t < 5; ++t) {
+    const int stride = params[t][0], padding = params[t][1];
+    Mat2D ref = new_Mat2D((7 - 3 + 2 * padding) / stride + 1, (6 - 3 + 2 * padding) / stride + 1);
+    Mat2D out = new_Mat2D(ref.rows, ref.cols);
+
+    convolution2D(&input, &kernel, stride, padding, &ref);
+    depthwise_conv2D(&input, kernel.elems, 3, stride, padding, &out);
+    for (size_t i = 0; i < out.rows * out.cols; ++i) {
+      assert(fabs(out.elems[i] - ref.elems[i]) <= 1e-12);
+    }
+
+    destroy_Mat2D(&ref);
+    destroy_Mat2D(&out);
+  }
+
+  // two planes of 4 pixels mixed into three
+  double x[] = { 1, 2, 3, 4, -1, 0, 1, 2 };
+  double w[] = { 1, 0, 0.5, 2, -1, 1 };
+  double bias[] = { 0, 1, -1 };
+  double o[12];
+  Mat2D in = { .cols = 4, .rows = 2, .elems = x };
+  Mat2D weights = { .cols = 2, .rows = 3, .elems = w };
+  Mat2D planes[3];
+  for (size_t k = 0; k < 3; ++k) planes[k] = (Mat2D) { .cols = 2, .rows = 2, .elems = &o[k * 4] };
+
+  pointwise_conv2D(&weights, &in, bias, planes);
+  const double expected[] = { 1, 2, 3, 4, -0.5, 2, 4.5, 7, -3, -3, -3, -3 };
+  for (size_t i = 0; i < 12; ++i) {
+    assert(fabs(o[i] - expected[i]) <= 1e-12);
+  }
+
+  destroy_Mat2D(&input);
+  destroy_Mat2D(&kernel);
+}
+
+void sparse_input_mul_test() {
+  srandom(3);
+  Mat2D ws = new_Mat2D(150, 70), ws_t = new_Mat2D(70, 150);
+  Mat2D x = new_Mat2D(150, 1), dense = new_Mat2D(70, 1), gathered = new_Mat2D(70, 1), tiled = new_Mat2D(70, 1);
+  random_init_Mat2D(&ws, -1.0, 1.0);
+  random_init_Mat2D(&x, -1.0, 1.0);
+  for (size_t i = 0; i < x.rows; ++i) {
+    if (i % 5) x.elems[i] = 0.0;
+  }
+  for (size_t i = 0; i < ws.rows; ++i) {
+    for (size_t j = 0; j < ws.cols; ++j) MAT2D_GET(ws_t, j, i) = MAT2D_GET(ws, i, j);
+  }
+
+  size_t idx[150];
+  assert(nonzero_rows(&x, idx) == 30);
+  for (size_t k = 0; k < 30; ++k) assert(idx[k] == 5 * k);
+
+  // skipping the zero inputs leaves the sums unchanged
+  Mat2D_col_mul(&ws_t, &x, &dense);
+  Mat2D_T_gather_col_mul(&ws, &x, idx, 30, &gathered);
+  Mat2D_T_col_mul(&ws, &x, 16, &tiled);
+  assert(memcmp(dense.elems, gathered.elems, sizeof(double) * 70) == 0);
+  assert(memcmp(dense.elems, tiled.elems, sizeof(double) * 70) == 0);
+
+  destroy_Mat2D(&ws);
+  destroy_Mat2D(&ws_t);
+  destroy_Mat2D(&x);
+  destroy_Mat2D(&dense);
+  destroy_Mat2D(&gathered);
+  destroy_Mat2D(&tiled);
+}
+
+void rng_test() {
+  // known answers of philox4x32-10 from Random123
+  uint32_t out[4];
+  philox4x32((uint32_t[4]) { 0 }, (uint32_t[2]) { 0 }, out);
+  assert(out[0] == 0x6627e8d5 && out[1] == 0xe169c58d && out[2] == 0xbc57ac4c && out[3] == 0x9b00dbd8);
+  philox4x32((uint32_t[4]) { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 }, (uint32_t[2]) { 0xa4093822, 0x299f31d0 }, out);
+  assert(out[0] == 0xd16cfe09 && out[1] == 0x94fdcceb && out[2] == 0x5001e420 && out[3] == 0x24126ea1);
+
+  // the same numbers for any thread count and any split of the range
+  const rng_t r = { .seed = 42, .stream = 3 };
+  const size_t n = 10000;
+  double *a = malloc(sizeof(double) * n), *b = malloc(sizeof(double) * n);
+  const int threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  rng_fill(r, 0, a, n, -1.0, 1.0);
+  omp_set_num_threads(4);
+  rng_fill(r, 0, b, 700, -1.0, 1.0);
+  rng_fill(r, 700, &b[700], n - 700, -1.0, 1.0);
+  omp_set_num_threads(threads);
+  assert(memcmp(a, b, sizeof(double) * n) == 0);
+
+  double mean = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    assert(a[i] >= -1.0 && a[i] < 1.0);
+    mean += a[i] / n;
+  }
+  assert(fabs(mean) < 0.05);
+  // another stream is another sequence
+  rng_fill((rng_t) { .seed = 42, .stream = 4 }, 0, b, n, -1.0, 1.0);
+  assert(memcmp(a, b, sizeof(double) * n) != 0);
+
+  size_t idx[100], seen[100] = { 0 };
+  for (size_t i = 0; i < 100; ++i) idx[i] = i;
+  rng_shuffle(r, idx, 100);
+  for (size_t i = 0; i < 100; ++i) seen[idx[i]]++;
+  for (size_t i = 0; i < 100; ++i) assert(seen[i] == 1);
+
+  free(a);
+  free(b);
+}
+
+void strided_view_test() {
+  double x[2 * 3 * 4];
+  for (size_t i = 0; i < 24; ++i) x[i] = i;
+  const mat_t m = mat_view(x, 3, (size_t[]) { 2, 3, 4 });
+  assert(mat_size(&m) == 24 && mat_is_contiguous(&m));
+  assert(*mat_at(&m, (size_t[]) { 1, 2, 3 }) == 23);
+
+  // a slice of the middle dimension has gaps, selecting then reshaping one plane does not
+  const mat_t cols = mat_slice(&m, 2, 1, 3);
+  assert(!mat_is_contiguous(&cols) && cols.dims[2] == 2 && *mat_at(&cols, (size_t[]) { 1, 0, 0 }) == 13);
+  const mat_t plane = mat_select(&m, 0, 1);
+  const mat_t flat = mat_reshape(&plane, 2, (size_t[]) { 12, 1 });
+  const Mat2D col = mat_to_Mat2D(&flat);
+  assert(col.rows == 12 && col.cols == 1 && col.elems == &x[12]);
+
+  // gathering the strided slice
+  double y[2 * 3 * 2];
+  const mat_t packed = mat_view(y, 3, cols.dims);
+  mat_copy(&cols, &packed);
+  for (size_t i = 0; i < 2; ++i) {
+    for (size_t j = 0; j < 3; ++j) {
+      assert(y[(i * 3 + j) * 2] == x[(i * 3 + j) * 4 + 1] && y[(i * 3 + j) * 2 + 1] == x[(i * 3 + j) * 4 + 2]);
+    }
+  }
+  // and a transposed view, stepping by a column
+  const mat_t t = { .dims = { 6, 4 }, .strides = { 1, 6 }, .dim_count = 2, .elems = x };
+  double z[24];
+  const mat_t zt = mat_view(z, 2, t.dims);
+  mat_copy(&t, &zt);
+  for (size_t i = 0; i < 6; ++i) {
+    for (size_t j = 0; j < 4; ++j) assert(z[i * 4 + j] == x[j * 6 + i]);
+  }
+
+  // planes one after the other are one view, scattered ones are not
+  Mat2D planes[3];
+  for (size_t c = 0; c < 3; ++c) planes[c] = (Mat2D) { .cols = 2, .rows = 2, .elems = &x[c * 4] };
+  mat_t v;
+  assert(mat_of_planes(planes, 3, &v) == 0 && mat_is_contiguous(&v) && v.dims[0] == 3);
+  planes[2].elems = &x[16];
+  assert(mat_of_planes(planes, 3, &v) == -1);
+  planes[1].elems = &x[8];
+  assert(mat_of_planes(planes, 3, &v) == 0 && !mat_is_contiguous(&v) && *mat_at(&v, (size_t[]) { 2, 1, 0 }) == 18);
+
+  // a 5 x 5 crop of a 6 x 8 plane goes into the conv and pooling kernels as it is, and they compute
+  // what they do on its packed copy
+  double img[48], crop[25], kernel[9];
+  for (size_t i = 0; i < 48; ++i) img[i] = sin(i * 0.7);
+  for (size_t i = 0; i < 9; ++i) kernel[i] = 0.1 * i - 0.4;
+  const mat_t whole = mat_view(img, 2, (size_t[]) { 6, 8 });
+  const mat_t rows = mat_slice(&whole, 0, 1, 6);
+  const mat_t window = mat_slice(&rows, 1, 2, 7);
+  const mat_t packed_crop = mat_view(crop, 2, window.dims);
+  assert(!mat_is_contiguous(&window));
+  mat_copy(&window, &packed_crop);
+  const Mat2D in = { .rows = 5, .cols = 5, .elems = crop }, k = { .rows = 3, .cols = 3, .elems = kernel };
+
+  Mat2D got = new_Mat2D(5, 5), want = new_Mat2D(5, 5);
+  mat_convolution2D(&window, &k, 1, 1, &got);
+  convolution2D(&in, &k, 1, 1, &want);
+  assert(memcmp(got.elems, want.elems, sizeof(double) * 25) == 0);
+  mat_depthwise_conv2D(&window, kernel, 3, 1, 1, &got);
+  depthwise_conv2D(&in, kernel, 3, 1, 1, &want);
+  assert(memcmp(got.elems, want.elems, sizeof(double) * 25) == 0);
+
+  got.rows = got.cols = want.rows = want.cols = 2;
+  mat_max_pooling2D(&window, &got, 2, 2);
+  max_pooling2D(&in, &want, 2, 2);
+  assert(memcmp(got.elems, want.elems, sizeof(double) * 4) == 0);
+  mat_avg_pooling2D(&window, &got, 3, 2);
+  avg_pooling2D(&in, &want, 3, 2);
+  assert(memcmp(got.elems, want.elems, sizeof(double) * 4) == 0);
+  destroy_Mat2D(&got);
+  destroy_Mat2D(&want);
+}
+
 int main(void) {
   test_t tests[] = {
     mul_test,
@@ -308,8 +662,18 @@ int main(void) {
     conv_2padding_1stride_test,
     max_pooling_test,
     avg_pooling_test,
+    overlapping_pooling_test,
+    qmat_mul_test,
+    optimizer_step_test,
+    csr_mul_test,
+    half_test,
+    aligned_alloc_test,
+    depthwise_conv_test,
+    sparse_input_mul_test,
+    rng_test,
+    strided_view_test,
   };
 
-  run_tests(tests, 6);
+  run_tests(tests, 16);
   return 0;
 }
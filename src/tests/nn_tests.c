@@ -1,9 +1,18 @@
 #include "cnn.h"
 #include "mat.h"
+#include "serve.h"
 #include "test_utils.h"
+#include "topology.h"
+#include <dlfcn.h>
 #include <math.h>
 #include <omp.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #define NN_OUTPUT(nn) nn.layers[nn.layer_count - 1].dl.a
 
@@ -270,8 +279,1569 @@ void conv_forward_test() {
   nn_destroy(&nn);
 }
 
+void fusion_test() {
+  srandom(7);
+  nn_t nn = new_nn(6, 6, 1);
+  nn_add_conv2d_layer(&nn, 2, 3, 1, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_flatten_layer(&nn);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  // conv output is never materialised and the pooled planes live in the flatten buffer
+  assert(nn.layers[2].fusion & FUSED && nn.layers[3].fusion & FUSED);
+  assert(nn.layers[1].cl.a[0].elems == NULL);
+  assert(nn.layers[2].pl.a[1].elems == &nn.layers[3].fl.a.elems[9]);
+
+  Mat2D input = new_Mat2D(6, 6);
+  random_init_Mat2D(&input, -1.0, 1.0);
+  nn_forward(&nn, &input, 1);
+
+  Mat2D conv = new_Mat2D(6, 6);
+  Mat2D pooled = new_Mat2D(3, 3);
+  for (size_t k = 0; k < 2; ++k) {
+    convolution2D(&input, &nn.layers[1].cl.kernels[k], 1, 1, &conv);
+    for (size_t i = 0; i < 36; ++i) {
+      conv.elems[i] = fmax(conv.elems[i] + nn.layers[1].cl.bias[k], 0.0);
+    }
+    max_pooling2D(&conv, &pooled, 2, 2);
+
+    for (size_t i = 0; i < 9; ++i) {
+      assert(fabs(nn_output(&nn)->elems[k * 9 + i] - pooled.elems[i]) <= 1e-12);
+    }
+  }
+
+  destroy_Mat2D(&conv);
+  destroy_Mat2D(&pooled);
+  destroy_Mat2D(&input);
+  nn_destroy(&nn);
+}
+
+void profile_test() {
+  nn_t nn = new_nn(8, 1, 1);
+  nn_add_dense_layer(&nn, 4, RELU);
+  nn_add_dense_layer(&nn, 2, SIGMOID);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+  assert(nn.prof == NULL);
+
+  nn_enable_profiling(&nn);
+
+  double i1[8] = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8 };
+  double y1[2] = { 0.0, 1.0 };
+  Mat2D input = { .cols = 1, .rows = 8, .elems = i1 };
+  Mat2D y = { .cols = 1, .rows = 2, .elems = y1 };
+
+  for (int i = 0; i < 3; ++i) {
+    nn_forward(&nn, &input, 1);
+  }
+  nn_t g = nn_backprop(&nn, &y);
+
+  const LayerProfile *fwd = nn_profile(&nn, 1, PHASE_FORWARD);
+  const LayerProfile *bwd = nn_profile(&nn, 2, PHASE_BACKWARD);
+  assert(fwd->calls == 3 && fwd->time > 0.0);
+  assert(fwd->flops == 2.0 * 8 * 4 + 2.0 * 4);
+  assert(bwd->calls == 1 && bwd->flops == 4.0 * 4 * 2 + 2.0 * 2);
+  nn_print_profile(&nn);
+
+  nn_reset_profile(&nn);
+  assert(nn_profile(&nn, 1, PHASE_FORWARD)->calls == 0);
+
+  nn_disable_profiling(&nn);
+  assert(nn.prof == NULL);
+
+  nn_destroy(&g);
+  nn_destroy(&nn);
+}
+
+void memory_test() {
+  mem_stats_t before = mem_stats();
+
+  nn_t nn = new_nn(8, 1, 1);
+  nn_add_dense_layer(&nn, 4, RELU);
+  nn_add_dense_layer(&nn, 2, SIGMOID);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  size_t footprint[MEM_KIND_COUNT];
+  nn_memory_footprint(&nn, footprint);
+  mem_stats_t compiled = mem_stats();
+
+  assert(footprint[MEM_WEIGHTS] == sizeof(double) * (8 * 4 + 4 * 2));
+  assert(footprint[MEM_ACTIVATIONS] == sizeof(double) * (4 + 2));
+  assert(compiled.live[MEM_WEIGHTS] - before.live[MEM_WEIGHTS] == footprint[MEM_WEIGHTS]);
+  assert(compiled.live[MEM_ACTIVATIONS] - before.live[MEM_ACTIVATIONS] == footprint[MEM_ACTIVATIONS]);
+
+  double i1[16] = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.8, 0.7, 0.6, 0.5, 0.4, 0.3, 0.2, 0.1 };
+  double y1[4] = { 0.0, 1.0, 1.0, 0.0 };
+  Mat2D data = { .cols = 8, .rows = 2, .elems = i1 };
+  Mat2D labels = { .cols = 2, .rows = 2, .elems = y1 };
+
+  mem_reset_peaks();
+  nn_fit(&nn, &data, &labels, 1, 0.1);
+  mem_stats_t trained = mem_stats();
+  mem_print_stats();
+
+  // gradients are freed after the step, the backward pass peaks with them alive
+  assert(trained.steps - before.steps == 2 && trained.last_step_allocs > 0);
+  assert(trained.live[MEM_GRADIENTS] == before.live[MEM_GRADIENTS]);
+  assert(trained.phase_peak[MEM_PHASE_BACKWARD] >= compiled.peak - before.peak + footprint[MEM_GRADIENTS] / 2);
+
+  nn_destroy(&nn);
+  mem_stats_t after = mem_stats();
+  for (size_t k = 0; k < MEM_KIND_COUNT; ++k) {
+    assert(after.live[k] == before.live[k]);
+  }
+}
+
+void evaluate_test() {
+  srandom(3);
+  nn_t nn = new_nn(4, 1, 1);
+  nn_add_dense_layer(&nn, 8, RELU);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  const size_t N = 50;
+  Mat2D data = new_Mat2D(N, 4);
+  Mat2D labels = new_Mat2D(N, 3);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < N; ++i) {
+    MAT2D_GET(labels, i, i % 3) = 1.0;
+  }
+
+  // reference: one sample at a time on the network itself
+  double loss = 0.0;
+  size_t correct = 0, confusion[9] = { 0 };
+  for (size_t i = 0; i < N; ++i) {
+    Mat2D x = { .cols = 1, .rows = 4, .elems = &data.elems[i * 4] };
+    nn_forward(&nn, &x, 1);
+    const double *o = nn_output(&nn)->elems;
+    size_t pred = 0;
+    for (size_t j = 1; j < 3; ++j) {
+      if (o[j] > o[pred]) pred = j;
+    }
+    loss -= log(o[i % 3]);
+    correct += pred == i % 3;
+    confusion[(i % 3) * 3 + pred]++;
+  }
+
+  omp_set_num_threads(4);
+  nn_metrics_t metrics;
+  nn_evaluate(&nn, &data, &labels, &metrics);
+  printf("loss %f accuracy %f\n", metrics.loss, metrics.accuracy);
+
+  assert(fabs(metrics.loss - loss / N) <= 1e-12);
+  assert(metrics.accuracy == (double) correct / N);
+  assert(metrics.classes == 3);
+  for (size_t i = 0; i < 9; ++i) {
+    assert(metrics.confusion[i] == confusion[i]);
+  }
+
+  // contexts share the weights and only own their activations
+  nn_t ctx = nn_new_context(&nn);
+  assert(ctx.layers[1].dl.ws.elems == nn.layers[1].dl.ws.elems);
+  assert(ctx.layers[1].dl.a.elems != nn.layers[1].dl.a.elems);
+  nn_destroy(&ctx);
+
+  nn_destroy_metrics(&metrics);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  nn_destroy(&nn);
+}
+
+void conv_context_test() {
+  srandom(5);
+  nn_t nn = new_nn(8, 8, 1);
+  nn_add_conv2d_layer(&nn, 3, 3, 1, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 4, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  Mat2D input = new_Mat2D(8, 8);
+  random_init_Mat2D(&input, 0.0, 1.0);
+
+  nn_t ctx = nn_new_context(&nn);
+  nn_forward(&nn, &input, 1);
+  nn_forward(&ctx, &input, 1);
+
+  assert(ctx.layers[3].fl.a.elems != nn.layers[3].fl.a.elems);
+  assert(ctx.layers[2].pl.a[0].elems == ctx.layers[3].fl.a.elems);
+  for (size_t i = 0; i < 4; ++i) {
+    assert(nn_output(&ctx)->elems[i] == nn_output(&nn)->elems[i]);
+  }
+
+  nn_destroy(&ctx);
+  destroy_Mat2D(&input);
+  nn_destroy(&nn);
+}
+
+void quantize_test() {
+  srandom(42);
+  nn_t nn = new_nn(16, 1, 1);
+  nn_add_dense_layer(&nn, 32, RELU);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  Mat2D samples = new_Mat2D(32, 16);
+  random_init_Mat2D(&samples, 0.0, 1.0);
+
+  double err = nn_quantize(&nn, &samples);
+  printf("dense int8 max abs error: %f\n", err);
+  assert(nn.layers[1].dl.q != NULL && nn.layers[2].dl.q != NULL);
+  assert(err < 0.02);
+
+  nn_dequantize(&nn);
+  assert(nn.layers[1].dl.q == NULL && nn.layers[2].dl.q == NULL);
+
+  destroy_Mat2D(&samples);
+  nn_destroy(&nn);
+}
+
+void conv_quantize_test() {
+  srandom(42);
+  nn_t nn = new_nn(12, 12, 2);
+  nn_add_conv2d_layer(&nn, 4, 3, 2, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_conv2d_layer(&nn, 3, 3, 4, 0, 1, RELU);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  Mat2D samples = new_Mat2D(8, 12 * 12 * 2);
+  random_init_Mat2D(&samples, 0.0, 1.0);
+
+  double err = nn_quantize(&nn, &samples);
+  printf("conv int8 max abs error: %f\n", err);
+  assert(nn.layers[1].cl.q != NULL && nn.layers[3].cl.q != NULL);
+  assert(err < 0.02);
+
+  destroy_Mat2D(&samples);
+  nn_destroy(&nn);
+}
+
+static nn_t optimizer_test_nn(Optimizer opt) {
+  nn_t nn = new_nn(2, 1, 1);
+  nn_add_dense_layer(&nn, 2, SIGMOID);
+  nn_add_dense_layer(&nn, 2, SIGMOID);
+  nn_set_optimizer(&nn, opt);
+  nn_compile(&nn);
+
+  nn.layers[1].dl.bias = .35;
+  nn.layers[2].dl.bias = .6;
+
+  double ws[] = { .15, .25, .2, .3, .4, .5, .45, .55 };
+  memcpy(nn.layers[1].dl.ws.elems, ws, sizeof(double) * 4);
+  memcpy(nn.layers[2].dl.ws.elems, ws + 4, sizeof(double) * 4);
+  return nn;
+}
+
+void optimizer_test() {
+  double i1[] = { .05, .1 };
+  Mat2D input = (Mat2D) { .rows = 1, .cols = 2, .elems = i1 };
+  double labels[] = { .01, .99 };
+  Mat2D y = (Mat2D) { .rows = 1, .cols = 2, .elems = labels };
+
+  nn_t sgd = optimizer_test_nn(nn_optimizer(SGD));
+  nn_t momentum = optimizer_test_nn(nn_optimizer(MOMENTUM));
+  nn_t adam = optimizer_test_nn(nn_optimizer(ADAM));
+  assert(sgd.layers[1].dl.m.elems == NULL);
+  assert(momentum.layers[1].dl.m.elems != NULL && momentum.layers[1].dl.v.elems == NULL);
+  assert(adam.layers[2].dl.m.elems != NULL && adam.layers[2].dl.v.elems != NULL);
+
+  const double lr = 0.5;
+  nn_fit(&sgd, &input, &y, 1, lr);
+  nn_fit(&momentum, &input, &y, 1, lr);
+  nn_fit(&adam, &input, &y, 1, lr);
+  assert(adam.opt.t == 1);
+
+  // the first momentum step is plain sgd and the first adam step moves every weight by lr
+  const double w0[] = { .15, .25, .2, .3, .4, .5, .45, .55 };
+  for (size_t l = 1; l <= 2; ++l) {
+    for (size_t i = 0; i < 4; ++i) {
+      double ws = sgd.layers[l].dl.ws.elems[i];
+      double before = w0[(l - 1) * 4 + i];
+      assert(fabs(momentum.layers[l].dl.ws.elems[i] - ws) <= 1e-12);
+      assert(fabs(adam.layers[l].dl.ws.elems[i] - (before - (ws < before ? lr : -lr))) <= 1e-4);
+    }
+  }
+
+  // switching drops the momentum, the first adam step after it moves every weight by lr again
+  nn_set_optimizer(&momentum, nn_optimizer(ADAM));
+  assert(momentum.layers[1].dl.v.elems != NULL && momentum.layers[1].dl.m.elems[0] == 0.0);
+  double trained[8];
+  for (size_t l = 1; l <= 2; ++l) memcpy(&trained[(l - 1) * 4], momentum.layers[l].dl.ws.elems, sizeof(double) * 4);
+  nn_fit(&momentum, &input, &y, 1, lr);
+  for (size_t l = 1; l <= 2; ++l) {
+    for (size_t i = 0; i < 4; ++i) {
+      assert(fabs(fabs(momentum.layers[l].dl.ws.elems[i] - trained[(l - 1) * 4 + i]) - lr) <= 1e-4);
+    }
+  }
+
+  nn_destroy(&sgd);
+  nn_destroy(&momentum);
+  nn_destroy(&adam);
+}
+
+void prune_test() {
+  srandom(42);
+  nn_t nn = new_nn(64, 1, 1);
+  nn_add_dense_layer(&nn, 32, RELU);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  Mat2D x = new_Mat2D(64, 1);
+  random_init_Mat2D(&x, 0.0, 1.0);
+
+  // 90% leaves the layers sparse enough for CSR, 10% does not
+  assert(nn_prune(&nn, 0.1) >= (64 * 32 + 32 * 10) / 10);
+  assert(nn.layers[1].dl.sparse == NULL);
+  size_t zeros = nn_prune(&nn, 0.9);
+  assert(zeros >= (64 * 32 + 32 * 10) * 9 / 10 && zeros <= (64 * 32 + 32 * 10) * 9 / 10 + 2);
+  assert(nn.layers[1].dl.sparse != NULL && nn.layers[2].dl.sparse != NULL);
+  assert(nn.layers[1].dl.sparse->nnz == 64 * 32 - 64 * 32 * 9 / 10);
+
+  nn_forward(&nn, &x, 1);
+  double sparse_out[10];
+  memcpy(sparse_out, nn_output(&nn)->elems, sizeof(sparse_out));
+
+  CSRMat2D *s1 = nn.layers[1].dl.sparse, *s2 = nn.layers[2].dl.sparse;
+  nn.layers[1].dl.sparse = nn.layers[2].dl.sparse = NULL;
+  nn_forward(&nn, &x, 1);
+  for (size_t i = 0; i < 10; ++i) {
+    assert(fabs(nn_output(&nn)->elems[i] - sparse_out[i]) <= 1e-12);
+  }
+  nn.layers[1].dl.sparse = s1;
+  nn.layers[2].dl.sparse = s2;
+
+  // pruned weights stay 0 and the CSR values follow the update
+  Mat2D input = { .rows = 1, .cols = 64, .elems = x.elems };
+  double label[10] = { [3] = 1.0 };
+  Mat2D y = { .rows = 1, .cols = 10, .elems = label };
+  nn_fit(&nn, &input, &y, 1, 0.1);
+
+  size_t after = 0;
+  for (size_t l = 1; l <= 2; ++l) {
+    const Mat2D *ws = &nn.layers[l].dl.ws;
+    for (size_t i = 0; i < ws->rows * ws->cols; ++i) after += ws->elems[i] == 0.0;
+  }
+  assert(after >= zeros);
+
+  nn_forward(&nn, &x, 1);
+  memcpy(sparse_out, nn_output(&nn)->elems, sizeof(sparse_out));
+  nn.layers[1].dl.sparse = nn.layers[2].dl.sparse = NULL;
+  nn_forward(&nn, &x, 1);
+  for (size_t i = 0; i < 10; ++i) {
+    assert(fabs(nn_output(&nn)->elems[i] - sparse_out[i]) <= 1e-12);
+  }
+  nn.layers[1].dl.sparse = s1;
+  nn.layers[2].dl.sparse = s2;
+  nn_destroy(&nn);
+
+  // a layer left dense keeps its pruned weights at 0 through the mask
+  nn = new_nn(64, 1, 1);
+  nn_add_dense_layer(&nn, 32, RELU);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(MOMENTUM));
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+  zeros = nn_prune(&nn, 0.2);
+  assert(nn.layers[1].dl.sparse == NULL && nn.layers[1].dl.mask != NULL);
+  for (size_t step = 0; step < 5; ++step) nn_fit(&nn, &input, &y, 1, 0.1);
+
+  after = 0;
+  for (size_t l = 1; l <= 2; ++l) {
+    const DenseLayer *dl = &nn.layers[l].dl;
+    for (size_t i = 0; i < dl->ws.rows * dl->ws.cols; ++i) {
+      assert(dl->mask[i] || dl->ws.elems[i] == 0.0);
+      after += dl->ws.elems[i] == 0.0;
+    }
+  }
+  assert(after >= zeros);
+
+  // pruning nothing drops the mask, the zeroed weights train again
+  assert(nn_prune(&nn, 0.0) == 0);
+  assert(nn.layers[1].dl.mask == NULL && nn.layers[2].dl.mask == NULL);
+  for (size_t step = 0; step < 5; ++step) nn_fit(&nn, &input, &y, 1, 0.1);
+  size_t retrained = 0;
+  for (size_t l = 1; l <= 2; ++l) {
+    const DenseLayer *dl = &nn.layers[l].dl;
+    for (size_t i = 0; i < dl->ws.rows * dl->ws.cols; ++i) retrained += dl->ws.elems[i] == 0.0;
+  }
+  assert(retrained < after);
+
+  destroy_Mat2D(&x);
+  nn_destroy(&nn);
+}
+
+void half_weights_test() {
+  srandom(42);
+  nn_t nn = new_nn(12, 12, 2);
+  nn_add_conv2d_layer(&nn, 4, 3, 2, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_conv2d_layer(&nn, 3, 3, 4, 0, 1, RELU);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  Mat2D x[2] = { new_Mat2D(12, 12), new_Mat2D(12, 12) };
+  random_init_Mat2D(&x[0], 0.0, 1.0);
+  random_init_Mat2D(&x[1], 0.0, 1.0);
+
+  size_t full[MEM_KIND_COUNT], half[MEM_KIND_COUNT];
+  nn_memory_footprint(&nn, full);
+
+  nn_forward(&nn, x, 2);
+  double fp_out[10];
+  memcpy(fp_out, nn_output(&nn)->elems, sizeof(fp_out));
+
+  const enum half_format formats[] = { HALF_FP16, HALF_BF16 };
+  for (size_t f = 0; f < 2; ++f) {
+    nn_half_weights(&nn, formats[f]);
+    assert(nn.layers[1].cl.h != NULL && nn.layers[3].cl.h != NULL && nn.layers[5].dl.h != NULL);
+
+    nn_memory_footprint(&nn, half);
+    assert(half[MEM_WEIGHTS] - full[MEM_WEIGHTS] < full[MEM_WEIGHTS] / 4 + 64);
+
+    nn_forward(&nn, x, 2);
+    for (size_t i = 0; i < 10; ++i) {
+      assert(fabs(nn_output(&nn)->elems[i] - fp_out[i]) <= 1e-2);
+    }
+  }
+
+  nn_full_weights(&nn);
+  assert(nn.layers[1].cl.h == NULL && nn.layers[5].dl.h == NULL);
+  nn_forward(&nn, x, 2);
+  assert(memcmp(fp_out, nn_output(&nn)->elems, sizeof(fp_out)) == 0);
+
+  destroy_Mat2D(&x[0]);
+  destroy_Mat2D(&x[1]);
+  nn_destroy(&nn);
+}
+
+static nn_t checkpoint_test_nn(void) {
+  srandom(42);
+  nn_t nn = new_nn(16, 1, 1);
+  for (size_t l = 0; l < 7; ++l) {
+    nn_add_dense_layer(&nn, 32, l % 2 ? TANH : RELU);
+  }
+  nn_add_dense_layer(&nn, 4, SIGMOID);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+  return nn;
+}
+
+void checkpoint_test() {
+  nn_t full = checkpoint_test_nn();
+  nn_t ckpt = checkpoint_test_nn();
+  const size_t all = sizeof(double) * (7 * 32 + 4);
+
+  mem_stats_t before = mem_stats();
+  assert(nn_set_activation_budget(&ckpt, 0) == all);
+  // k = 2 keeps 100 of the 228 outputs and the largest segment is 32 more
+  size_t used = nn_set_activation_budget(&ckpt, all * 3 / 5);
+  mem_stats_t planned = mem_stats();
+  assert(used == sizeof(double) * 132);
+  assert(before.live[MEM_ACTIVATIONS] - planned.live[MEM_ACTIVATIONS] == all - used);
+
+  size_t footprint[MEM_KIND_COUNT];
+  nn_memory_footprint(&ckpt, footprint);
+  assert(footprint[MEM_ACTIVATIONS] == used);
+
+  size_t recomputed = 0;
+  for (size_t l = 1; l < ckpt.layer_count; ++l) {
+    recomputed += (ckpt.layers[l].fusion & RECOMPUTED) != 0;
+  }
+  assert(recomputed > 0 && !(ckpt.layers[ckpt.layer_count - 1].fusion & RECOMPUTED));
+
+  Mat2D data = new_Mat2D(6, 16);
+  Mat2D labels = new_Mat2D(6, 4);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  random_init_Mat2D(&labels, 0.0, 1.0);
+
+  // the recomputed activations are bit for bit the ones that were dropped
+  Mat2D x = { .rows = 16, .cols = 1, .elems = data.elems };
+  Mat2D y = { .rows = 4, .cols = 1, .elems = labels.elems };
+  nn_forward(&full, &x, 1);
+  nn_forward(&ckpt, &x, 1);
+  nn_t g_full = nn_backprop(&full, &y);
+  nn_t g_ckpt = nn_backprop(&ckpt, &y);
+  for (size_t l = 1; l < full.layer_count; ++l) {
+    const Mat2D *a = &g_full.layers[l].dl.ws, *b = &g_ckpt.layers[l].dl.ws;
+    assert(memcmp(a->elems, b->elems, sizeof(double) * a->rows * a->cols) == 0);
+    assert(g_full.layers[l].dl.bias == g_ckpt.layers[l].dl.bias);
+  }
+  nn_destroy(&g_full);
+  nn_destroy(&g_ckpt);
+
+  nn_fit(&full, &data, &labels, 2, 0.1);
+  nn_fit(&ckpt, &data, &labels, 2, 0.1);
+  for (size_t l = 1; l < full.layer_count; ++l) {
+    const Mat2D *a = &full.layers[l].dl.ws, *b = &ckpt.layers[l].dl.ws;
+    assert(memcmp(a->elems, b->elems, sizeof(double) * a->rows * a->cols) == 0);
+  }
+
+  // back to keeping everything
+  assert(nn_set_activation_budget(&ckpt, 0) == all);
+  assert(mem_stats().live[MEM_ACTIVATIONS] == before.live[MEM_ACTIVATIONS]);
+
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  nn_destroy(&full);
+  nn_destroy(&ckpt);
+}
+
+static nn_t inference_plan_test_nn(int plan) {
+  srandom(9);
+  nn_t nn = new_nn(12, 12, 2);
+  nn_add_conv2d_layer(&nn, 4, 3, 2, 1, 1, RELU);
+  nn_add_conv2d_layer(&nn, 4, 3, 4, 0, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_conv2d_layer(&nn, 3, 3, 4, 1, 1, RELU);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 16, RELU);
+  nn_add_dense_layer(&nn, 10, SOFTMAX);
+  if (plan) nn_compile_inference(&nn);
+  else nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+  return nn;
+}
+
+void inference_plan_test() {
+  mem_stats_t start = mem_stats();
+  nn_t nn = inference_plan_test_nn(0);
+  mem_stats_t before = mem_stats();
+  nn_t plan = inference_plan_test_nn(1);
+  mem_stats_t compiled = mem_stats();
+
+  // owners: conv 4x12x12, pool 4x5x5, flatten 3x5x5, dense 16, dense 10
+  size_t full[MEM_KIND_COUNT], planned[MEM_KIND_COUNT];
+  nn_memory_footprint(&nn, full);
+  nn_memory_footprint(&plan, planned);
+  assert(full[MEM_ACTIVATIONS] == sizeof(double) * (576 + 100 + 75 + 16 + 10));
+  assert(planned[MEM_ACTIVATIONS] == sizeof(double) * (576 + 100));
+  // the plane headers are the same in both
+  assert((before.live[MEM_ACTIVATIONS] - start.live[MEM_ACTIVATIONS]) - (compiled.live[MEM_ACTIVATIONS] - before.live[MEM_ACTIVATIONS])
+    == full[MEM_ACTIVATIONS] - planned[MEM_ACTIVATIONS]);
+  assert(plan.layers[4].cl.a[0].elems == plan.layers[5].fl.a.elems);
+
+  const size_t N = 8;
+  Mat2D data = new_Mat2D(N, 12 * 12 * 2);
+  Mat2D labels = new_Mat2D(N, 10);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < N; ++i) {
+    MAT2D_GET(labels, i, i % 10) = 1.0;
+    Mat2D x[2] = {
+      { .rows = 12, .cols = 12, .elems = &data.elems[i * data.cols] },
+      { .rows = 12, .cols = 12, .elems = &data.elems[i * data.cols + 144] },
+    };
+    nn_forward(&nn, x, 2);
+    nn_forward(&plan, x, 2);
+    assert(memcmp(nn_output(&nn)->elems, nn_output(&plan)->elems, sizeof(double) * 10) == 0);
+  }
+
+  // the contexts of nn_evaluate get their own arena
+  nn_metrics_t a, b;
+  omp_set_num_threads(3);
+  nn_evaluate(&nn, &data, &labels, &a);
+  nn_evaluate(&plan, &data, &labels, &b);
+  assert(a.loss == b.loss && a.accuracy == b.accuracy);
+  nn_destroy_metrics(&a);
+  nn_destroy_metrics(&b);
+
+  nn_t ctx = nn_new_context(&plan);
+  assert(ctx.arena != NULL && ctx.arena != plan.arena);
+  nn_destroy(&ctx);
+
+  nn_destroy(&plan);
+  assert(mem_stats().live[MEM_ACTIVATIONS] == before.live[MEM_ACTIVATIONS]);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  nn_destroy(&nn);
+}
+
+static void dist_allreduce_check(enum dist_transport transport) {
+  // a chunk smaller than the buffer and sizes that do not split evenly over the ranks
+  dist_t d = dist_fork(3, 7, transport);
+
+  double x[17];
+  for (size_t i = 0; i < 17; ++i) x[i] = d.rank * 0.1 + i;
+  dist_allreduce(&d, x, 17);
+  for (size_t i = 0; i < 17; ++i) {
+    assert(fabs(x[i] - (0.3 + 3.0 * i)) <= 1e-12);
+  }
+
+  double y[10] = { 0 };
+  if (d.rank == 0) for (size_t i = 0; i < 10; ++i) y[i] = i * 0.5;
+  dist_broadcast(&d, y, 10);
+  for (size_t i = 0; i < 10; ++i) {
+    assert(y[i] == i * 0.5);
+  }
+
+  assert(dist_finalize(&d) == 0);
+}
+
+// every rank trains on its shard and ends with the same bits as rank 0
+static void dist_fit_check(enum dist_transport transport, double *out) {
+  srandom(11);
+  nn_t nn = new_nn(6, 1, 1);
+  nn_add_dense_layer(&nn, 12, TANH);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(ADAM));
+  nn_compile(&nn);
+
+  Mat2D data = new_Mat2D(12, 6);
+  Mat2D labels = new_Mat2D(12, 3);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 12; ++i) MAT2D_GET(labels, i, i % 3) = 1.0;
+
+  dist_t d = dist_fork(3, 32, transport);
+  // each rank starts from different weights, nn_set_dist takes rank 0's
+  nn_init_random(&nn, -0.5 - d.rank, 0.5);
+  nn_set_dist(&nn, &d);
+
+  Mat2D x = dist_shard(&d, &data), y = dist_shard(&d, &labels);
+  assert(x.rows == 4 && y.elems == &labels.elems[d.rank * 4 * 3]);
+  for (size_t epoch = 0; epoch < 3; ++epoch) {
+    nn_fit(&nn, &x, &y, 2, 0.05);
+  }
+
+  const size_t n = 6 * 12 + 1 + 12 * 3 + 1;
+  double w[n], w0[n];
+  memcpy(w, nn.layers[1].dl.ws.elems, sizeof(double) * 72);
+  w[72] = nn.layers[1].dl.bias;
+  memcpy(&w[73], nn.layers[2].dl.ws.elems, sizeof(double) * 36);
+  w[109] = nn.layers[2].dl.bias;
+
+  memcpy(w0, w, sizeof(w));
+  dist_broadcast(&d, w0, n);
+  double diff = memcmp(w, w0, sizeof(w)) != 0;
+  dist_allreduce(&d, &diff, 1);
+  assert(diff == 0.0);
+  memcpy(out, w, sizeof(w));
+
+  nn.dist = NULL;
+  nn_destroy(&nn);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  assert(dist_finalize(&d) == 0);
+}
+
+// the separable and batch norm params are summed and stepped like the dense weights, the batch statistics
+// are the ones of every rank's rows
+static void dist_separable_check(enum dist_transport transport) {
+  srandom(12);
+  nn_t nn = new_nn(6, 6, 2);
+  nn_add_depthwise_separable_conv_layer(&nn, 3, 3, 2, 1, 1, TANH);
+  nn_add_batch_norm_layer(&nn);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 2, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(ADAM));
+  nn_compile(&nn);
+
+  Mat2D data = new_Mat2D(8, 72), labels = new_Mat2D(8, 2);
+  random_init_Mat2D(&data, -0.5, 0.5);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 8; ++i) MAT2D_GET(labels, i, i % 2) = 1.0;
+
+  dist_t d = dist_fork(2, 32, transport);
+  nn_init_random(&nn, -0.5 - d.rank, 0.5);
+  nn_set_dist(&nn, &d);
+
+  Mat2D x = dist_shard(&d, &data), y = dist_shard(&d, &labels);
+  for (size_t epoch = 0; epoch < 3; ++epoch) nn_fit(&nn, &x, &y, 2, 0.05);
+
+  // the separable params, then gamma, beta and the running mean and var
+  const size_t n = 2 * 9 + 3 * 2 + 3 + 4 * 3;
+  double p[n], p0[n];
+  memcpy(p, nn.layers[1].sl.params, sizeof(double) * 27);
+  memcpy(&p[27], nn.layers[2].bn.params, sizeof(double) * 6);
+  memcpy(&p[33], nn.layers[2].bn.mean, sizeof(double) * 6);
+  memcpy(p0, p, sizeof(p));
+  dist_broadcast(&d, p0, n);
+  double diff = memcmp(p, p0, sizeof(p)) != 0;
+  dist_allreduce(&d, &diff, 1);
+  assert(diff == 0.0);
+
+  nn.dist = NULL;
+  nn_destroy(&nn);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  assert(dist_finalize(&d) == 0);
+}
+
+void dist_test() {
+  dist_allreduce_check(DIST_SHM);
+  dist_allreduce_check(DIST_SOCKET);
+
+  // reruns are reproducible
+  double a[110], b[110], c[110];
+  dist_fit_check(DIST_SHM, a);
+  dist_fit_check(DIST_SHM, b);
+  dist_fit_check(DIST_SOCKET, c);
+  assert(memcmp(a, b, sizeof(a)) == 0);
+  for (size_t i = 0; i < 110; ++i) {
+    assert(fabs(a[i] - c[i]) <= 1e-9);
+  }
+
+  dist_separable_check(DIST_SHM);
+}
+
+void hogwild_test() {
+  srandom(5);
+  nn_t nn = new_nn(8, 1, 1);
+  nn_add_dense_layer(&nn, 10, TANH);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  // sparse one-hot-ish inputs, feature 7 is never set
+  Mat2D data = new_Mat2D(96, 8);
+  Mat2D labels = new_Mat2D(96, 3);
+  zero_init_Mat2D(&data);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 96; ++i) {
+    MAT2D_GET(data, i, (i % 3) * 2) = 1.0;
+    MAT2D_GET(data, i, 6) = (i % 4) * 0.25;
+    MAT2D_GET(labels, i, i % 3) = 1.0;
+  }
+
+  double unused[10];
+  memcpy(unused, &nn.layers[1].dl.ws.elems[7 * 10], sizeof(unused));
+
+  nn_train_stats_t first = nn_fit_hogwild(&nn, &data, &labels, 0.1, 4), last = first;
+  for (size_t epoch = 0; epoch < 20; ++epoch) {
+    last = nn_fit_hogwild(&nn, &data, &labels, 0.1, 4);
+  }
+
+  assert(first.samples == 96 && last.samples == 96);
+  assert(last.seconds > 0.0 && last.throughput > 0.0);
+  assert(last.loss < first.loss * 0.5);
+  assert(memcmp(unused, &nn.layers[1].dl.ws.elems[7 * 10], sizeof(unused)) == 0);
+
+  nn_metrics_t metrics;
+  nn_evaluate(&nn, &data, &labels, &metrics);
+  assert(metrics.accuracy == 1.0);
+  nn_destroy_metrics(&metrics);
+
+  nn_destroy(&nn);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+}
+
+void numa_test() {
+  assert(topo_nodes() >= 1);
+  assert(topo_current_node() >= 0 && topo_current_node() < topo_nodes());
+  assert(topo_pin_threads(3) == 3);
+
+  srandom(9);
+  nn_t nn = new_nn(6, 6, 1);
+  nn_add_conv2d_layer(&nn, 2, 3, 1, 0, 1, RELU);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_set_numa(&nn, (NumaPolicy) { .pin = 1, .first_touch = 1 });
+  nn_compile(&nn);
+  assert(nn.layers[3].dl.ws.elems[0] == 0.0);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  Mat2D data = new_Mat2D(8, 36);
+  Mat2D labels = new_Mat2D(8, 3);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 8; ++i) MAT2D_GET(labels, i, i % 3) = 1.0;
+
+  // a replica computes the same thing from its own weights
+  size_t weights = mem_stats().live[MEM_WEIGHTS];
+  nn_t r = nn_new_replica(&nn);
+  assert(mem_stats().live[MEM_WEIGHTS] - weights == sizeof(double) * (2 * 9 + 32 * 3) + sizeof(Mat2D) * 2);
+  assert(r.layers[3].dl.ws.elems != nn.layers[3].dl.ws.elems);
+  assert(r.layers[1].cl.kernels != nn.layers[1].cl.kernels);
+  assert(memcmp(r.layers[3].dl.ws.elems, nn.layers[3].dl.ws.elems, sizeof(double) * 32 * 3) == 0);
+  nn_destroy(&r);
+  assert(mem_stats().live[MEM_WEIGHTS] == weights);
+
+  // one replica per node is made up front, evaluating copies the weights into them and allocates none
+  nn_metrics_t shared, replicated;
+  nn_evaluate(&nn, &data, &labels, &shared);
+  nn_set_numa(&nn, (NumaPolicy) { .pin = 1, .first_touch = 1, .replicate = 1 });
+  assert(nn.replicas != NULL && nn.replica_nodes == topo_nodes());
+  assert(nn.replicas[0].layers[3].dl.ws.elems != nn.layers[3].dl.ws.elems);
+  weights = mem_stats().live[MEM_WEIGHTS];
+  nn_evaluate(&nn, &data, &labels, &replicated);
+  assert(shared.loss == replicated.loss);
+  assert(mem_stats().live[MEM_WEIGHTS] == weights);
+  nn_destroy_metrics(&shared);
+  nn_destroy_metrics(&replicated);
+
+  // and they follow the weights
+  for (size_t i = 0; i < 32 * 3; ++i) nn.layers[3].dl.ws.elems[i] *= 0.5;
+  nn.layers[1].cl.kernels[0].elems[4] += 1.0;
+  nn_evaluate(&nn, &data, &labels, &replicated);
+  nn_set_numa(&nn, (NumaPolicy) { 0 });
+  assert(nn.replicas == NULL);
+  nn_evaluate(&nn, &data, &labels, &shared);
+  assert(shared.loss == replicated.loss);
+  nn_destroy_metrics(&shared);
+  nn_destroy_metrics(&replicated);
+
+  nn_destroy(&nn);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+}
+
+static double cross_entropy(nn_t *nn, const Mat2D *x, const double *y) {
+  nn_forward(nn, x, 2);
+  const Mat2D *o = nn_output(nn);
+  double loss = 0.0;
+  for (size_t i = 0; i < o->rows; ++i) loss -= y[i] * log(o->elems[i]);
+  return loss;
+}
+
+void separable_conv_test() {
+  srandom(21);
+  double img[2 * 36];
+  for (size_t i = 0; i < 72; ++i) img[i] = (double) random() / RAND_MAX - 0.5;
+  Mat2D x[2] = { { .cols = 6, .rows = 6, .elems = img }, { .cols = 6, .rows = 6, .elems = &img[36] } };
+
+  // same output as the full convolution with kernel (k, c) = pointwise(k, c) * depthwise(c)
+  nn_t sep = new_nn(6, 6, 2), full = new_nn(6, 6, 2);
+  nn_add_depthwise_separable_conv_layer(&sep, 3, 3, 2, 1, 2, RELU);
+  nn_add_conv2d_layer(&full, 3, 3, 2, 1, 2, RELU);
+  nn_compile(&sep);
+  nn_compile(&full);
+  nn_init_random(&sep, -1.0, 1.0);
+
+  const SeparableConvLayer *sl = &sep.layers[1].sl;
+  for (size_t k = 0; k < 3; ++k) {
+    for (size_t c = 0; c < 2; ++c) {
+      for (size_t i = 0; i < 9; ++i) {
+        full.layers[1].cl.kernels[k * 2 + c].elems[i] = MAT2D_GET(sl->pointwise, k, c) * MAT2D_GET(sl->depthwise, c, i);
+      }
+    }
+    full.layers[1].cl.bias[k] = sl->bias[k];
+  }
+
+  nn_forward(&sep, x, 2);
+  nn_forward(&full, x, 2);
+  for (size_t k = 0; k < 3; ++k) {
+    assert(sl->a[k].rows == 3 && sl->a[k].cols == 3);
+    for (size_t i = 0; i < 9; ++i) {
+      assert(fabs(sl->a[k].elems[i] - full.layers[1].cl.a[k].elems[i]) <= 1e-12);
+    }
+  }
+  nn_destroy(&sep);
+  nn_destroy(&full);
+
+  // backprop through the dense, flatten, pooling and separable layers against finite differences
+  nn_t nn = new_nn(6, 6, 2);
+  nn_add_depthwise_separable_conv_layer(&nn, 3, 3, 2, 1, 1, TANH);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 2, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(ADAM));
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  double y[] = { 0.0, 1.0 };
+  Mat2D label = { .cols = 1, .rows = 2, .elems = y };
+  cross_entropy(&nn, x, y);
+  nn_t g = nn_backprop(&nn, &label);
+
+  double *params = nn.layers[1].sl.params;
+  const size_t n = 2 * 9 + 3 * 2 + 3;
+  for (size_t i = 0; i < n; ++i) {
+    const double p = params[i], eps = 1e-6;
+    params[i] = p + eps;
+    const double up = cross_entropy(&nn, x, y);
+    params[i] = p - eps;
+    const double down = cross_entropy(&nn, x, y);
+    params[i] = p;
+    assert(fabs((up - down) / (2 * eps) - g.layers[1].sl.params[i]) <= 1e-6);
+  }
+  nn_destroy(&g);
+
+  // and nn_fit learns from images
+  Mat2D data = new_Mat2D(8, 72), labels = new_Mat2D(8, 2);
+  random_init_Mat2D(&data, -0.5, 0.5);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 8; ++i) MAT2D_GET(labels, i, i % 2) = 1.0;
+
+  nn_metrics_t before, after;
+  nn_evaluate(&nn, &data, &labels, &before);
+  for (size_t epoch = 0; epoch < 30; ++epoch) nn_fit(&nn, &data, &labels, 1, 0.01);
+  nn_evaluate(&nn, &data, &labels, &after);
+  assert(after.loss < before.loss * 0.5);
+
+  nn_destroy_metrics(&before);
+  nn_destroy_metrics(&after);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+  nn_destroy(&nn);
+}
+
+static void assert_same_output(nn_t *nn, const Mat2D *x, const double *expected) {
+  nn_forward(nn, x, 2);
+  const Mat2D *o = nn_output(nn);
+  for (size_t i = 0; i < o->rows; ++i) assert(fabs(o->elems[i] - expected[i]) < 1e-9);
+}
+
+void autotune_test() {
+  srandom(5);
+  double img[2 * 64];
+  for (size_t i = 0; i < 128; ++i) img[i] = (double) random() / RAND_MAX - 0.5;
+  Mat2D x[2] = { { .cols = 8, .rows = 8, .elems = img }, { .cols = 8, .rows = 8, .elems = &img[64] } };
+
+  nn_t nn = new_nn(8, 8, 2);
+  nn_add_conv2d_layer(&nn, 3, 3, 2, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 5, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  nn_forward(&nn, x, 2);
+  double expected[5];
+  memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+
+  // every kernel computes the same thing
+  nn.layers[1].kc = (KernelChoice) { .algo = ALGO_CONV_IM2COL };
+  nn.layers[4].kc = (KernelChoice) { .algo = ALGO_DENSE_AXPY, .tile = 2, .threads = 1 };
+  assert_same_output(&nn, x, expected);
+  nn.layers[1].kc = (KernelChoice) { .algo = ALGO_DEFAULT, .threads = 1 };
+  nn.layers[4].kc = (KernelChoice) { .algo = ALGO_DENSE_AXPY, .tile = 512 };
+  assert_same_output(&nn, x, expected);
+
+  // the second run finds both layers in the cache
+  char path[] = "/tmp/cnn-tune-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  assert(nn_autotune(&nn, path) == 2);
+  assert(nn.layers[1].kc.algo == ALGO_DEFAULT || nn.layers[1].kc.algo == ALGO_CONV_IM2COL);
+  assert_same_output(&nn, x, expected);
+  KernelChoice conv = nn.layers[1].kc, dense = nn.layers[4].kc;
+  nn.layers[1].kc = nn.layers[4].kc = (KernelChoice) { 0 };
+  assert(nn_autotune(&nn, path) == 0);
+  assert(memcmp(&nn.layers[1].kc, &conv, sizeof(conv)) == 0);
+  assert(memcmp(&nn.layers[4].kc, &dense, sizeof(dense)) == 0);
+
+  // nn_compile tunes the same shapes from the cache
+  nn_t same = new_nn(8, 8, 2);
+  nn_add_conv2d_layer(&same, 3, 3, 2, 1, 1, RELU);
+  nn_add_max_pooling_layer(&same, 2);
+  nn_add_flatten_layer(&same);
+  nn_add_dense_layer(&same, 5, SOFTMAX);
+  nn_set_autotune(&same, path);
+  nn_compile(&same);
+  assert(memcmp(&same.layers[4].kc, &dense, sizeof(dense)) == 0);
+  unlink(path);
+
+  nn_destroy(&same);
+  nn_destroy(&nn);
+}
+
+static nn_t async_checkpoint_nn(void) {
+  nn_t nn = new_nn(36, 1, 1);
+  nn_add_dense_layer(&nn, 8, RELU);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(ADAM));
+  nn_compile(&nn);
+  return nn;
+}
+
+void async_checkpoint_test() {
+  srandom(13);
+  nn_t nn = async_checkpoint_nn();
+  nn_init_random(&nn, -1.0, 1.0);
+
+  Mat2D data = new_Mat2D(10, 36);
+  Mat2D labels = new_Mat2D(10, 3);
+  random_init_Mat2D(&data, 0.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 10; ++i) MAT2D_GET(labels, i, i % 3) = 1.0;
+
+  char path[] = "/tmp/cnn-ckpt-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  nn_set_checkpoint(&nn, path, 3);
+  nn_fit(&nn, &data, &labels, 1, 0.01);
+  nn_checkpoint(&nn);
+  // a snapshot may be replaced by a newer one before it is written, the last one always is
+  const size_t written = nn_checkpoint_wait(&nn);
+  assert(written >= 1 && written <= 4);
+
+  nn_t restored = async_checkpoint_nn();
+  assert(nn_load_checkpoint(&restored, path) == 0);
+  assert(restored.opt.t == nn.opt.t && nn.opt.t == 10);
+  assert(memcmp(restored.layers[1].dl.ws.elems, nn.layers[1].dl.ws.elems, sizeof(double) * 36 * 8) == 0);
+  assert(memcmp(restored.layers[1].dl.v.elems, nn.layers[1].dl.v.elems, sizeof(double) * 36 * 8) == 0);
+  assert(restored.layers[2].dl.bias_m == nn.layers[2].dl.bias_m);
+
+  // the same data from both goes on the same way
+  nn_fit(&nn, &data, &labels, 2, 0.01);
+  nn_fit(&restored, &data, &labels, 2, 0.01);
+  assert(memcmp(restored.layers[2].dl.ws.elems, nn.layers[2].dl.ws.elems, sizeof(double) * 8 * 3) == 0);
+
+  // another network does not load it
+  nn_t other = new_nn(36, 1, 1);
+  nn_add_dense_layer(&other, 8, RELU);
+  nn_add_dense_layer(&other, 3, SOFTMAX);
+  nn_compile(&other);
+  assert(nn_load_checkpoint(&other, path) == -1);
+  nn_destroy(&other);
+
+  // nor do ones with as many doubles laid out for another shape or activation
+  other = new_nn(6, 6, 1);
+  nn_add_flatten_layer(&other);
+  nn_add_dense_layer(&other, 8, RELU);
+  nn_add_dense_layer(&other, 3, SOFTMAX);
+  nn_set_optimizer(&other, nn_optimizer(ADAM));
+  nn_compile(&other);
+  assert(nn_load_checkpoint(&other, path) == -1);
+  nn_destroy(&other);
+
+  other = new_nn(36, 1, 1);
+  nn_add_dense_layer(&other, 8, TANH);
+  nn_add_dense_layer(&other, 3, SOFTMAX);
+  nn_set_optimizer(&other, nn_optimizer(ADAM));
+  nn_compile(&other);
+  assert(nn_load_checkpoint(&other, path) == -1);
+  nn_destroy(&other);
+
+  // a pruned network gets its sparse weights back too, not only the dense ones
+  nn_set_checkpoint(&nn, path, 0);
+  nn_prune(&nn, 0.9);
+  assert(nn.layers[1].dl.sparse != NULL);
+  nn_checkpoint(&nn);
+  nn_checkpoint_wait(&nn);
+  Mat2D x = { .rows = 36, .cols = 1, .elems = data.elems };
+  double expected[3];
+  nn_forward(&nn, &x, 1);
+  memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+  for (size_t epoch = 0; epoch < 5; ++epoch) nn_fit(&nn, &data, &labels, 1, 0.05);
+  assert(nn_load_checkpoint(&nn, path) == 0);
+  nn_forward(&nn, &x, 1);
+  assert(memcmp(nn_output(&nn)->elems, expected, sizeof(expected)) == 0);
+
+  nn_checkpoint_wait(&nn);
+  unlink(path);
+  assert(nn_load_checkpoint(&restored, path) == -1);
+
+  nn_destroy(&restored);
+  nn_destroy(&nn);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+}
+
+static double dense_cross_entropy(nn_t *nn, const Mat2D *x, const double *y) {
+  nn_forward(nn, x, 1);
+  const Mat2D *o = nn_output(nn);
+  double loss = 0.0;
+  for (size_t i = 0; i < o->rows; ++i) loss -= y[i] * log(o->elems[i]);
+  return loss;
+}
+
+// statistics and an affine map far from the identity
+static void batch_norm_scramble(BatchNormLayer *bn) {
+  for (size_t f = 0; f < bn->features; ++f) {
+    bn->gamma[f] = 0.5 + 0.25 * f;
+    bn->beta[f] = 0.1 * f - 0.2;
+    bn->mean[f] = 0.05 * f;
+    bn->var[f] = 0.3 + 0.2 * f;
+  }
+}
+
+static nn_t batch_norm_net(void) {
+  srandom(19);
+  nn_t nn = new_nn(4, 1, 1);
+  nn_add_dense_layer(&nn, 6, RELU);
+  nn_add_batch_norm_layer(&nn);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+  return nn;
+}
+
+// the summed loss of rows from to to of data, with the mean and var of their inputs to the batch norm
+static double batch_norm_loss(nn_t *nn, const Mat2D *data, const Mat2D *labels, size_t from, size_t to) {
+  BatchNormLayer *bn = &nn->layers[2].bn;
+  const size_t n = bn->features;
+  double running[2 * n], mean[n], var[n];
+  memcpy(running, bn->mean, sizeof(running));
+  memset(mean, 0, sizeof(mean));
+  memset(var, 0, sizeof(var));
+
+  for (size_t i = from; i < to; ++i) {
+    Mat2D x = { .rows = data->cols, .cols = 1, .elems = &data->elems[i * data->cols] };
+    nn_forward(nn, &x, 1);
+    for (size_t f = 0; f < n; ++f) {
+      mean[f] += nn->layers[1].dl.a.elems[f] / (to - from);
+      var[f] += nn->layers[1].dl.a.elems[f] * nn->layers[1].dl.a.elems[f] / (to - from);
+    }
+  }
+  for (size_t f = 0; f < n; ++f) {
+    bn->mean[f] = mean[f];
+    bn->var[f] = var[f] - mean[f] * mean[f];
+  }
+
+  double loss = 0.0;
+  for (size_t i = from; i < to; ++i) {
+    Mat2D x = { .rows = data->cols, .cols = 1, .elems = &data->elems[i * data->cols] };
+    loss += dense_cross_entropy(nn, &x, &labels->elems[i * labels->cols]);
+  }
+  memcpy(bn->mean, running, sizeof(running));
+  return loss;
+}
+
+void batch_norm_test() {
+  srandom(17);
+  nn_t nn = new_nn(4, 1, 1);
+  nn_add_dense_layer(&nn, 6, RELU);
+  nn_add_batch_norm_layer(&nn);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+  assert(nn.layers[1].act == LINEAR && nn.layers[2].act == RELU);
+  assert(nn.layers[2].bn.gamma[0] == 1.0 && nn.layers[2].bn.var[0] == 1.0);
+  batch_norm_scramble(&nn.layers[2].bn);
+
+  double in[] = { 0.3, -0.7, 0.9, 0.2 }, label[] = { 0.0, 1.0, 0.0 };
+  Mat2D x = { .rows = 4, .cols = 1, .elems = in }, y = { .rows = 3, .cols = 1, .elems = label };
+
+  // backprop against finite differences, for gamma, beta and the weights before the normalization
+  nn_forward(&nn, &x, 1);
+  nn_t g = nn_backprop(&nn, &y);
+  double *params[] = { &nn.layers[2].bn.gamma[1], &nn.layers[2].bn.beta[4], &nn.layers[1].dl.ws.elems[5] };
+  const double grads[] = { g.layers[2].bn.gamma[1], g.layers[2].bn.beta[4], g.layers[1].dl.ws.elems[5] };
+  for (size_t i = 0; i < 3; ++i) {
+    const double h = 1e-6, p = *params[i];
+    *params[i] = p + h;
+    const double up = dense_cross_entropy(&nn, &x, label);
+    *params[i] = p - h;
+    const double down = dense_cross_entropy(&nn, &x, label);
+    *params[i] = p;
+    assert(fabs((up - down) / (2 * h) - grads[i]) < 1e-6);
+  }
+  nn_destroy(&g);
+
+  // training on batches tracks their statistics and lowers the loss, the steps are after row 0, 4 and 8
+  Mat2D data = new_Mat2D(12, 4);
+  Mat2D labels = new_Mat2D(12, 3);
+  random_init_Mat2D(&data, -1.0, 1.0);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 12; ++i) MAT2D_GET(labels, i, i % 3) = 1.0;
+
+  nn_metrics_t before, after;
+  nn_evaluate(&nn, &data, &labels, &before);
+  for (size_t epoch = 0; epoch < 40; ++epoch) nn_fit(&nn, &data, &labels, 4, 0.05);
+  nn_evaluate(&nn, &data, &labels, &after);
+  assert(after.loss < before.loss);
+  assert(nn.layers[2].bn.seen == 3 * 40 && nn.layers[2].bn.stage == BN_RUNNING);
+  nn_destroy_metrics(&before);
+  nn_destroy_metrics(&after);
+
+  // folded into the weights the network computes the same thing with one layer less
+  double expected[3];
+  nn_forward(&nn, &x, 1);
+  memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+  nn_freeze(&nn);
+  assert(nn.layer_count == 3 && nn.layers[1].act == RELU && nn.layers[1].dl.shift.elems != NULL);
+  nn_forward(&nn, &x, 1);
+  for (size_t i = 0; i < 3; ++i) assert(fabs(nn_output(&nn)->elems[i] - expected[i]) < 1e-12);
+  nn_destroy(&nn);
+
+  // a step of nn_fit against finite differences of the loss of its batch, rows 1 to 4 normalized with
+  // their own mean and var. b takes the step a is left before, the dense bias under the normalization
+  // cancels out
+  const double lr = 0.1;
+  nn_t a = batch_norm_net(), b = batch_norm_net();
+  Mat2D first = { .rows = 1, .cols = 4, .elems = data.elems }, first_label = { .rows = 1, .cols = 3, .elems = labels.elems };
+  Mat2D batch = { .rows = 5, .cols = 4, .elems = data.elems }, batch_labels = { .rows = 5, .cols = 3, .elems = labels.elems };
+  nn_fit(&a, &first, &first_label, 4, lr);
+  nn_fit(&b, &batch, &batch_labels, 4, lr);
+  assert(a.layers[2].bn.seen == 1 && b.layers[2].bn.seen == 2);
+
+  double *ps[] = { &a.layers[2].bn.gamma[1], &a.layers[2].bn.beta[4], &a.layers[1].dl.ws.elems[5], &a.layers[1].dl.bias };
+  const double *stepped[] = { &b.layers[2].bn.gamma[1], &b.layers[2].bn.beta[4], &b.layers[1].dl.ws.elems[5], &b.layers[1].dl.bias };
+  for (size_t i = 0; i < 4; ++i) {
+    const double h = 1e-6, p = *ps[i];
+    *ps[i] = p + h;
+    const double up = batch_norm_loss(&a, &data, &labels, 1, 5);
+    *ps[i] = p - h;
+    const double down = batch_norm_loss(&a, &data, &labels, 1, 5);
+    *ps[i] = p;
+    assert(fabs((up - down) / (2 * h) - (p - *stepped[i]) * 4 / lr) < 1e-6);
+  }
+  assert(fabs(a.layers[1].dl.bias - b.layers[1].dl.bias) < 1e-12);
+  nn_destroy(&a);
+  nn_destroy(&b);
+
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+
+  // conv planes into a fused flatten, on a training and on an inference compile
+  double img[36];
+  for (size_t i = 0; i < 36; ++i) img[i] = (double) random() / RAND_MAX - 0.5;
+  Mat2D image = { .rows = 6, .cols = 6, .elems = img };
+  for (int inference = 0; inference < 2; ++inference) {
+    nn_t conv = new_nn(6, 6, 1);
+    nn_add_conv2d_layer(&conv, 2, 3, 1, 0, 1, TANH);
+    nn_add_batch_norm_layer(&conv);
+    nn_add_flatten_layer(&conv);
+    nn_add_dense_layer(&conv, 3, SOFTMAX);
+    if (inference) nn_compile_inference(&conv);
+    else nn_compile(&conv);
+    nn_init_random(&conv, -1.0, 1.0);
+    batch_norm_scramble(&conv.layers[2].bn);
+
+    nn_forward(&conv, &image, 1);
+    memcpy(expected, nn_output(&conv)->elems, sizeof(expected));
+    nn_freeze(&conv);
+    assert(conv.layer_count == 4 && conv.layers[2].kind == FLATTEN);
+    nn_forward(&conv, &image, 1);
+    for (size_t i = 0; i < 3; ++i) assert(fabs(nn_output(&conv)->elems[i] - expected[i]) < 1e-12);
+    nn_destroy(&conv);
+  }
+}
+
+typedef void (*emitted_forward_t)(const double *, double *);
+
+// builds nn_emit_c's output into a shared object and loads it, the files are gone once it is open
+static emitted_forward_t emit_forward(const nn_t *nn, void **lib) {
+  char src[] = "/tmp/cnn-emit-XXXXXX.c", so[64], cmd[256];
+  int fd = mkstemps(src, 2);
+  assert(fd != -1);
+  close(fd);
+  snprintf(so, sizeof(so), "%.*s.so", (int) strlen(src) - 2, src);
+  assert(nn_emit_c(nn, src) == 0);
+  snprintf(cmd, sizeof(cmd), "cc -O2 -shared -fPIC -o %s %s -lm", so, src);
+  assert(system(cmd) == 0);
+
+  *lib = dlopen(so, RTLD_NOW);
+  unlink(so);
+  unlink(src);
+  assert(*lib != NULL);
+  emitted_forward_t forward = (emitted_forward_t) dlsym(*lib, "cnn_forward");
+  assert(forward != NULL);
+  return forward;
+}
+
+void emit_c_test() {
+  srandom(23);
+  nn_t nn = new_nn(8, 8, 2);
+  nn_add_conv2d_layer(&nn, 3, 3, 2, 1, 1, RELU);
+  nn_add_max_pooling_layer(&nn, 2);
+  nn_add_depthwise_separable_conv_layer(&nn, 4, 3, 3, 0, 1, TANH);
+  nn_add_batch_norm_layer(&nn);
+  nn_add_avg_pooling_layer(&nn, 2);
+  nn_add_flatten_layer(&nn);
+  nn_add_dense_layer(&nn, 5, SIGMOID);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+  batch_norm_scramble(&nn.layers[4].bn);
+
+  void *lib;
+  emitted_forward_t forward = emit_forward(&nn, &lib);
+  const unsigned *in_size = (const unsigned *) dlsym(lib, "cnn_input_size");
+  assert(in_size != NULL && *in_size == 128);
+
+  double in[128], out[3];
+  Mat2D x[2];
+  for (size_t i = 0; i < 128; ++i) in[i] = (double) random() / RAND_MAX - 0.5;
+  for (size_t c = 0; c < 2; ++c) x[c] = (Mat2D) { .rows = 8, .cols = 8, .elems = &in[c * 64] };
+  forward(in, out);
+  nn_forward(&nn, x, 2);
+  for (size_t i = 0; i < 3; ++i) assert(fabs(nn_output(&nn)->elems[i] - out[i]) < 1e-12);
+
+  dlclose(lib);
+  nn_destroy(&nn);
+
+  // a frozen dense network, the folded shift goes into the generated code too
+  nn = new_nn(4, 1, 1);
+  nn_add_dense_layer(&nn, 6, TANH);
+  nn_add_batch_norm_layer(&nn);
+  nn_add_dense_layer(&nn, 2, LINEAR);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+  batch_norm_scramble(&nn.layers[2].bn);
+  nn_freeze(&nn);
+
+  forward = emit_forward(&nn, &lib);
+
+  Mat2D col = { .rows = 4, .cols = 1, .elems = in };
+  forward(in, out);
+  nn_forward(&nn, &col, 1);
+  for (size_t i = 0; i < 2; ++i) assert(fabs(nn_output(&nn)->elems[i] - out[i]) < 1e-12);
+
+  dlclose(lib);
+  nn_destroy(&nn);
+}
+
+typedef struct {
+  const char *path;
+  const double *in, *expected; // 4 and 3 doubles per request
+  size_t requests;
+} serve_client_t;
+
+static void *serve_client(void *arg) {
+  const serve_client_t *cl = (const serve_client_t *) arg;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, cl->path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+
+  for (size_t i = 0; i < cl->requests; ++i) {
+    double out[3];
+    assert(write(fd, &cl->in[i * 4], sizeof(double) * 4) == sizeof(double) * 4);
+    assert(recv(fd, out, sizeof(out), MSG_WAITALL) == sizeof(out));
+    for (size_t j = 0; j < 3; ++j) assert(fabs(out[j] - cl->expected[i * 3 + j]) < 1e-12);
+  }
+
+  close(fd);
+  return NULL;
+}
+
+void serve_test() {
+  srandom(29);
+  nn_t nn = new_nn(4, 1, 1);
+  nn_add_dense_layer(&nn, 8, RELU);
+  nn_add_dense_layer(&nn, 3, SOFTMAX);
+  nn_compile(&nn);
+  nn_init_random(&nn, -1.0, 1.0);
+
+  enum { CLIENTS = 4, REQUESTS = 32 };
+  double in[CLIENTS * REQUESTS * 4], expected[CLIENTS * REQUESTS * 3];
+  for (size_t i = 0; i < CLIENTS * REQUESTS; ++i) {
+    for (size_t j = 0; j < 4; ++j) in[i * 4 + j] = (double) random() / RAND_MAX - 0.5;
+    nn_forward(&nn, &(Mat2D) { .rows = 4, .cols = 1, .elems = &in[i * 4] }, 1);
+    memcpy(&expected[i * 3], nn_output(&nn)->elems, sizeof(double) * 3);
+  }
+
+  // a unique name for the socket
+  char path[] = "/tmp/cnn-serve-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  unlink(path);
+  serve_t *s = serve_open(&nn, path, (serve_config_t) { .max_batch = 8, .max_delay = 0.005, .workers = 2 });
+  assert(s != NULL);
+
+  // concurrent clients, each waiting for its answer before the next request
+  pthread_t threads[CLIENTS];
+  serve_client_t clients[CLIENTS];
+  for (size_t i = 0; i < CLIENTS; ++i) {
+    clients[i] = (serve_client_t) { .path = path, .in = &in[i * REQUESTS * 4], .expected = &expected[i * REQUESTS * 3], .requests = REQUESTS };
+    pthread_create(&threads[i], NULL, serve_client, &clients[i]);
+  }
+  for (size_t i = 0; i < CLIENTS; ++i) pthread_join(threads[i], NULL);
+
+  serve_stats_t st;
+  serve_stats(s, &st);
+  assert(st.requests == CLIENTS * REQUESTS);
+  assert(st.batches >= CLIENTS * REQUESTS / 8 && st.batches < st.requests);
+  assert(st.mean_batch > 1.0 && st.throughput > 0.0);
+  assert(0.0 < st.p50 && st.p50 <= st.p99 && st.p99 <= st.max);
+
+  // a client that goes away halfway through a request leaves the server running
+  serve_client_t last = { .path = path, .in = in, .expected = expected, .requests = 1 };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  assert(write(fd, in, sizeof(double) * 2) == sizeof(double) * 2);
+  close(fd);
+  serve_client(&last);
+
+  serve_close(s);
+  assert(access(path, F_OK) != 0);
+  nn_destroy(&nn);
+}
+
+void flatten_view_test() {
+  srandom(31);
+  double in[18], swapped[18], expected[4];
+  for (size_t i = 0; i < 18; ++i) in[i] = (double) random() / RAND_MAX - 0.5;
+  memcpy(swapped, &in[9], sizeof(double) * 9);
+  memcpy(&swapped[9], in, sizeof(double) * 9);
+
+  for (int inference = 0; inference < 2; ++inference) {
+    nn_t nn = new_nn(3, 3, 2);
+    nn_add_flatten_layer(&nn);
+    nn_add_dense_layer(&nn, 4, TANH);
+    if (inference) nn_compile_inference(&nn);
+    else nn_compile(&nn);
+    nn_init_random(&nn, -1.0, 1.0);
+
+    // planes one after the other are flattened without a copy
+    Mat2D x[2] = { { .cols = 3, .rows = 3, .elems = in }, { .cols = 3, .rows = 3, .elems = &in[9] } };
+    nn_forward(&nn, x, 2);
+    assert(nn_layer_output(&nn.layers[1])->elems == in && nn_layer_output(&nn.layers[1])->rows == 18);
+    memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+
+    // out of order planes are gathered into the flatten buffer
+    x[0].elems = &swapped[9];
+    x[1].elems = swapped;
+    nn_forward(&nn, x, 2);
+    assert(nn_layer_output(&nn.layers[1])->elems != swapped && nn_layer_output(&nn.layers[1])->elems != &swapped[9]);
+    assert(memcmp(nn_output(&nn)->elems, expected, sizeof(expected)) == 0);
+
+    // the rows nn_evaluate hands out are views too
+    Mat2D data = { .rows = 1, .cols = 18, .elems = in }, labels = new_Mat2D(1, 4);
+    zero_init_Mat2D(&labels);
+    nn_metrics_t metrics;
+    nn_evaluate(&nn, &data, &labels, &metrics);
+    double loss = 0.0;
+    for (size_t i = 0; i < 4; ++i) loss += expected[i] * expected[i];
+    assert(fabs(metrics.loss - loss / 4) < 1e-12);
+    nn_destroy_metrics(&metrics);
+    destroy_Mat2D(&labels);
+    nn_destroy(&nn);
+  }
+}
+
+void global_avg_pool_test() {
+  srandom(37);
+  double img[2 * 36];
+  for (size_t i = 0; i < 72; ++i) img[i] = (double) random() / RAND_MAX - 0.5;
+  Mat2D x[2] = { { .cols = 6, .rows = 6, .elems = img }, { .cols = 6, .rows = 6, .elems = &img[36] } };
+
+  // overlapping windows are not fused into the conv, they pool the planes it wrote
+  double expected[2], out[2];
+  for (int inference = 0; inference < 2; ++inference) {
+    nn_t nn = new_nn(6, 6, 2);
+    nn_add_conv2d_layer(&nn, 3, 3, 2, 1, 1, TANH);
+    nn_add_strided_pooling_layer(&nn, MAX_POOL, 3, 2);
+    nn_add_global_avg_pooling_layer(&nn);
+    nn_add_dense_layer(&nn, 2, SOFTMAX);
+    if (inference) nn_compile_inference(&nn);
+    else nn_compile(&nn);
+    srandom(41);
+    nn_init_random(&nn, -1.0, 1.0);
+    assert(!(nn.layers[2].fusion & FUSED) && nn.layers[2].pl.a[0].rows == 2 && nn.layers[2].pl.a[0].cols == 2);
+    assert(nn.layers[3].gp.a.rows == 3);
+    nn_forward(&nn, x, 2);
+
+    // the planned network keeps the global pooling column in the arena and gives the same output
+    if (inference) {
+      for (size_t i = 0; i < 2; ++i) assert(nn_output(&nn)->elems[i] == expected[i]);
+      nn_destroy(&nn);
+      continue;
+    }
+    memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+
+    Mat2D pooled = new_Mat2D(2, 2);
+    for (size_t k = 0; k < 3; ++k) {
+      max_pooling2D(&nn.layers[1].cl.a[k], &pooled, 3, 2);
+      double mean = 0.0;
+      for (size_t i = 0; i < 4; ++i) {
+        assert(pooled.elems[i] == nn.layers[2].pl.a[k].elems[i]);
+        mean += pooled.elems[i] / 4;
+      }
+      assert(fabs(nn.layers[3].gp.a.elems[k] - mean) <= 1e-12);
+    }
+    destroy_Mat2D(&pooled);
+    nn_destroy(&nn);
+  }
+
+  // backprop through the dense, global pooling and separable layers against finite differences
+  nn_t nn = new_nn(6, 6, 2);
+  nn_add_depthwise_separable_conv_layer(&nn, 3, 3, 2, 1, 1, TANH);
+  nn_add_global_avg_pooling_layer(&nn);
+  nn_add_dense_layer(&nn, 2, SOFTMAX);
+  nn_set_optimizer(&nn, nn_optimizer(ADAM));
+  nn_compile(&nn);
+  nn_init_random(&nn, -0.5, 0.5);
+
+  double y[] = { 0.0, 1.0 };
+  Mat2D label = { .cols = 1, .rows = 2, .elems = y };
+  cross_entropy(&nn, x, y);
+  nn_t g = nn_backprop(&nn, &label);
+
+  double *params = nn.layers[1].sl.params;
+  const size_t n = 2 * 9 + 3 * 2 + 3;
+  for (size_t i = 0; i < n; ++i) {
+    const double p = params[i], eps = 1e-6;
+    params[i] = p + eps;
+    const double up = cross_entropy(&nn, x, y);
+    params[i] = p - eps;
+    const double down = cross_entropy(&nn, x, y);
+    params[i] = p;
+    assert(fabs((up - down) / (2 * eps) - g.layers[1].sl.params[i]) <= 1e-6);
+  }
+  nn_destroy(&g);
+
+  Mat2D data = new_Mat2D(8, 72), labels = new_Mat2D(8, 2);
+  random_init_Mat2D(&data, -0.5, 0.5);
+  zero_init_Mat2D(&labels);
+  for (size_t i = 0; i < 8; ++i) MAT2D_GET(labels, i, i % 2) = 1.0;
+
+  nn_metrics_t before, after;
+  nn_evaluate(&nn, &data, &labels, &before);
+  for (size_t epoch = 0; epoch < 50; ++epoch) nn_fit(&nn, &data, &labels, 1, 0.01);
+  nn_evaluate(&nn, &data, &labels, &after);
+  assert(after.loss < before.loss);
+
+  nn_destroy_metrics(&before);
+  nn_destroy_metrics(&after);
+  destroy_Mat2D(&data);
+  destroy_Mat2D(&labels);
+
+  // the generated code pools the same way
+  nn_forward(&nn, x, 2);
+  memcpy(expected, nn_output(&nn)->elems, sizeof(expected));
+
+  void *lib;
+  emitted_forward_t forward = emit_forward(&nn, &lib);
+  forward(img, out);
+  for (size_t i = 0; i < 2; ++i) assert(fabs(expected[i] - out[i]) < 1e-12);
+
+  dlclose(lib);
+  nn_destroy(&nn);
+}
+
 int main(void) {
-  test_t tests[] = {forward_test, backprop_test, fit_test, compile_test, conv_forward_test};
-  run_tests(tests, 5);
+  test_t tests[] = {
+    forward_test,
+    backprop_test,
+    fit_test,
+    compile_test,
+    conv_forward_test,
+    fusion_test,
+    profile_test,
+    memory_test,
+    evaluate_test,
+    conv_context_test,
+    quantize_test,
+    conv_quantize_test,
+    optimizer_test,
+    prune_test,
+    half_weights_test,
+    checkpoint_test,
+    inference_plan_test,
+    dist_test,
+    hogwild_test,
+    numa_test,
+    separable_conv_test,
+    autotune_test,
+    async_checkpoint_test,
+    batch_norm_test,
+    emit_c_test,
+    serve_test,
+    flatten_view_test,
+    global_avg_pool_test,
+  };
+  run_tests(tests, 28);
   return 0;
 }
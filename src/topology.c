@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "topology.h"
+#include <assert.h>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// from linux/mempolicy.h
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+static int node_count = 1;
+static int cpu_node[CPU_SETSIZE];
+static pthread_once_t loaded = PTHREAD_ONCE_INIT;
+
+// calls f on every id of a sysfs list like "0-3,8,10-11", returns the highest one or -1
+static int parse_list(const char *path, void (*f)(int id, int arg), int arg) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+
+  int max = -1, first, last;
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+    int c = fgetc(file);
+    if (c == '-') {
+      if (fscanf(file, "%d", &last) != 1) break;
+      c = fgetc(file);
+    }
+    for (int id = first; id <= last && id < CPU_SETSIZE; ++id) {
+      if (f) f(id, arg);
+      if (id > max) max = id;
+    }
+    if (c != ',') break;
+  }
+
+  fclose(file);
+  return max;
+}
+
+static void set_cpu_node(int cpu, int node) {
+  cpu_node[cpu] = node;
+}
+
+static void load(void) {
+  int max = parse_list("/sys/devices/system/node/online", NULL, 0);
+  if (max < 0) return;
+  assert(max < 64 && "topo_bind takes a single word node mask");
+
+  node_count = max + 1;
+  for (int node = 0; node < node_count; ++node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    parse_list(path, set_cpu_node, node);
+  }
+}
+
+int topo_nodes(void) {
+  pthread_once(&loaded, load);
+  return node_count;
+}
+
+int topo_cpu_node(int cpu) {
+  pthread_once(&loaded, load);
+  return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+int topo_current_node(void) {
+  return topo_cpu_node(sched_getcpu());
+}
+
+int topo_pin_threads(int threads) {
+  cpu_set_t allowed;
+  int order[CPU_SETSIZE], n = 0;
+
+  int err = sched_getaffinity(0, sizeof(allowed), &allowed);
+  assert(err == 0 && "could not read the allowed cpus");
+  for (int node = 0; node < topo_nodes(); ++node) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed) && topo_cpu_node(cpu) == node) order[n++] = cpu;
+    }
+  }
+  assert(n > 0);
+
+  int pinned = 0;
+  #pragma omp parallel num_threads(threads > 0 ? threads : omp_get_max_threads()) reduction(+:pinned)
+  {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(order[omp_get_thread_num() % n], &one);
+    pinned += pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+  }
+
+  return pinned;
+}
+
+int topo_bind(void *p, size_t bytes, int node) {
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = ((uintptr_t) p + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t) p + bytes) & ~(page - 1);
+  if (end <= begin) return 0;
+
+  unsigned long mask = 1UL << node;
+  return syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE) == 0 ? 0 : -1;
+}